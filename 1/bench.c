@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcoro.h"
+
+/**
+ * Benchmark of the coroutine creation, switch, and wait cost, and
+ * of the memory per coroutine. Build it with 'make bench' and
+ * 'make bench_signals' to compare the backends. The results can
+ * be printed as text, CSV, or JSON to be compared between the
+ * library revisions:
+ *
+ * $> ./bench -f csv > before.csv
+ */
+
+enum {
+	/**
+	 * Coroutines are created in batches. Otherwise the number
+	 * of simultaneously existing stacks is limited by memory
+	 * and by the number of mappings.
+	 */
+	BENCH_BATCH = 1000,
+	BENCH_CREATE_COUNT = 100 * 1000,
+	BENCH_SWITCH_COUNT = 10 * 1000 * 1000,
+	BENCH_SWITCH_MIN_PER_CORO = 10,
+	BENCH_YIELD_ROUND_TRIPS = 1000 * 1000,
+	BENCH_WAIT_MIN_CALLS = 100 * 1000,
+	BENCH_MEM_COROS = 1000,
+	BENCH_MT_COROS = 1000,
+	BENCH_WORK_PER_YIELD = 100,
+	BENCH_QUANTUM_COROS = 10,
+	BENCH_QUANTUM_CHECKS = 10 * 1000 * 1000,
+	BENCH_QUANTUM_NS = 100 * 1000,
+	BENCH_POOL_SIZE = 16,
+	BENCH_MAX_RESULTS = 128,
+};
+
+enum bench_format {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_CSV,
+	BENCH_FORMAT_JSON,
+};
+
+/**
+ * One measured value. @a param is the parameter the value depends
+ * on, like a coroutine count, or 0.
+ */
+struct bench_result {
+	const char *name;
+	long param;
+	double value;
+	const char *unit;
+};
+
+static struct bench_result bench_results[BENCH_MAX_RESULTS];
+static int bench_result_count = 0;
+
+#ifdef LIBCORO_USE_SIGNALS
+static const char *bench_backend = "signals";
+#else
+static const char *bench_backend = "default";
+#endif
+
+static void
+bench_result(const char *name, long param, double value, const char *unit)
+{
+	if (bench_result_count == BENCH_MAX_RESULTS)
+		abort();
+	struct bench_result *r = &bench_results[bench_result_count++];
+	r->name = name;
+	r->param = param;
+	r->value = value;
+	r->unit = unit;
+}
+
+static void
+bench_results_print(enum bench_format format)
+{
+	switch (format) {
+	case BENCH_FORMAT_TEXT:
+		printf("backend: %s\n", bench_backend);
+		for (int i = 0; i < bench_result_count; ++i) {
+			struct bench_result *r = &bench_results[i];
+			printf("%-16s %8ld %14.1f %s\n", r->name, r->param,
+			       r->value, r->unit);
+		}
+		break;
+	case BENCH_FORMAT_CSV:
+		printf("backend,name,param,value,unit\n");
+		for (int i = 0; i < bench_result_count; ++i) {
+			struct bench_result *r = &bench_results[i];
+			printf("%s,%s,%ld,%.3f,%s\n", bench_backend, r->name,
+			       r->param, r->value, r->unit);
+		}
+		break;
+	case BENCH_FORMAT_JSON:
+		printf("{\"backend\": \"%s\", \"results\": [\n",
+		       bench_backend);
+		for (int i = 0; i < bench_result_count; ++i) {
+			struct bench_result *r = &bench_results[i];
+			printf("  {\"name\": \"%s\", \"param\": %ld, "
+			       "\"value\": %.3f, \"unit\": \"%s\"}%s\n",
+			       r->name, r->param, r->value, r->unit,
+			       i + 1 < bench_result_count ? "," : "");
+		}
+		printf("]}\n");
+		break;
+	}
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_empty_f(void *arg)
+{
+	return 0;
+}
+
+static int
+bench_yield_f(void *arg)
+{
+	long count = (long) arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+static void
+bench_create(void)
+{
+	double create_time = 0;
+	double start = bench_now();
+	for (int done = 0; done < BENCH_CREATE_COUNT; done += BENCH_BATCH) {
+		double batch_start = bench_now();
+		for (int i = 0; i < BENCH_BATCH; ++i)
+			coro_new(bench_empty_f, NULL);
+		create_time += bench_now() - batch_start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	double total_time = bench_now() - start;
+	bench_result("create", 0, BENCH_CREATE_COUNT / create_time,
+		     "coro/sec");
+	bench_result("create_delete", 0, BENCH_CREATE_COUNT / total_time,
+		     "coro/sec");
+}
+
+/**
+ * Many tiny jobs run by a coroutine pool, compared to a coroutine
+ * per job.
+ */
+static void
+bench_pool(void)
+{
+	double start = bench_now();
+	struct coro_pool *p = coro_pool_new(BENCH_POOL_SIZE);
+	for (int i = 0; i < BENCH_CREATE_COUNT; ++i)
+		coro_pool_submit(p, bench_empty_f, NULL);
+	coro_pool_delete(p);
+	double total_time = bench_now() - start;
+	bench_result("pool_job", BENCH_POOL_SIZE,
+		     BENCH_CREATE_COUNT / total_time, "job/sec");
+}
+
+/**
+ * Each coroutine stack is 2 mappings - the stack and its guard.
+ * So the number of coroutines existing at once is limited.
+ */
+static int
+bench_max_coro_count(void)
+{
+	int max_map_count = 65530;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%d", &max_map_count) != 1)
+			max_map_count = 65530;
+		fclose(f);
+	}
+	/* Leave some mappings for the libraries and the heap. */
+	return max_map_count / 2 - 1000;
+}
+
+/**
+ * Measure switch cost with @a coro_count coroutines yielding in
+ * a round. It should not depend on the coroutine count.
+ */
+static void
+bench_switch(const char *name, int coro_count)
+{
+	if (coro_count > bench_max_coro_count()) {
+		fprintf(stderr, "%s: %d coros - skipped, raise "
+			"vm.max_map_count\n", name, coro_count);
+		return;
+	}
+	long per_coro = BENCH_SWITCH_COUNT / coro_count;
+	if (per_coro < BENCH_SWITCH_MIN_PER_CORO)
+		per_coro = BENCH_SWITCH_MIN_PER_CORO;
+	for (int i = 0; i < coro_count; ++i)
+		coro_new(bench_yield_f, (void *) per_coro);
+	long long switches = 0;
+	double start = bench_now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double total_time = bench_now() - start;
+	bench_result(name, coro_count, total_time * 1e9 / switches,
+		     "ns/switch");
+}
+
+/**
+ * Two coroutines yield to each other. A round trip is a yield
+ * of one and a yield of the other back.
+ */
+static void
+bench_yield_round_trip(void)
+{
+	coro_new(bench_yield_f, (void *) (long) BENCH_YIELD_ROUND_TRIPS);
+	coro_new(bench_yield_f, (void *) (long) BENCH_YIELD_ROUND_TRIPS);
+	double start = bench_now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double total_time = bench_now() - start;
+	bench_result("yield_rtt", 2, total_time * 1e9 /
+		     BENCH_YIELD_ROUND_TRIPS, "ns");
+}
+
+/**
+ * Cost of a coro_sched_wait() call returning a finished coroutine
+ * with @a coro_count coroutines existing. It includes running the
+ * coroutine. It should not depend on the coroutine count.
+ */
+static void
+bench_sched_wait(int coro_count)
+{
+	if (coro_count > bench_max_coro_count()) {
+		fprintf(stderr, "sched_wait: %d coros - skipped, raise "
+			"vm.max_map_count\n", coro_count);
+		return;
+	}
+	int rounds = BENCH_WAIT_MIN_CALLS / coro_count;
+	if (rounds == 0)
+		rounds = 1;
+	double wait_time = 0;
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < coro_count; ++i)
+			coro_new(bench_empty_f, NULL);
+		struct coro **done = (struct coro **)
+			malloc(coro_count * sizeof(done[0]));
+		double start = bench_now();
+		for (int i = 0; i < coro_count; ++i)
+			done[i] = coro_sched_wait();
+		wait_time += bench_now() - start;
+		for (int i = 0; i < coro_count; ++i)
+			coro_delete(done[i]);
+		free(done);
+	}
+	bench_result("sched_wait", coro_count,
+		     wait_time * 1e9 / rounds / coro_count, "ns/call");
+}
+
+static int
+bench_suspend_f(void *arg)
+{
+	/* Touch some of the stack like a usual function would. */
+	volatile char frame[256];
+	frame[0] = 0;
+	coro_suspend();
+	return frame[0];
+}
+
+/** Resident and mapped memory of the process in bytes. */
+static void
+bench_mem_usage(double *rss, double *mapped)
+{
+	long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+			size = resident = 0;
+		fclose(f);
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	*rss = (double) resident * page_size;
+	*mapped = (double) size * page_size;
+}
+
+/**
+ * Memory taken by each of many coroutines, which have started and
+ * are suspended. Mapped memory includes the stacks and the guard
+ * pages, resident is what was touched.
+ */
+static void
+bench_memory(void)
+{
+	double rss1, mapped1, rss2, mapped2;
+	bench_mem_usage(&rss1, &mapped1);
+	struct coro *coros[BENCH_MEM_COROS];
+	for (int i = 0; i < BENCH_MEM_COROS; ++i)
+		coros[i] = coro_new(bench_suspend_f, NULL);
+	/* All are suspended, so nothing is returned. */
+	if (coro_sched_wait() != NULL)
+		abort();
+	bench_mem_usage(&rss2, &mapped2);
+	for (int i = 0; i < BENCH_MEM_COROS; ++i)
+		coro_wakeup(coros[i]);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	bench_result("mem_rss", BENCH_MEM_COROS,
+		     (rss2 - rss1) / BENCH_MEM_COROS, "bytes/coro");
+	bench_result("mem_mapped", BENCH_MEM_COROS,
+		     (mapped2 - mapped1) / BENCH_MEM_COROS, "bytes/coro");
+}
+
+static int
+bench_quantum_f(void *arg)
+{
+	long count = (long) arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield_if_quantum_expired();
+	return 0;
+}
+
+/**
+ * Cost of the time slice check done on each iteration of a hot
+ * loop, compared to a clock_gettime() call. Each coroutine should
+ * get about the same run time.
+ */
+static void
+bench_quantum(void)
+{
+	long per_coro = BENCH_QUANTUM_CHECKS / BENCH_QUANTUM_COROS;
+	coro_set_quantum(BENCH_QUANTUM_NS);
+	for (int i = 0; i < BENCH_QUANTUM_COROS; ++i)
+		coro_new(bench_quantum_f, (void *) per_coro);
+	uint64_t min_run = UINT64_MAX, max_run = 0;
+	double start = bench_now();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		uint64_t run = coro_run_time_ns(c);
+		if (run < min_run)
+			min_run = run;
+		if (run > max_run)
+			max_run = run;
+		coro_delete(c);
+	}
+	double total_time = bench_now() - start;
+	coro_set_quantum(0);
+	coro_set_accounting(false);
+
+	start = bench_now();
+	for (long i = 0; i < BENCH_QUANTUM_CHECKS; ++i)
+		bench_now();
+	double clock_time = bench_now() - start;
+	bench_result("quantum_check", 0,
+		     total_time * 1e9 / BENCH_QUANTUM_CHECKS, "ns");
+	bench_result("clock_gettime", 0,
+		     clock_time * 1e9 / BENCH_QUANTUM_CHECKS, "ns");
+	/* How fair the quanta are. */
+	bench_result("quantum_spread", BENCH_QUANTUM_COROS,
+		     max_run > 0 ? (double) min_run / max_run * 100 : 0,
+		     "%");
+}
+
+static int
+bench_work_f(void *arg)
+{
+	long count = (long) arg;
+	volatile unsigned x = 1;
+	for (long i = 0; i < count; ++i) {
+		for (int j = 0; j < BENCH_WORK_PER_YIELD; ++j)
+			x = x * 1103515245 + 12345;
+		coro_yield();
+	}
+	return 0;
+}
+
+/**
+ * CPU-bound coroutines run by the multi-threaded scheduler. Total
+ * time should drop with the thread count.
+ */
+static void
+bench_mt(int thread_count)
+{
+	if (coro_sched_init_mt(thread_count) != 0) {
+		fprintf(stderr, "mt: not supported\n");
+		return;
+	}
+	long per_coro = BENCH_SWITCH_COUNT / BENCH_MT_COROS / 10;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_MT_COROS; ++i)
+		coro_new(bench_work_f, (void *) per_coro);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double total_time = bench_now() - start;
+	coro_sched_destroy();
+	bench_result("mt", thread_count, total_time * 1000, "ms");
+}
+
+int
+main(int argc, char **argv)
+{
+	enum bench_format format = BENCH_FORMAT_TEXT;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		if (opt == 'f' && strcmp(optarg, "text") == 0) {
+			format = BENCH_FORMAT_TEXT;
+		} else if (opt == 'f' && strcmp(optarg, "csv") == 0) {
+			format = BENCH_FORMAT_CSV;
+		} else if (opt == 'f' && strcmp(optarg, "json") == 0) {
+			format = BENCH_FORMAT_JSON;
+		} else {
+			fprintf(stderr, "Usage: %s [-f text|csv|json]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	coro_sched_init();
+	/* Before the stack cache is filled by the others. */
+	bench_memory();
+	bench_create();
+	bench_pool();
+	bench_yield_round_trip();
+	for (int count = 10; count <= 100 * 1000; count *= 10)
+		bench_switch("switch", count);
+	for (int count = 10; count <= 100 * 1000; count *= 10)
+		bench_sched_wait(count);
+	coro_set_accounting(true);
+	bench_switch("switch_acct", 10);
+	coro_set_accounting(false);
+	bench_quantum();
+	coro_sched_destroy();
+	for (int count = 1; count <= 8; count *= 2)
+		bench_mt(count);
+	bench_results_print(format);
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sorter.h"
+
+/**
+ * Benchmark of the number parsing and printing of the sorter,
+ * compared to fscanf(), strtol() and snprintf(). Takes a file
+ * made by generator.py, or makes the same numbers in memory:
+ *
+ * $> python3 generator.py -f big.txt -c 10000000
+ * $> ./bench_parse big.txt
+ */
+
+enum {
+	BENCH_DEFAULT_COUNT = 10 * 1000 * 1000,
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_report(const char *name, double time, size_t size, size_t count)
+{
+	printf("%-10s %8.1f MB/s %6.2f ns/number\n", name,
+	       size / time / 1024 / 1024, time * 1e9 / count);
+}
+
+/** Text with the same numbers as generator.py makes by default. */
+static char *
+bench_text_new(size_t count, size_t *size)
+{
+	size_t capacity = count * SORT_INT_MAX_LEN;
+	char *mem = (char *) malloc(capacity + 2 * SORT_PARSE_PADDING);
+	char *text = mem + SORT_PARSE_PADDING;
+	char *pos = text;
+	srand(1);
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = ((uint32_t) rand() << 1) ^ rand();
+		pos = sort_itoa(pos, (int) (value & 0x7fffffff));
+		*pos++ = ' ';
+	}
+	*size = pos - text;
+	return mem;
+}
+
+static char *
+bench_text_read(const char *path, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *mem = (char *) malloc(*size + 2 * SORT_PARSE_PADDING);
+	if (fread(mem + SORT_PARSE_PADDING, 1, *size, f) != *size) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	return mem;
+}
+
+static size_t
+bench_parse(const char *name, sort_parse_f parse, const char *text,
+	    size_t size, int *out, size_t capacity)
+{
+	if (parse == NULL) {
+		printf("%-10s not supported\n", name);
+		return 0;
+	}
+	struct sort_parser p;
+	memset(&p, 0, sizeof(p));
+	size_t count = 0;
+	double start = bench_now();
+	/* The last number is ended by a space after the text. */
+	parse(&p, text, size + 1, out, &count, capacity);
+	bench_report(name, bench_now() - start, size, count);
+	return count;
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size;
+	char *mem = argc > 1 ? bench_text_read(argv[1], &size) :
+		    bench_text_new(BENCH_DEFAULT_COUNT, &size);
+	char *text = mem + SORT_PARSE_PADDING;
+	text[size] = ' ';
+	text[size + 1] = 0;
+	/* Numbers are at least 2 bytes with a separator. */
+	size_t capacity = size / 2 + 1;
+	int *out = (int *) malloc(capacity * sizeof(int));
+	int *check = (int *) malloc(capacity * sizeof(int));
+
+	printf("parse:\n");
+	FILE *f = fmemopen(text, size, "r");
+	size_t count = 0;
+	double start = bench_now();
+	while (fscanf(f, "%d", &check[count]) == 1)
+		++count;
+	bench_report("fscanf", bench_now() - start, size, count);
+	fclose(f);
+
+	start = bench_now();
+	char *pos = text;
+	char *end;
+	count = 0;
+	while (true) {
+		long value = strtol(pos, &end, 10);
+		if (end == pos)
+			break;
+		check[count++] = value;
+		pos = end;
+	}
+	bench_report("strtol", bench_now() - start, size, count);
+
+	sort_parse_f parsers[] = {
+		sort_parse_scalar, sort_parse_sse42(), sort_parse_avx2(),
+	};
+	const char *names[] = {"scalar", "sse4.2", "avx2"};
+	for (int i = 0; i < 3; ++i) {
+		size_t n = bench_parse(names[i], parsers[i], text, size, out,
+				       capacity);
+		if (n != 0 && (n != count ||
+			       memcmp(out, check, n * sizeof(int)) != 0)) {
+			printf("%s: wrong result\n", names[i]);
+			return 1;
+		}
+	}
+
+	printf("print:\n");
+	char *buf = (char *) malloc((count + 1) * SORT_INT_MAX_LEN);
+	start = bench_now();
+	pos = buf;
+	for (size_t i = 0; i < count; ++i)
+		pos += snprintf(pos, SORT_INT_MAX_LEN, "%d ", check[i]);
+	bench_report("snprintf", bench_now() - start, pos - buf, count);
+
+	char *(*itoas[])(char *, int) = {sort_itoa_scalar, sort_itoa};
+	const char *itoa_names[] = {"scalar", "simd"};
+	for (int i = 0; i < 2; ++i) {
+		start = bench_now();
+		pos = buf;
+		for (size_t j = 0; j < count; ++j) {
+			pos = itoas[i](pos, check[j]);
+			*pos++ = ' ';
+		}
+		bench_report(itoa_names[i], bench_now() - start, pos - buf,
+			     count);
+	}
+	free(buf);
+	free(check);
+	free(out);
+	free(mem);
+	return 0;
+}
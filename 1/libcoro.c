@@ -1,76 +1,610 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "libcoro.h"
 
+/*
+ * The event loop uses io_uring when it is available in the
+ * kernel headers, unless LIBCORO_NO_IO_URING is defined. If the
+ * running kernel does not allow io_uring, poll() is used.
+ */
+#if defined(__linux__) && ! defined(LIBCORO_NO_IO_URING) && \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LIBCORO_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+/*
+ * Context switch backend is chosen at build time. By default on
+ * x86-64 and aarch64 coroutines are switched by a tiny assembly
+ * routine which saves only callee-saved registers - no syscalls
+ * neither on creation nor on a switch. Define LIBCORO_USE_SIGNALS
+ * to use the portable, but much slower, sigaltstack + sigsetjmp
+ * implementation. It is also used on other architectures.
+ */
+#if ! defined(LIBCORO_USE_SIGNALS) && ! defined(__x86_64__) && \
+    ! defined(__aarch64__)
+#define LIBCORO_USE_SIGNALS
+#endif
+
+/** Intrusive FIFO queue of coroutines. */
+struct coro_queue {
+	struct coro *first;
+	struct coro *last;
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
+#ifdef LIBCORO_USE_SIGNALS
 	/** Last remembered coroutine context. */
 	sigjmp_buf ctx;
+#else
+	/**
+	 * Stack pointer saved by the last switch from this
+	 * coroutine. All the other registers are on the stack.
+	 */
+	void *ctx;
+#endif
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * True, if the coroutine belongs to the library and is
+	 * not returned by coro_sched_wait().
+	 */
+	bool is_internal;
+	/** True, if the coroutine is suspended until a wakeup. */
+	bool is_suspended;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Total time the coroutine was running, in clock ticks. */
+	uint64_t run_ticks;
+	/** When the coroutine was switched in last time. */
+	uint64_t run_start;
+	/**
+	 * A wait queue of a channel, mutex etc, where the
+	 * coroutine is suspended. NULL, if it is not waiting on
+	 * anything.
+	 */
+	struct coro_queue *wait_queue;
+	/**
+	 * Links in a scheduler or a wait queue. A coroutine is
+	 * either running, or suspended, or is in exactly one queue
+	 * - ready, finished, or a wait queue.
+	 */
 	struct coro *next, *prev;
 };
 
+/** A file descriptor waited by the poll() event loop. */
+struct coro_io_fd {
+	/** Waiting coroutine. */
+	struct coro *coro;
+};
+
+struct coro_io_offload;
+
+/** A sleeping coroutine in the timer heap. */
+struct coro_io_timer {
+	/** Wakeup time, CLOCK_MONOTONIC nanoseconds. */
+	uint64_t deadline;
+	/** Sleeping coroutine. */
+	struct coro *coro;
+};
+
+/**
+ * Event loop. It is created on the first I/O request. Coroutines
+ * waiting for I/O are suspended, and the scheduler blocks in the
+ * loop when nobody else is ready.
+ */
+struct coro_io_loop {
+	/** True, if the loop is created. */
+	bool is_inited;
+	/** Number of coroutines waiting for I/O or a timer. */
+	int pending;
+#ifdef LIBCORO_HAVE_IO_URING
+	/** io_uring descriptor, or -1 if poll() is used. */
+	int ring_fd;
+	/** Mapped SQ and CQ rings. */
+	void *ring;
+	size_t ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	unsigned cq_entries;
+	struct io_uring_cqe *cqes;
+	/** Requests added to the SQ, but not yet submitted. */
+	unsigned to_submit;
+	/** Requests submitted, but not completed yet. */
+	unsigned in_flight;
+	/**
+	 * Coroutines waiting for a place in the completion queue.
+	 * So the CQ never overflows.
+	 */
+	struct coro_queue ring_waiters;
+#endif
+	/** poll() fallback: descriptors and their waiters. */
+	struct pollfd *fds;
+	struct coro_io_fd *fd_waiters;
+	int fd_count;
+	int fd_capacity;
+	/**
+	 * poll() fallback: helper threads for the I/O of regular
+	 * files. NULL until the first such I/O.
+	 */
+	struct coro_io_offload *offload;
+	/** poll() fallback: min-heap of sleeping coroutines. */
+	struct coro_io_timer *timers;
+	int timer_count;
+	int timer_capacity;
+	/**
+	 * poll() fallback does a syscall on each check, so not
+	 * blocking checks are done not on each yield.
+	 */
+	int poll_skips;
+};
+
+/**
+ * Check the event loop and wakeup coroutines whose I/O is done.
+ * With @a block wait for at least one event.
+ */
+static void
+coro_io_poll(bool block);
+
+
+enum {
+	/** Default stack size of a coroutine. */
+	CORO_STACK_SIZE = 1024 * 1024,
+	/** How many different stack sizes can be cached. */
+	CORO_STACK_CACHE_CLASSES = 8,
+	/** Maximal number of cached stacks of one size. */
+	CORO_STACK_CACHE_MAX = 1024,
+	/**
+	 * How many most recently freed stacks of one size keep
+	 * their pages. The others are given back to the kernel,
+	 * but keep the address space.
+	 */
+	CORO_STACK_CACHE_HOT = 16,
+};
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * A free stack in the cache. The header is stored in the top of
+ * the stack itself, which is never given back to the kernel.
  */
-static struct coro coro_sched;
+struct coro_stack {
+	struct coro_stack *next;
+	/** Whether the pages below the header are given back. */
+	bool is_released;
+};
+
+/** Free stacks of the same size. */
+struct coro_stack_cache {
+	/** Usable stack size, 0 if the class is not used yet. */
+	size_t size;
+	/** Number of stacks in the list. */
+	int count;
+	/** LIFO list of stacks. The hottest one is the first. */
+	struct coro_stack *list;
+};
+
+struct coro_worker;
+struct coro_mt;
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Scheduler state of a thread. Each thread can have its own
+ * independent scheduler.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+struct coro_thread {
+	/**
+	 * Scheduler is a main coroutine - it catches and returns
+	 * dead ones to a user.
+	 */
+	struct coro sched;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_sched_waiting;
+	/** Which coroutine works at this moment. */
+	struct coro *this_ptr;
+	/** Coroutines ready to run, in the order of execution. */
+	struct coro_queue ready;
+	/** Finished coroutines not yet returned by coro_sched_wait(). */
+	struct coro_queue finished;
+	/** Event loop. */
+	struct coro_io_loop io;
+	/** Cache of free stacks. */
+	struct coro_stack_cache stack_caches[CORO_STACK_CACHE_CLASSES];
+	/**
+	 * Multi-threaded scheduler, if it was created by this
+	 * thread. Then coroutines are run by the workers.
+	 */
+	struct coro_mt *mt;
+	/** Worker, if this thread is a worker of a scheduler. */
+	struct coro_worker *worker;
+#ifdef LIBCORO_USE_SIGNALS
+	/**
+	 * Buffer, used by the coroutine constructor to escape from
+	 * the signal handler back into the constructor to rollback
+	 * sigaltstack etc.
+	 */
+	sigjmp_buf start_point;
+#endif
+};
+
+/** When the quantum of the current coroutine ends, in ticks. */
+static _Thread_local uint64_t coro_quantum_deadline = UINT64_MAX;
+/** Time quantum in clock ticks. 0, if not set. */
+static uint64_t coro_quantum_ticks = 0;
+/** Whether the run time is counted on switches. */
+static bool coro_is_accounting_on = false;
+/** Clock ticks per nanosecond. */
+static double coro_ticks_per_ns = 1;
+static pthread_once_t coro_clock_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct coro_thread coro_thread_storage;
+static _Thread_local struct coro_thread *coro_thread_ptr = NULL;
+static size_t coro_page_size = 0;
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Scheduler state of the current thread. In the multi-threaded
+ * mode a coroutine can continue on another thread after any
+ * switch, but the compiler is free to cache addresses of
+ * thread-local variables across calls. So the state is always
+ * taken from this function, which is never inlined, and is not
+ * kept in variables across switches.
  */
-static sigjmp_buf start_point;
+static __attribute__((noinline)) struct coro_thread *
+coro_thread(void)
+{
+	return coro_thread_ptr;
+}
+
+static inline size_t
+coro_page_round(size_t size)
+{
+	return (size + coro_page_size - 1) & ~(coro_page_size - 1);
+}
 
-/** Add a new coroutine to the beginning of the list. */
+static inline struct coro_stack *
+coro_stack_header(void *stack, size_t size)
+{
+	return (struct coro_stack *) ((char *) stack + size) - 1;
+}
+
+static struct coro_stack_cache *
+coro_stack_cache_find(size_t size)
+{
+	struct coro_thread *t = coro_thread();
+	for (int i = 0; i < CORO_STACK_CACHE_CLASSES; ++i) {
+		struct coro_stack_cache *cache = &t->stack_caches[i];
+		if (cache->size == size)
+			return cache;
+		if (cache->size == 0) {
+			cache->size = size;
+			return cache;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Give pages of an idle stack back to the kernel. The top page
+ * is kept, because it stores the cache header and is the first
+ * one to be touched on reuse.
+ */
 static void
-coro_list_add(struct coro *c)
+coro_stack_release_pages(void *stack, size_t size)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	size -= coro_page_size;
+	if (size == 0)
+		return;
+#ifdef MADV_FREE
+	if (madvise(stack, size, MADV_FREE) == 0)
+		return;
+#endif
+	madvise(stack, size, MADV_DONTNEED);
+}
+
+/**
+ * Allocate a stack of @a size bytes, page aligned. Below the
+ * stack there is a PROT_NONE guard page, so an overflow crashes
+ * right away instead of corrupting neighbour memory. Only touched
+ * pages consume memory.
+ */
+static void *
+coro_stack_new(size_t size)
+{
+	struct coro_stack_cache *cache = coro_stack_cache_find(size);
+	if (cache != NULL && cache->list != NULL) {
+		struct coro_stack *s = cache->list;
+		cache->list = s->next;
+		--cache->count;
+		return (char *) (s + 1) - size;
+	}
+	char *map = mmap(NULL, size + coro_page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	/*
+	 * The guard splits the mapping in two, so each stack costs
+	 * 2 mappings. Their count is limited by vm.max_map_count,
+	 * which has to be raised for more than ~32k coroutines.
+	 */
+	if (mprotect(map, coro_page_size, PROT_NONE) != 0)
+		handle_error();
+	return map + coro_page_size;
 }
 
-/** Remove a coroutine from the list. */
+/** Return a stack into the cache or unmap it. */
 static void
-coro_list_delete(struct coro *c)
+coro_stack_delete(void *stack, size_t size)
+{
+	struct coro_stack_cache *cache = coro_stack_cache_find(size);
+	if (cache == NULL || cache->count >= CORO_STACK_CACHE_MAX) {
+		if (munmap((char *) stack - coro_page_size,
+			   size + coro_page_size) != 0)
+			handle_error();
+		return;
+	}
+	struct coro_stack *s = coro_stack_header(stack, size);
+	s->next = cache->list;
+	s->is_released = false;
+	cache->list = s;
+	++cache->count;
+	if (cache->count <= CORO_STACK_CACHE_HOT)
+		return;
+	/*
+	 * The new stack is the hottest, so the one it pushed out of
+	 * the hot window goes cold. It is released already, if it
+	 * was cold before and came back into the window via pops.
+	 */
+	for (int i = 0; i < CORO_STACK_CACHE_HOT; ++i)
+		s = s->next;
+	if (!s->is_released) {
+		coro_stack_release_pages((char *) (s + 1) - size, size);
+		s->is_released = true;
+	}
+}
+
+#ifndef LIBCORO_USE_SIGNALS
+
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC(name) ".private_extern _" #name "\n"
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC(name) ".hidden " #name "\n"			\
+			    ".type " #name ", @function\n"
+#endif
+
+/**
+ * Save callee-saved registers of the current context on its
+ * stack, store the stack pointer into @a from_sp, and restore the
+ * context saved at @a to_sp. Caller-saved registers are already
+ * spilled by the compiler because it is a normal function call.
+ */
+void
+coro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * First function executed on a new coroutine stack. It takes the
+ * coroutine and its entry point from the registers prepared by
+ * coro_ctx_init() and calls the entry point, which never returns.
+ */
+void
+coro_ctx_trampoline(void);
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".globl " CORO_ASM_SYM(coro_ctx_switch) "\n"
+	CORO_ASM_FUNC(coro_ctx_switch)
+	".p2align 4\n"
+CORO_ASM_SYM(coro_ctx_switch) ":\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	/* SSE and x87 control words are callee-saved too. */
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".globl " CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+	CORO_ASM_FUNC(coro_ctx_trampoline)
+	".p2align 4\n"
+CORO_ASM_SYM(coro_ctx_trampoline) ":\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+);
+
+enum {
+	/**
+	 * Words in a frame saved by coro_ctx_switch(), including
+	 * the return address.
+	 */
+	CORO_CTX_FRAME_WORDS = 8,
+	/** Default MXCSR: all exceptions masked, round to nearest. */
+	CORO_CTX_MXCSR = 0x1F80,
+	/** Default x87 control word. */
+	CORO_CTX_FPUCW = 0x037F,
+};
+
+/**
+ * Prepare a stack so as the first switch to it would jump into
+ * @a entry(@a c). Returns a value to store as the context.
+ */
+static void *
+coro_ctx_init(void *stack, size_t stack_size, void (*entry)(struct coro *),
+	      struct coro *c)
+{
+	uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+	/*
+	 * The trampoline is 'returned' into, and it calls entry
+	 * right away. So after popping the return address the
+	 * stack has to be 16 byte aligned as before any call.
+	 */
+	uint64_t *sp = (uint64_t *) (top - 16) - CORO_CTX_FRAME_WORDS;
+	memset(sp, 0, CORO_CTX_FRAME_WORDS * sizeof(*sp));
+	sp[0] = CORO_CTX_MXCSR | ((uint64_t) CORO_CTX_FPUCW << 32);
+	/* r15, r14. */
+	sp[3] = (uint64_t) entry;	/* r13 */
+	sp[4] = (uint64_t) c;		/* r12 */
+	/* rbx, rbp = 0 to terminate backtraces. */
+	sp[7] = (uint64_t) coro_ctx_trampoline;
+	return sp;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".globl " CORO_ASM_SYM(coro_ctx_switch) "\n"
+	CORO_ASM_FUNC(coro_ctx_switch)
+	".p2align 4\n"
+CORO_ASM_SYM(coro_ctx_switch) ":\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".globl " CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+	CORO_ASM_FUNC(coro_ctx_trampoline)
+	".p2align 4\n"
+CORO_ASM_SYM(coro_ctx_trampoline) ":\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+);
+
+enum {
+	/** Words in a frame saved by coro_ctx_switch(). */
+	CORO_CTX_FRAME_WORDS = 22,
+};
+
+/**
+ * Prepare a stack so as the first switch to it would jump into
+ * @a entry(@a c). Returns a value to store as the context.
+ */
+static void *
+coro_ctx_init(void *stack, size_t stack_size, void (*entry)(struct coro *),
+	      struct coro *c)
+{
+	uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+	uint64_t *sp = (uint64_t *) top - CORO_CTX_FRAME_WORDS;
+	memset(sp, 0, CORO_CTX_FRAME_WORDS * sizeof(*sp));
+	sp[0] = (uint64_t) c;		/* x19 */
+	sp[1] = (uint64_t) entry;	/* x20 */
+	/* x29 = 0 to terminate backtraces. */
+	sp[11] = (uint64_t) coro_ctx_trampoline;	/* x30 */
+	return sp;
+}
+
+#endif /* __aarch64__ */
+
+#endif /* ! LIBCORO_USE_SIGNALS */
+
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+static inline void
+coro_queue_remove(struct coro_queue *q, struct coro *c)
+{
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		q->first = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	else
+		q->last = c->prev;
+	c->next = NULL;
+	c->prev = NULL;
+}
+
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_remove(q, c);
+	return c;
 }
 
 int
@@ -94,151 +628,799 @@ coro_is_finished(const struct coro *c)
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	coro_stack_delete(c->stack, c->stack_size);
 	free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Find how fast the coroutine clock ticks. */
 static void
-coro_yield_to(struct coro *to)
+coro_clock_calibrate(void)
 {
-	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+#if defined(__aarch64__)
+	uint64_t freq;
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	coro_ticks_per_ns = freq / 1e9;
+#elif defined(__x86_64__)
+	uint64_t ns1 = coro_clock_ns(), ticks1 = coro_ticks();
+	uint64_t ns2;
+	do {
+		ns2 = coro_clock_ns();
+	} while (ns2 - ns1 < 1000000);
+	coro_ticks_per_ns = (double) (coro_ticks() - ticks1) / (ns2 - ns1);
+#endif
+}
+
+/**
+ * Start a new time quantum of the current thread at the moment
+ * @a now.
+ */
+static inline void
+coro_quantum_start(uint64_t now)
+{
+	coro_quantum_deadline = coro_quantum_ticks == 0 ? UINT64_MAX :
+				now + coro_quantum_ticks;
 }
 
 void
-coro_yield(void)
+coro_set_accounting(bool is_on)
 {
-	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
-	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+	pthread_once(&coro_clock_once, coro_clock_calibrate);
+	coro_is_accounting_on = is_on || coro_quantum_ticks != 0;
+	struct coro *c = coro_this();
+	if (c != NULL)
+		c->run_start = coro_ticks();
 }
 
 void
-coro_sched_init(void)
+coro_set_quantum(uint64_t ns)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	pthread_once(&coro_clock_once, coro_clock_calibrate);
+	coro_quantum_ticks = ns * coro_ticks_per_ns;
+	if (coro_quantum_ticks == 0 && ns != 0)
+		coro_quantum_ticks = 1;
+	if (ns != 0)
+		coro_set_accounting(true);
+	coro_quantum_start(coro_ticks());
 }
 
-struct coro *
-coro_sched_wait(void)
+uint64_t
+coro_run_time_ns(const struct coro *c)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
-		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
-	}
-	return NULL;
+	pthread_once(&coro_clock_once, coro_clock_calibrate);
+	uint64_t ticks = c->run_ticks;
+	if (coro_is_accounting_on && c == coro_this())
+		ticks += coro_ticks() - c->run_start;
+	return ticks / coro_ticks_per_ns;
 }
 
-struct coro *
-coro_this(void)
+/**
+ * Account the run time of the coroutine being switched out, and
+ * start the time of the one being switched in.
+ */
+static inline void
+coro_account_switch(struct coro *from, struct coro *to)
 {
-	return coro_this_ptr;
+	if (! coro_is_accounting_on)
+		return;
+	uint64_t now = coro_ticks();
+	from->run_ticks += now - from->run_start;
+	to->run_start = now;
+	coro_quantum_start(now);
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Switch the current coroutine to an arbitrary one. @a t is the
+ * scheduler of the current thread.
  */
 static void
-coro_body(int signum)
+coro_yield_to(struct coro_thread *t, struct coro *to)
 {
-	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
-	c->ret = c->func(c->func_arg);
-	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
-		printf("Critical error - no place to return!\n");
-		exit(-1);
+	struct coro *from = t->this_ptr;
+	++from->switch_count;
+	coro_account_switch(from, to);
+#ifdef LIBCORO_USE_SIGNALS
+	if (sigsetjmp(from->ctx, 0) == 0)
+		siglongjmp(to->ctx, 1);
+#else
+	coro_ctx_switch(&from->ctx, to->ctx);
+#endif
+	/* Can be another thread now. */
+	coro_thread()->this_ptr = from;
+}
+
+/**
+ * Multi-threaded scheduler. Worker threads run coroutines from
+ * their own deques and steal from each other when idle.
+ */
+
+/**
+ * Array of a work-stealing deque. When it is full, a twice
+ * bigger copy is created. Thieves can still read the old one, so
+ * it is freed only together with the deque.
+ */
+struct coro_deque_array {
+	/** Capacity, a power of 2. */
+	int64_t size;
+	/** Previous smaller array. */
+	struct coro_deque_array *prev;
+	struct coro *items[];
+};
+
+/**
+ * Work-stealing deque of Chase and Lev. Only the owner pushes to
+ * the bottom. Everyone, including the owner, takes from the top.
+ * So coroutines of a worker run in FIFO order like in the single
+ * thread mode, and thieves take the ones waiting the longest.
+ */
+struct coro_deque {
+	int64_t top;
+	int64_t bottom;
+	struct coro_deque_array *array;
+};
+
+enum {
+	/** Initial capacity of a worker deque. */
+	CORO_DEQUE_SIZE = 64,
+};
+
+static struct coro_deque_array *
+coro_deque_array_new(int64_t size, struct coro_deque_array *prev)
+{
+	struct coro_deque_array *a = (struct coro_deque_array *)
+		malloc(sizeof(*a) + size * sizeof(a->items[0]));
+	if (a == NULL)
+		handle_error();
+	a->size = size;
+	a->prev = prev;
+	return a;
+}
+
+static void
+coro_deque_create(struct coro_deque *d)
+{
+	d->top = 0;
+	d->bottom = 0;
+	d->array = coro_deque_array_new(CORO_DEQUE_SIZE, NULL);
+}
+
+static void
+coro_deque_destroy(struct coro_deque *d)
+{
+	struct coro_deque_array *a = d->array;
+	while (a != NULL) {
+		struct coro_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
 	}
-	siglongjmp(coro_sched.ctx, 1);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+static inline int64_t
+coro_deque_size(struct coro_deque *d)
 {
-	struct coro *c = (struct coro *) malloc(sizeof(*c));
-	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->is_finished = false;
-	c->switch_count = 0;
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	return b - t;
+}
+
+/** Push to the bottom. Only the owner can do that. */
+static void
+coro_deque_push(struct coro_deque *d, struct coro *c)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct coro_deque_array *a = d->array;
+	if (b - t >= a->size) {
+		struct coro_deque_array *new_a =
+			coro_deque_array_new(a->size * 2, a);
+		for (int64_t i = t; i < b; ++i) {
+			new_a->items[i & (new_a->size - 1)] =
+				a->items[i & (a->size - 1)];
+		}
+		__atomic_store_n(&d->array, new_a, __ATOMIC_RELEASE);
+		a = new_a;
+	}
+	__atomic_store_n(&a->items[b & (a->size - 1)], c, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/** Take from the top. Any thread can do that. */
+static struct coro *
+coro_deque_steal(struct coro_deque *d)
+{
+	while (true) {
+		int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+		if (t >= b)
+			return NULL;
+		struct coro_deque_array *a =
+			__atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+		struct coro *c = __atomic_load_n(&a->items[t & (a->size - 1)],
+						 __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			return c;
+	}
+}
+
+/** Worker thread of the multi-threaded scheduler. */
+struct coro_worker {
+	/** Coroutines ready to run on this worker. */
+	struct coro_deque deque;
+	/** Scheduler the worker belongs to. */
+	struct coro_mt *mt;
+	pthread_t thread;
+	/** State of a random generator to choose steal victims. */
+	uint32_t rand;
+} __attribute__((aligned(64)));
+
+struct coro_mt {
+	struct coro_worker *workers;
+	int worker_count;
+	/** Number of idle workers. */
+	int sleeper_count;
+	/**
+	 * Number of coroutines created and not yet returned by
+	 * coro_sched_wait().
 	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
+	long alive_count;
+	/** Number of coroutines in the injected queue. */
+	long injected_count;
+	/** Protects the queues and the stop flag. */
+	pthread_mutex_t mutex;
+	/** Idle workers wait here. */
+	pthread_cond_t worker_cond;
+	/** coro_sched_wait() waits here. */
+	pthread_cond_t wait_cond;
+	/** Coroutines created outside of the workers. */
+	struct coro_queue injected;
+	/** Finished coroutines. */
+	struct coro_queue finished;
+	/** True, if the workers should exit. */
+	bool is_stopped;
+};
+
+/** Wakeup an idle worker, if any, because there is new work. */
+static void
+coro_mt_wakeup_worker(struct coro_mt *mt)
+{
 	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * Pairs with the check of the deques done by a worker
+	 * after it has announced itself idle.
 	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
-	}
-	coro_this_ptr = old_this;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mt->sleeper_count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&mt->mutex);
+	pthread_cond_signal(&mt->worker_cond);
+	pthread_mutex_unlock(&mt->mutex);
+}
+
+/** Push a ready coroutine to the deque of the current worker. */
+static void
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	coro_deque_push(&w->deque, c);
 	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
+	 * One coroutine is taken by the worker itself right away.
+	 * The others can be given to the idle workers.
 	 */
-	if (sigaltstack(NULL, &newst) != 0)
+	if (coro_deque_size(&w->deque) > 1)
+		coro_mt_wakeup_worker(w->mt);
+}
+
+static struct coro *
+coro_mt_pop_injected(struct coro_mt *mt)
+{
+	if (__atomic_load_n(&mt->injected_count, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+	pthread_mutex_lock(&mt->mutex);
+	struct coro *c = coro_queue_pop(&mt->injected);
+	if (c != NULL)
+		__atomic_sub_fetch(&mt->injected_count, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mt->mutex);
+	return c;
+}
+
+static bool
+coro_mt_has_work(struct coro_mt *mt)
+{
+	if (__atomic_load_n(&mt->injected_count, __ATOMIC_ACQUIRE) > 0)
+		return true;
+	for (int i = 0; i < mt->worker_count; ++i) {
+		if (coro_deque_size(&mt->workers[i].deque) > 0)
+			return true;
+	}
+	return false;
+}
+
+/** Try to steal a coroutine from a random other worker. */
+static struct coro *
+coro_worker_steal(struct coro_worker *w)
+{
+	struct coro_mt *mt = w->mt;
+	/* xorshift32. */
+	w->rand ^= w->rand << 13;
+	w->rand ^= w->rand >> 17;
+	w->rand ^= w->rand << 5;
+	int start = w->rand % mt->worker_count;
+	for (int i = 0; i < mt->worker_count; ++i) {
+		struct coro_worker *victim =
+			&mt->workers[(start + i) % mt->worker_count];
+		if (victim == w)
+			continue;
+		struct coro *c = coro_deque_steal(&victim->deque);
+		if (c != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * Sleep until there is new work. Return true, if the worker
+ * should exit instead.
+ */
+static bool
+coro_worker_sleep(struct coro_worker *w)
+{
+	struct coro_mt *mt = w->mt;
+	pthread_mutex_lock(&mt->mutex);
+	__atomic_add_fetch(&mt->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	if (! mt->is_stopped && ! coro_mt_has_work(mt))
+		pthread_cond_wait(&mt->worker_cond, &mt->mutex);
+	__atomic_sub_fetch(&mt->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	bool is_stopped = mt->is_stopped;
+	pthread_mutex_unlock(&mt->mutex);
+	return is_stopped;
+}
+
+/** Find a next coroutine to run. NULL, if the worker is stopped. */
+static struct coro *
+coro_worker_next(struct coro_worker *w)
+{
+	do {
+		struct coro *c = coro_deque_steal(&w->deque);
+		if (c == NULL)
+			c = coro_mt_pop_injected(w->mt);
+		if (c == NULL)
+			c = coro_worker_steal(w);
+		if (c != NULL)
+			return c;
+	} while (! coro_worker_sleep(w));
+	return NULL;
+}
+
+/** Return a finished coroutine to coro_sched_wait(). */
+static void
+coro_mt_finish(struct coro_mt *mt, struct coro *c)
+{
+	pthread_mutex_lock(&mt->mutex);
+	coro_queue_push(&mt->finished, c);
+	pthread_cond_signal(&mt->wait_cond);
+	pthread_mutex_unlock(&mt->mutex);
+}
+
+static void
+coro_thread_init(void);
+
+static void
+coro_thread_destroy(void);
+
+/**
+ * Worker thread main loop. Coroutines switch back here on each
+ * yield, and the worker decides where to put them. It is the
+ * worker who pushes a coroutine into a deque, after its context
+ * is fully saved, so the other workers can't take it too early.
+ */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = (struct coro_worker *) arg;
+	coro_thread_init();
+	struct coro_thread *t = coro_thread();
+	t->worker = w;
+	struct coro *c;
+	while ((c = coro_worker_next(w)) != NULL) {
+		t->is_sched_waiting = true;
+		coro_yield_to(t, c);
+		t->is_sched_waiting = false;
+		if (c->is_finished)
+			coro_mt_finish(w->mt, c);
+		else
+			coro_worker_push(w, c);
+	}
+	coro_thread_destroy();
+	return NULL;
+}
+
+static void
+coro_mt_unsupported(const char *what)
+{
+	printf("Critical error - %s is not supported in the "
+	       "multi-threaded mode\n", what);
+	exit(-1);
+}
+
+void
+coro_yield(void)
+{
+	struct coro_thread *t = coro_thread();
+	struct coro_worker *w = t->worker;
+	if (w != NULL) {
+		/*
+		 * When there is nothing else to do for this
+		 * worker, continue right away.
+		 */
+		if (coro_deque_size(&w->deque) == 0 &&
+		    __atomic_load_n(&w->mt->injected_count,
+				    __ATOMIC_RELAXED) == 0) {
+			++t->this_ptr->switch_count;
+			if (coro_quantum_ticks != 0)
+				coro_quantum_start(coro_ticks());
+			return;
+		}
+		coro_yield_to(t, &t->sched);
+		return;
+	}
+	struct coro *from = t->this_ptr;
+	if (t->io.pending > 0)
+		coro_io_poll(false);
+	struct coro *to = coro_queue_pop(&t->ready);
+	if (to == NULL) {
+		/* Nobody else is ready, continue right away. */
+		++from->switch_count;
+		if (coro_quantum_ticks != 0)
+			coro_quantum_start(coro_ticks());
+		return;
+	}
+	coro_queue_push(&t->ready, from);
+	coro_yield_to(t, to);
+}
+
+/**
+ * Not inlined for the same reason as coro_thread(): the deadline
+ * has to be of the thread, where the coroutine runs now.
+ */
+__attribute__((noinline)) bool
+coro_quantum_is_expired(void)
+{
+	return coro_ticks() >= coro_quantum_deadline;
+}
+
+void
+coro_yield_if_quantum_expired(void)
+{
+	if (coro_quantum_is_expired())
+		coro_yield();
+}
+
+/**
+ * Pick a next coroutine to run when the current one can not
+ * continue. If nobody is ready, the scheduler gets the control.
+ */
+static struct coro *
+coro_sched_next(void)
+{
+	struct coro_thread *t = coro_thread();
+	struct coro *c = coro_queue_pop(&t->ready);
+	return c != NULL ? c : &t->sched;
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_thread *t = coro_thread();
+	if (t->worker != NULL)
+		coro_mt_unsupported("coro_suspend()");
+	t->this_ptr->is_suspended = true;
+	coro_yield_to(t, coro_sched_next());
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	if (! c->is_suspended)
+		return;
+	if (c->wait_queue != NULL) {
+		coro_queue_remove(c->wait_queue, c);
+		c->wait_queue = NULL;
+	}
+	c->is_suspended = false;
+	coro_queue_push(&coro_thread()->ready, c);
+}
+
+/**
+ * Suspend the current coroutine in the wait queue @a q. It is
+ * woken up either via coro_wait_queue_wakeup_first(), or by a
+ * direct coro_wakeup(). So the waiters have to check their
+ * condition again after a wakeup.
+ */
+static void
+coro_wait_queue_wait(struct coro_queue *q)
+{
+	struct coro *c = coro_this();
+	coro_queue_push(q, c);
+	c->wait_queue = q;
+	coro_suspend();
+}
+
+/** Wakeup the oldest waiter of @a q. Return it, or NULL. */
+static struct coro *
+coro_wait_queue_wakeup_first(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_wakeup(c);
+	return c;
+}
+
+static void
+coro_wait_queue_wakeup_all(struct coro_queue *q)
+{
+	while (coro_wait_queue_wakeup_first(q) != NULL);
+}
+
+static void
+coro_io_destroy(void);
+
+static void
+coro_thread_init(void)
+{
+	memset(&coro_thread_storage, 0, sizeof(coro_thread_storage));
+	coro_thread_ptr = &coro_thread_storage;
+	coro_thread_ptr->this_ptr = &coro_thread_ptr->sched;
+}
+
+/** Free the cached stacks and the event loop of the thread. */
+static void
+coro_thread_destroy(void)
+{
+	struct coro_thread *t = coro_thread();
+	for (int i = 0; i < CORO_STACK_CACHE_CLASSES; ++i) {
+		struct coro_stack_cache *cache = &t->stack_caches[i];
+		struct coro_stack *s = cache->list;
+		while (s != NULL) {
+			struct coro_stack *next = s->next;
+			char *stack = (char *) (s + 1) - cache->size;
+			munmap(stack - coro_page_size,
+			       cache->size + coro_page_size);
+			s = next;
+		}
+	}
+	coro_io_destroy();
+	coro_thread_ptr = NULL;
+}
+
+void
+coro_sched_init(void)
+{
+	if (coro_page_size == 0)
+		coro_page_size = sysconf(_SC_PAGESIZE);
+	coro_thread_init();
+}
+
+int
+coro_sched_init_mt(int thread_count)
+{
+	if (thread_count <= 0)
+		return -1;
+#ifdef LIBCORO_USE_SIGNALS
+	/* Coroutine creation via signals is not thread-safe. */
+	return -1;
+#endif
+	coro_sched_init();
+	struct coro_mt *mt = (struct coro_mt *) calloc(1, sizeof(*mt));
+	if (mt == NULL ||
+	    posix_memalign((void **) &mt->workers, 64,
+			   thread_count * sizeof(mt->workers[0])) != 0)
+		handle_error();
+	mt->worker_count = thread_count;
+	pthread_mutex_init(&mt->mutex, NULL);
+	pthread_cond_init(&mt->worker_cond, NULL);
+	pthread_cond_init(&mt->wait_cond, NULL);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &mt->workers[i];
+		coro_deque_create(&w->deque);
+		w->mt = mt;
+		w->rand = i + 1;
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &mt->workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+			handle_error();
+	}
+	coro_thread()->mt = mt;
+	return 0;
+}
+
+void
+coro_sched_destroy(void)
+{
+	struct coro_mt *mt = coro_thread()->mt;
+	if (mt != NULL) {
+		pthread_mutex_lock(&mt->mutex);
+		mt->is_stopped = true;
+		pthread_cond_broadcast(&mt->worker_cond);
+		pthread_mutex_unlock(&mt->mutex);
+		for (int i = 0; i < mt->worker_count; ++i) {
+			pthread_join(mt->workers[i].thread, NULL);
+			coro_deque_destroy(&mt->workers[i].deque);
+		}
+		pthread_cond_destroy(&mt->wait_cond);
+		pthread_cond_destroy(&mt->worker_cond);
+		pthread_mutex_destroy(&mt->mutex);
+		free(mt->workers);
+		free(mt);
+	}
+	coro_thread_destroy();
+}
+
+/** coro_sched_wait() of the multi-threaded scheduler. */
+static struct coro *
+coro_mt_wait(struct coro_mt *mt)
+{
+	pthread_mutex_lock(&mt->mutex);
+	while (mt->finished.first == NULL &&
+	       __atomic_load_n(&mt->alive_count, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&mt->wait_cond, &mt->mutex);
+	struct coro *c = coro_queue_pop(&mt->finished);
+	if (c != NULL)
+		__atomic_sub_fetch(&mt->alive_count, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mt->mutex);
+	return c;
+}
+
+struct coro *
+coro_sched_wait(void)
+{
+	struct coro_thread *t = coro_thread();
+	if (t->mt != NULL)
+		return coro_mt_wait(t->mt);
+	while (true) {
+		struct coro *c = coro_queue_pop(&t->finished);
+		if (c != NULL)
+			return c;
+		c = coro_queue_pop(&t->ready);
+		if (c == NULL) {
+			if (t->io.pending == 0)
+				return NULL;
+			coro_io_poll(true);
+			continue;
+		}
+		/*
+		 * The coroutines switch between each other and get
+		 * back here only when one of them has finished.
+		 */
+		t->is_sched_waiting = true;
+		coro_yield_to(t, c);
+		t->is_sched_waiting = false;
+	}
+}
+
+struct coro *
+coro_this(void)
+{
+	struct coro_thread *t = coro_thread();
+	return t != NULL ? t->this_ptr : NULL;
+}
+
+/**
+ * Coroutine body, common for all the backends. Runs the user
+ * function and returns into the scheduler. It never returns,
+ * because there is no place to return to.
+ */
+static void
+coro_main(struct coro *c)
+{
+	coro_thread()->this_ptr = c;
+	c->ret = c->func(c->func_arg);
+	c->is_finished = true;
+	/* Can be another thread now. */
+	struct coro_thread *t = coro_thread();
+	/* A worker handles finished coroutines itself. */
+	if (t->worker == NULL && ! c->is_internal)
+		coro_queue_push(&t->finished, c);
+	/* Can not return - 'ret' address is invalid already! */
+	if (! t->is_sched_waiting) {
+		printf("Critical error - no place to return!\n");
+		exit(-1);
+	}
+	coro_account_switch(c, &t->sched);
+#ifdef LIBCORO_USE_SIGNALS
+	siglongjmp(t->sched.ctx, 1);
+#else
+	coro_ctx_switch(&c->ctx, t->sched.ctx);
+	abort();
+#endif
+}
+
+#ifdef LIBCORO_USE_SIGNALS
+
+/**
+ * The core part of the coroutines creation - this signal handler
+ * is run on a separate stack using sigaltstack. On an invokation
+ * it remembers its current context and jumps back to the
+ * coroutine constructor. Later the coroutine continues from here.
+ */
+static void
+coro_body(int signum)
+{
+	(void) signum;
+	struct coro_thread *t = coro_thread();
+	struct coro *c = t->this_ptr;
+	t->this_ptr = NULL;
+	/*
+	 * On an invokation jump back to the constructor right
+	 * after remembering the context.
+	 */
+	if (sigsetjmp(c->ctx, 0) == 0)
+		siglongjmp(t->start_point, 1);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finaly start work.
+	 */
+	coro_main(c);
+}
+
+/** Prepare the coroutine context using a signal handler. */
+static void
+coro_ctx_create(struct coro *c, size_t stack_size)
+{
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+		handle_error();
+	/*
+	 * New handler should jump onto a new stack and remember
+	 * that position. Afterwards the stack is disabled and
+	 * becomes dedicated to that single coroutine.
+	 */
+	struct sigaction newsa, oldsa;
+	newsa.sa_handler = coro_body;
+	newsa.sa_flags = SA_ONSTACK;
+	sigemptyset(&newsa.sa_mask);
+	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+		handle_error();
+	/* Create that new stack. */
+	stack_t oldst, newst;
+	newst.ss_sp = c->stack;
+	newst.ss_size = stack_size;
+	newst.ss_flags = 0;
+	if (sigaltstack(&newst, &oldst) != 0)
+		handle_error();
+	/* Jump onto the stack and remember its position. */
+	struct coro_thread *t = coro_thread();
+	struct coro *old_this = t->this_ptr;
+	t->this_ptr = c;
+	sigemptyset(&suss);
+	if (sigsetjmp(t->start_point, 1) == 0) {
+		raise(SIGUSR2);
+		while (t->this_ptr != NULL)
+			sigsuspend(&suss);
+	}
+	t->this_ptr = old_this;
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new coroutine, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
 		handle_error();
 	newst.ss_flags = SS_DISABLE;
 	if (sigaltstack(&newst, NULL) != 0)
@@ -250,8 +1432,1077 @@ coro_new(coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
+}
+
+#else /* ! LIBCORO_USE_SIGNALS */
+
+/**
+ * Prepare the coroutine context by hand. The first switch to it
+ * starts coro_main().
+ */
+static void
+coro_ctx_create(struct coro *c, size_t stack_size)
+{
+	c->ctx = coro_ctx_init(c->stack, stack_size, coro_main, c);
+}
+
+#endif /* ! LIBCORO_USE_SIGNALS */
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_with_stack(func, func_arg, CORO_STACK_SIZE);
+}
+
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size)
+{
+	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	c->ret = 0;
+#ifdef LIBCORO_USE_SIGNALS
+	if (stack_size < SIGSTKSZ)
+		stack_size = SIGSTKSZ;
+#endif
+	/* The top page keeps the cache header, it can't be the guard. */
+	if (stack_size < coro_page_size)
+		stack_size = coro_page_size;
+	stack_size = coro_page_round(stack_size);
+	c->stack = coro_stack_new(stack_size);
+	c->stack_size = stack_size;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->is_finished = false;
+	c->is_internal = false;
+	c->is_suspended = false;
+	c->switch_count = 0;
+	c->run_ticks = 0;
+	c->run_start = 0;
+	c->wait_queue = NULL;
+	coro_ctx_create(c, stack_size);
 
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	struct coro_thread *t = coro_thread();
+	if (t->worker != NULL) {
+		__atomic_add_fetch(&t->worker->mt->alive_count, 1,
+				   __ATOMIC_RELAXED);
+		coro_worker_push(t->worker, c);
+	} else if (t->mt != NULL) {
+		struct coro_mt *mt = t->mt;
+		__atomic_add_fetch(&mt->alive_count, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&mt->mutex);
+		coro_queue_push(&mt->injected, c);
+		__atomic_add_fetch(&mt->injected_count, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&mt->worker_cond);
+		pthread_mutex_unlock(&mt->mutex);
+	} else {
+		coro_queue_push(&t->ready, c);
+	}
 	return c;
 }
+
+/** Mutex for coroutines. */
+struct coro_mutex {
+	/**
+	 * Coroutine owning the mutex. On unlock the ownership is
+	 * handed over to the first waiter directly, so the
+	 * waiters are served in FIFO order.
+	 */
+	struct coro *owner;
+	/** Coroutines waiting for the mutex. */
+	struct coro_queue waiters;
+};
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	return (struct coro_mutex *) calloc(1, sizeof(struct coro_mutex));
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+	free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+	struct coro *c = coro_this();
+	while (m->owner != c) {
+		if (m->owner == NULL)
+			m->owner = c;
+		else
+			coro_wait_queue_wait(&m->waiters);
+	}
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+	m->owner = coro_wait_queue_wakeup_first(&m->waiters);
+}
+
+/** Condition variable for coroutines. */
+struct coro_cond {
+	/** Coroutines waiting for a signal. */
+	struct coro_queue waiters;
+};
+
+struct coro_cond *
+coro_cond_new(void)
+{
+	return (struct coro_cond *) calloc(1, sizeof(struct coro_cond));
+}
+
+void
+coro_cond_delete(struct coro_cond *cond)
+{
+	free(cond);
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m)
+{
+	coro_mutex_unlock(m);
+	coro_wait_queue_wait(&cond->waiters);
+	coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_wait_queue_wakeup_first(&cond->waiters);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_wait_queue_wakeup_all(&cond->waiters);
+}
+
+/** Bounded channel of pointers. */
+struct coro_chan {
+	/** Ring buffer of messages. */
+	void **msgs;
+	/** Capacity of the ring buffer. */
+	size_t capacity;
+	/** Index of the oldest message. */
+	size_t begin;
+	/** Number of messages in the buffer. */
+	size_t count;
+	/** True, if no more messages can be sent. */
+	bool is_closed;
+	/** Coroutines waiting for a free place. */
+	struct coro_queue senders;
+	/** Coroutines waiting for a message. */
+	struct coro_queue receivers;
+};
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+	struct coro_chan *ch = (struct coro_chan *) calloc(1, sizeof(*ch));
+	ch->msgs = (void **) malloc(capacity * sizeof(ch->msgs[0]));
+	ch->capacity = capacity;
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	free(ch->msgs);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	while (ch->count == ch->capacity && ! ch->is_closed)
+		coro_wait_queue_wait(&ch->senders);
+	if (ch->is_closed)
+		return -1;
+	size_t pos = ch->begin + ch->count;
+	if (pos >= ch->capacity)
+		pos -= ch->capacity;
+	ch->msgs[pos] = msg;
+	++ch->count;
+	coro_wait_queue_wakeup_first(&ch->receivers);
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	while (ch->count == 0 && ! ch->is_closed)
+		coro_wait_queue_wait(&ch->receivers);
+	if (ch->count == 0)
+		return -1;
+	*msg = ch->msgs[ch->begin];
+	if (++ch->begin == ch->capacity)
+		ch->begin = 0;
+	--ch->count;
+	coro_wait_queue_wakeup_first(&ch->senders);
+	return 0;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	ch->is_closed = true;
+	coro_wait_queue_wakeup_all(&ch->senders);
+	coro_wait_queue_wakeup_all(&ch->receivers);
+}
+
+/** A job of a coroutine pool. */
+struct coro_pool_job {
+	coro_f func;
+	void *arg;
+};
+
+/** Pool of coroutines running jobs from a queue. */
+struct coro_pool {
+	/** Pool coroutines. */
+	struct coro **coros;
+	int coro_count;
+	/** Number of the pool coroutines not finished yet. */
+	int alive_count;
+	/** Ring buffer of the queued jobs. Grows when full. */
+	struct coro_pool_job *jobs;
+	size_t job_capacity;
+	/** Index of the oldest job. */
+	size_t job_begin;
+	size_t job_count;
+	/** Number of the jobs being run now. */
+	int active_count;
+	/** True, if the pool coroutines have to finish. */
+	bool is_stopped;
+	/** Pool coroutines waiting for a job. */
+	struct coro_queue idle;
+	/** Coroutines waiting in coro_pool_wait(). */
+	struct coro_queue waiters;
+};
+
+static int
+coro_pool_f(void *arg)
+{
+	struct coro_pool *p = (struct coro_pool *) arg;
+	while (true) {
+		while (p->job_count == 0 && ! p->is_stopped)
+			coro_wait_queue_wait(&p->idle);
+		if (p->job_count == 0)
+			break;
+		struct coro_pool_job job = p->jobs[p->job_begin];
+		if (++p->job_begin == p->job_capacity)
+			p->job_begin = 0;
+		--p->job_count;
+		++p->active_count;
+		job.func(job.arg);
+		if (--p->active_count == 0 && p->job_count == 0)
+			coro_wait_queue_wakeup_all(&p->waiters);
+	}
+	if (--p->alive_count == 0)
+		coro_wait_queue_wakeup_all(&p->waiters);
+	return 0;
+}
+
+struct coro_pool *
+coro_pool_new(int coro_count)
+{
+	if (coro_thread()->mt != NULL)
+		coro_mt_unsupported("coro_pool_new()");
+	if (coro_count <= 0)
+		coro_count = 1;
+	struct coro_pool *p = (struct coro_pool *) calloc(1, sizeof(*p));
+	p->coros = (struct coro **) malloc(coro_count * sizeof(p->coros[0]));
+	p->coro_count = coro_count;
+	p->alive_count = coro_count;
+	for (int i = 0; i < coro_count; ++i) {
+		p->coros[i] = coro_new(coro_pool_f, p);
+		p->coros[i]->is_internal = true;
+	}
+	return p;
+}
+
+/**
+ * True, if the pool has nothing to do. After a stop - if all its
+ * coroutines have finished.
+ */
+static inline bool
+coro_pool_is_done(const struct coro_pool *p)
+{
+	if (p->is_stopped)
+		return p->alive_count == 0;
+	return p->job_count == 0 && p->active_count == 0;
+}
+
+/**
+ * Wait for coro_pool_is_done(). The scheduler context can not be
+ * suspended, so it runs the coroutines itself, like
+ * coro_sched_wait() does, but keeps the finished ones.
+ */
+static void
+coro_pool_wait_done(struct coro_pool *p)
+{
+	struct coro_thread *t = coro_thread();
+	if (t->this_ptr != &t->sched) {
+		while (! coro_pool_is_done(p))
+			coro_wait_queue_wait(&p->waiters);
+		return;
+	}
+	while (! coro_pool_is_done(p)) {
+		struct coro *c = coro_queue_pop(&t->ready);
+		if (c == NULL) {
+			/* The jobs wait for something never coming. */
+			if (t->io.pending == 0)
+				return;
+			coro_io_poll(true);
+			continue;
+		}
+		bool was_sched_waiting = t->is_sched_waiting;
+		t->is_sched_waiting = true;
+		coro_yield_to(t, c);
+		t->is_sched_waiting = was_sched_waiting;
+	}
+}
+
+void
+coro_pool_delete(struct coro_pool *p)
+{
+	coro_pool_wait_done(p);
+	p->is_stopped = true;
+	coro_wait_queue_wakeup_all(&p->idle);
+	coro_pool_wait_done(p);
+	for (int i = 0; i < p->coro_count; ++i) {
+		struct coro *c = p->coros[i];
+		if (! c->is_finished) {
+			printf("Critical error - a pool coroutine is stuck\n");
+			exit(-1);
+		}
+		coro_delete(c);
+	}
+	free(p->coros);
+	free(p->jobs);
+	free(p);
+}
+
+void
+coro_pool_submit(struct coro_pool *p, coro_f func, void *arg)
+{
+	if (p->job_count == p->job_capacity) {
+		size_t capacity = p->job_capacity == 0 ? 64 :
+				  p->job_capacity * 2;
+		struct coro_pool_job *jobs = (struct coro_pool_job *)
+			malloc(capacity * sizeof(jobs[0]));
+		for (size_t i = 0; i < p->job_count; ++i) {
+			size_t pos = p->job_begin + i;
+			if (pos >= p->job_capacity)
+				pos -= p->job_capacity;
+			jobs[i] = p->jobs[pos];
+		}
+		free(p->jobs);
+		p->jobs = jobs;
+		p->job_capacity = capacity;
+		p->job_begin = 0;
+	}
+	size_t pos = p->job_begin + p->job_count;
+	if (pos >= p->job_capacity)
+		pos -= p->job_capacity;
+	p->jobs[pos].func = func;
+	p->jobs[pos].arg = arg;
+	++p->job_count;
+	coro_wait_queue_wakeup_first(&p->idle);
+}
+
+void
+coro_pool_wait(struct coro_pool *p)
+{
+	coro_pool_wait_done(p);
+}
+
+enum {
+	/** Size of the io_uring submission queue. */
+	CORO_IO_RING_SIZE = 256,
+	/** Each that many yields check the poll() event loop. */
+	CORO_IO_POLL_INTERVAL = 64,
+	/** Helper threads of the poll() loop for the regular files. */
+	CORO_IO_HELPER_COUNT = 4,
+};
+
+static inline uint64_t
+coro_io_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Check if the I/O can be done via the event loop. Workers of the
+ * multi-threaded scheduler do blocking I/O.
+ */
+static inline bool
+coro_io_is_in_coro(void)
+{
+	struct coro_thread *t = coro_thread();
+	return t != NULL && t->this_ptr != &t->sched && t->worker == NULL;
+}
+
+#ifdef LIBCORO_HAVE_IO_URING
+
+/** A request to io_uring. Lives on the waiting coroutine stack. */
+struct coro_io_req {
+	struct coro *coro;
+	/** Result of the operation, negative errno on an error. */
+	int result;
+	/** Timeout for sleep requests. */
+	struct __kernel_timespec ts;
+};
+
+static int
+coro_io_ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, coro_thread()->io.ring_fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+/**
+ * Try to create io_uring. On failure the loop works via poll().
+ * Current file position reads (IORING_FEAT_RW_CUR_POS) are
+ * required, so as coro_read() would be just like read().
+ */
+static void
+coro_io_ring_create(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	l->ring_fd = -1;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, CORO_IO_RING_SIZE, &p);
+	if (fd < 0)
+		return;
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0 ||
+	    (p.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		close(fd);
+		return;
+	}
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+	char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		munmap(ring, ring_size);
+		close(fd);
+		return;
+	}
+	l->sq_head = (unsigned *) (ring + p.sq_off.head);
+	l->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+	l->sq_mask = *(unsigned *) (ring + p.sq_off.ring_mask);
+	l->sq_entries = p.sq_entries;
+	l->sq_array = (unsigned *) (ring + p.sq_off.array);
+	l->sqes = (struct io_uring_sqe *) sqes;
+	l->cq_head = (unsigned *) (ring + p.cq_off.head);
+	l->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+	l->cq_mask = *(unsigned *) (ring + p.cq_off.ring_mask);
+	l->cq_entries = p.cq_entries;
+	l->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+	l->ring = ring;
+	l->ring_size = ring_size;
+	l->ring_fd = fd;
+}
+
+/** Submit all the queued requests without waiting for them. */
+static void
+coro_io_ring_submit(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	while (l->to_submit > 0) {
+		int rc = coro_io_ring_enter(l->to_submit, 0, 0);
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY)
+				return;
+			handle_error();
+		}
+		l->to_submit -= rc;
+		l->in_flight += rc;
+	}
+}
+
+/**
+ * Get a free submission queue entry. The caller has to be a
+ * coroutine. It waits while the ring is full.
+ */
+static struct io_uring_sqe *
+coro_io_ring_get_sqe(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	unsigned tail;
+	while (true) {
+		if (l->in_flight + l->to_submit >= l->cq_entries) {
+			coro_wait_queue_wait(&l->ring_waiters);
+			continue;
+		}
+		tail = *l->sq_tail;
+		if (tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) <
+		    l->sq_entries)
+			break;
+		coro_io_ring_submit();
+		if (tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) <
+		    l->sq_entries)
+			break;
+		/*
+		 * The kernel took nothing, it is out of resources. They
+		 * are freed by completions, and without any in flight
+		 * the scheduler retries the submission on its poll.
+		 */
+		if (l->in_flight > 0)
+			coro_wait_queue_wait(&l->ring_waiters);
+		else
+			coro_yield();
+	}
+	struct io_uring_sqe *sqe = &l->sqes[tail & l->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/**
+ * Queue the filled SQE, park the current coroutine until it is
+ * completed and return the result.
+ */
+static int
+coro_io_ring_wait(struct io_uring_sqe *sqe, struct coro_io_req *req)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	req->coro = coro_this();
+	sqe->user_data = (uint64_t) (uintptr_t) req;
+	unsigned tail = *l->sq_tail;
+	unsigned idx = tail & l->sq_mask;
+	l->sq_array[idx] = idx;
+	__atomic_store_n(l->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++l->to_submit;
+	++l->pending;
+	coro_suspend();
+	return req->result;
+}
+
+/** Reap completions and wakeup their coroutines. */
+static void
+coro_io_ring_reap(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	unsigned head = *l->cq_head;
+	unsigned tail = __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &l->cqes[head & l->cq_mask];
+		struct coro_io_req *req =
+			(struct coro_io_req *) (uintptr_t) cqe->user_data;
+		req->result = cqe->res;
+		--l->in_flight;
+		--l->pending;
+		coro_wakeup(req->coro);
+		coro_wait_queue_wakeup_first(&l->ring_waiters);
+	}
+	__atomic_store_n(l->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+coro_io_ring_poll(bool block)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	unsigned to_submit = l->to_submit;
+	if (block && l->in_flight + to_submit > 0 &&
+	    *l->cq_head == __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE)) {
+		int rc = coro_io_ring_enter(to_submit, 1,
+					    IORING_ENTER_GETEVENTS);
+		if (rc < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			handle_error();
+		if (rc > 0) {
+			l->to_submit -= rc;
+			l->in_flight += rc;
+		}
+	} else if (to_submit > 0) {
+		coro_io_ring_submit();
+	}
+	coro_io_ring_reap();
+}
+
+static inline ssize_t
+coro_io_ring_result(int rc)
+{
+	if (rc >= 0)
+		return rc;
+	errno = -rc;
+	return -1;
+}
+
+#endif /* LIBCORO_HAVE_IO_URING */
+
+/**
+ * poll() event loop. It is used when io_uring is not available.
+ * A coroutine waits until its descriptor is ready and then does
+ * the I/O itself. Regular files and block devices are always
+ * ready, but their I/O can still block on the disk. So it is done
+ * by helper threads, and the loop polls their notification pipe
+ * together with the descriptors.
+ */
+
+/** I/O of a regular file. Lives on the waiting coroutine stack. */
+struct coro_io_job {
+	struct coro *coro;
+	int fd;
+	void *buf;
+	size_t size;
+	bool is_write;
+	/** Result of the operation, negative errno on an error. */
+	ssize_t result;
+	struct coro_io_job *next;
+};
+
+/** Helper threads of one poll() loop and their queues. */
+struct coro_io_offload {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** FIFO of the jobs to do. */
+	struct coro_io_job *todo_first;
+	struct coro_io_job *todo_last;
+	/** Done jobs, not yet seen by the loop. */
+	struct coro_io_job *done;
+	/**
+	 * A byte is written into it when the done list stops being
+	 * empty. Both ends are not blocking.
+	 */
+	int pipe[2];
+	bool is_stopped;
+	/** Jobs not yet reaped by the loop. Only the loop uses it. */
+	int in_flight;
+	pthread_t threads[CORO_IO_HELPER_COUNT];
+};
+
+/** Make place for one more descriptor and the notification pipe. */
+static void
+coro_io_fd_reserve(struct coro_io_loop *l)
+{
+	if (l->fd_count + 1 < l->fd_capacity)
+		return;
+	int cap = l->fd_capacity == 0 ? 16 : l->fd_capacity * 2;
+	l->fds = realloc(l->fds, cap * sizeof(l->fds[0]));
+	l->fd_waiters = realloc(l->fd_waiters,
+				cap * sizeof(l->fd_waiters[0]));
+	if (l->fds == NULL || l->fd_waiters == NULL)
+		handle_error();
+	l->fd_capacity = cap;
+}
+
+static void
+coro_io_fd_wait(int fd, short events)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	coro_io_fd_reserve(l);
+	struct pollfd *pfd = &l->fds[l->fd_count];
+	pfd->fd = fd;
+	pfd->events = events;
+	pfd->revents = 0;
+	l->fd_waiters[l->fd_count].coro = coro_this();
+	++l->fd_count;
+	++l->pending;
+	coro_suspend();
+}
+
+static void *
+coro_io_helper_f(void *arg)
+{
+	struct coro_io_offload *o = arg;
+	pthread_mutex_lock(&o->mutex);
+	while (true) {
+		struct coro_io_job *job = o->todo_first;
+		if (job == NULL) {
+			if (o->is_stopped)
+				break;
+			pthread_cond_wait(&o->cond, &o->mutex);
+			continue;
+		}
+		o->todo_first = job->next;
+		if (o->todo_first == NULL)
+			o->todo_last = NULL;
+		pthread_mutex_unlock(&o->mutex);
+		ssize_t rc;
+		if (job->is_write)
+			rc = write(job->fd, job->buf, job->size);
+		else
+			rc = read(job->fd, job->buf, job->size);
+		job->result = rc < 0 ? -errno : rc;
+		pthread_mutex_lock(&o->mutex);
+		bool is_first = o->done == NULL;
+		job->next = o->done;
+		o->done = job;
+		if (is_first && write(o->pipe[1], "", 1) < 0) {
+			/* The pipe is full, the loop is woken up anyway. */
+		}
+	}
+	pthread_mutex_unlock(&o->mutex);
+	return NULL;
+}
+
+static struct coro_io_offload *
+coro_io_offload_new(void)
+{
+	struct coro_io_offload *o = calloc(1, sizeof(*o));
+	if (o == NULL || pipe(o->pipe) != 0)
+		handle_error();
+	for (int i = 0; i < 2; ++i) {
+		int flags = fcntl(o->pipe[i], F_GETFL);
+		if (flags < 0 ||
+		    fcntl(o->pipe[i], F_SETFL, flags | O_NONBLOCK) != 0 ||
+		    fcntl(o->pipe[i], F_SETFD, FD_CLOEXEC) != 0)
+			handle_error();
+	}
+	pthread_mutex_init(&o->mutex, NULL);
+	pthread_cond_init(&o->cond, NULL);
+	/* The signals are for the scheduler thread, not the helpers. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (int i = 0; i < CORO_IO_HELPER_COUNT; ++i) {
+		errno = pthread_create(&o->threads[i], NULL,
+				       coro_io_helper_f, o);
+		if (errno != 0)
+			handle_error();
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return o;
+}
+
+static void
+coro_io_offload_delete(struct coro_io_offload *o)
+{
+	pthread_mutex_lock(&o->mutex);
+	o->is_stopped = true;
+	pthread_cond_broadcast(&o->cond);
+	pthread_mutex_unlock(&o->mutex);
+	for (int i = 0; i < CORO_IO_HELPER_COUNT; ++i)
+		pthread_join(o->threads[i], NULL);
+	close(o->pipe[0]);
+	close(o->pipe[1]);
+	pthread_cond_destroy(&o->cond);
+	pthread_mutex_destroy(&o->mutex);
+	free(o);
+}
+
+/** Is the I/O of the descriptor never waited by poll(). */
+static bool
+coro_io_fd_is_file(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 &&
+	       (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+}
+
+/** Do the I/O in a helper thread, and wait for it. */
+static ssize_t
+coro_io_offload(int fd, void *buf, size_t size, bool is_write)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	if (l->offload == NULL)
+		l->offload = coro_io_offload_new();
+	struct coro_io_offload *o = l->offload;
+	struct coro_io_job job;
+	job.coro = coro_this();
+	job.fd = fd;
+	job.buf = buf;
+	job.size = size;
+	job.is_write = is_write;
+	job.next = NULL;
+	pthread_mutex_lock(&o->mutex);
+	if (o->todo_last == NULL)
+		o->todo_first = &job;
+	else
+		o->todo_last->next = &job;
+	o->todo_last = &job;
+	pthread_cond_signal(&o->cond);
+	pthread_mutex_unlock(&o->mutex);
+	++o->in_flight;
+	++l->pending;
+	coro_suspend();
+	if (job.result < 0) {
+		errno = -job.result;
+		return -1;
+	}
+	return job.result;
+}
+
+/** Wakeup the coroutines whose jobs are done. */
+static void
+coro_io_offload_reap(struct coro_io_loop *l)
+{
+	struct coro_io_offload *o = l->offload;
+	/* The pipe goes first, so a byte of a later job is not lost. */
+	char buf[64];
+	while (read(o->pipe[0], buf, sizeof(buf)) > 0);
+	pthread_mutex_lock(&o->mutex);
+	struct coro_io_job *job = o->done;
+	o->done = NULL;
+	pthread_mutex_unlock(&o->mutex);
+	while (job != NULL) {
+		struct coro_io_job *next = job->next;
+		--o->in_flight;
+		--l->pending;
+		coro_wakeup(job->coro);
+		job = next;
+	}
+}
+
+static void
+coro_io_timer_swap(struct coro_io_timer *a, struct coro_io_timer *b)
+{
+	struct coro_io_timer tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+coro_io_timer_wait(uint64_t deadline)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	if (l->timer_count == l->timer_capacity) {
+		int cap = l->timer_capacity == 0 ? 16 : l->timer_capacity * 2;
+		l->timers = realloc(l->timers, cap * sizeof(l->timers[0]));
+		if (l->timers == NULL)
+			handle_error();
+		l->timer_capacity = cap;
+	}
+	int i = l->timer_count++;
+	l->timers[i].deadline = deadline;
+	l->timers[i].coro = coro_this();
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (l->timers[parent].deadline <= l->timers[i].deadline)
+			break;
+		coro_io_timer_swap(&l->timers[parent], &l->timers[i]);
+		i = parent;
+	}
+	++l->pending;
+	coro_suspend();
+}
+
+/** Wakeup the sleepers whose time has come. */
+static void
+coro_io_timer_expire(uint64_t now)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	while (l->timer_count > 0 && l->timers[0].deadline <= now) {
+		coro_wakeup(l->timers[0].coro);
+		--l->pending;
+		l->timers[0] = l->timers[--l->timer_count];
+		int i = 0;
+		while (true) {
+			int min = i, left = 2 * i + 1, right = left + 1;
+			if (left < l->timer_count &&
+			    l->timers[left].deadline < l->timers[min].deadline)
+				min = left;
+			if (right < l->timer_count &&
+			    l->timers[right].deadline < l->timers[min].deadline)
+				min = right;
+			if (min == i)
+				break;
+			coro_io_timer_swap(&l->timers[min], &l->timers[i]);
+			i = min;
+		}
+	}
+}
+
+static void
+coro_io_fd_poll(bool block)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	if (! block && ++l->poll_skips < CORO_IO_POLL_INTERVAL)
+		return;
+	l->poll_skips = 0;
+	int timeout = 0;
+	uint64_t now = 0;
+	if (block) {
+		timeout = -1;
+		if (l->timer_count > 0) {
+			now = coro_io_now();
+			uint64_t deadline = l->timers[0].deadline;
+			timeout = deadline <= now ? 0 :
+				  (deadline - now + 999999) / 1000000;
+		}
+	}
+	/* The notification pipe goes after the descriptors. */
+	int count = l->fd_count;
+	struct coro_io_offload *o = l->offload;
+	if (o != NULL && o->in_flight > 0) {
+		coro_io_fd_reserve(l);
+		l->fds[count].fd = o->pipe[0];
+		l->fds[count].events = POLLIN;
+		l->fds[count].revents = 0;
+		++count;
+	}
+	int rc = 0;
+	if (count > 0 || timeout != 0)
+		rc = poll(l->fds, count, timeout);
+	if (rc < 0 && errno != EINTR)
+		handle_error();
+	if (rc > 0 && count > l->fd_count &&
+	    l->fds[l->fd_count].revents != 0) {
+		--rc;
+		coro_io_offload_reap(l);
+	}
+	for (int i = 0; rc > 0 && i < l->fd_count;) {
+		if (l->fds[i].revents == 0) {
+			++i;
+			continue;
+		}
+		--rc;
+		coro_wakeup(l->fd_waiters[i].coro);
+		--l->pending;
+		--l->fd_count;
+		l->fds[i] = l->fds[l->fd_count];
+		l->fd_waiters[i] = l->fd_waiters[l->fd_count];
+	}
+	if (l->timer_count > 0)
+		coro_io_timer_expire(coro_io_now());
+}
+
+static void
+coro_io_poll(bool block)
+{
+#ifdef LIBCORO_HAVE_IO_URING
+	if (coro_thread()->io.ring_fd >= 0) {
+		coro_io_ring_poll(block);
+		return;
+	}
+#endif
+	coro_io_fd_poll(block);
+}
+
+static void
+coro_io_init(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	if (l->is_inited)
+		return;
+	memset(l, 0, sizeof(*l));
+	l->is_inited = true;
+#ifdef LIBCORO_HAVE_IO_URING
+	coro_io_ring_create();
+#endif
+}
+
+static void
+coro_io_destroy(void)
+{
+	struct coro_io_loop *l = &coro_thread()->io;
+	if (! l->is_inited)
+		return;
+#ifdef LIBCORO_HAVE_IO_URING
+	if (l->ring_fd >= 0) {
+		munmap(l->sqes, l->sq_entries * sizeof(struct io_uring_sqe));
+		munmap(l->ring, l->ring_size);
+		close(l->ring_fd);
+	}
+#endif
+	if (l->offload != NULL)
+		coro_io_offload_delete(l->offload);
+	free(l->fds);
+	free(l->fd_waiters);
+	free(l->timers);
+	memset(l, 0, sizeof(*l));
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	if (! coro_io_is_in_coro())
+		return read(fd, buf, size);
+	coro_io_init();
+#ifdef LIBCORO_HAVE_IO_URING
+	if (coro_thread()->io.ring_fd >= 0) {
+		struct coro_io_req req;
+		struct io_uring_sqe *sqe = coro_io_ring_get_sqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t) (uintptr_t) buf;
+		sqe->len = size;
+		/* Use and advance the current file position. */
+		sqe->off = (uint64_t) -1;
+		return coro_io_ring_result(coro_io_ring_wait(sqe, &req));
+	}
+#endif
+	if (coro_io_fd_is_file(fd))
+		return coro_io_offload(fd, buf, size, false);
+	coro_io_fd_wait(fd, POLLIN);
+	return read(fd, buf, size);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	if (! coro_io_is_in_coro())
+		return write(fd, buf, size);
+	coro_io_init();
+#ifdef LIBCORO_HAVE_IO_URING
+	if (coro_thread()->io.ring_fd >= 0) {
+		struct coro_io_req req;
+		struct io_uring_sqe *sqe = coro_io_ring_get_sqe();
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t) (uintptr_t) buf;
+		sqe->len = size;
+		sqe->off = (uint64_t) -1;
+		return coro_io_ring_result(coro_io_ring_wait(sqe, &req));
+	}
+#endif
+	if (coro_io_fd_is_file(fd))
+		return coro_io_offload(fd, (void *) buf, size, true);
+	coro_io_fd_wait(fd, POLLOUT);
+	return write(fd, buf, size);
+}
+
+void
+coro_sleep(double timeout)
+{
+	if (timeout <= 0) {
+		if (coro_io_is_in_coro())
+			coro_yield();
+		return;
+	}
+	uint64_t ns = (uint64_t) (timeout * 1e9);
+	if (! coro_io_is_in_coro()) {
+		struct timespec ts;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+		return;
+	}
+	coro_io_init();
+#ifdef LIBCORO_HAVE_IO_URING
+	if (coro_thread()->io.ring_fd >= 0) {
+		struct coro_io_req req;
+		req.ts.tv_sec = ns / 1000000000;
+		req.ts.tv_nsec = ns % 1000000000;
+		struct io_uring_sqe *sqe = coro_io_ring_get_sqe();
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t) (uintptr_t) &req.ts;
+		sqe->len = 1;
+		coro_io_ring_wait(sqe, &req);
+		return;
+	}
+#endif
+	coro_io_timer_wait(coro_io_now() + ns);
+}
@@ -1,17 +1,54 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
 
-/** Make current context scheduler. */
+/**
+ * Make current context scheduler. Each thread can have its own
+ * scheduler, independent from the others.
+ */
 void
 coro_sched_init(void);
 
+/**
+ * Make current context a multi-threaded scheduler. Coroutines
+ * created via coro_new() are run by @a thread_count worker
+ * threads, not by the current thread. Each worker has its own
+ * queue and steals coroutines from the others when it is idle. A
+ * coroutine can continue on another thread after any yield, so
+ * it should not keep pointers to thread-local data, including
+ * errno, across yields. coro_sched_wait() blocks until a
+ * coroutine has finished on any worker.
+ *
+ * In this mode coro_suspend() and everything built on it -
+ * mutexes, condition variables, channels - are not supported.
+ * coro_read(), coro_write(), coro_sleep() block the worker.
+ *
+ * @retval 0 Success.
+ * @retval -1 Invalid thread count, or the signal-based backend
+ *     is used, which does not support threads.
+ */
+int
+coro_sched_init_mt(int thread_count);
+
+/**
+ * Destroy the scheduler of the current thread. Stop the worker
+ * threads in the multi-threaded mode, free the cached stacks and
+ * the event loop. All the coroutines have to be finished and
+ * deleted.
+ */
+void
+coro_sched_destroy(void);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines, or all the remaining ones are suspended.
  */
 struct coro *
 coro_sched_wait(void);
@@ -27,6 +64,15 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with a custom stack size. It is rounded
+ * up to the page size. Stacks are reserved, but consume memory
+ * only for touched pages. Stack overflow crashes on a guard page.
+ * Stacks of deleted coroutines are cached for reuse.
+ */
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,6 +80,73 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Time the coroutine has been running, without the time it was
+ * waiting for others or for I/O. It is counted on each switch
+ * while the accounting is on.
+ */
+uint64_t
+coro_run_time_ns(const struct coro *c);
+
+/**
+ * Turn the run time accounting on or off. It costs a clock read
+ * per switch, so it is off by default. A quantum keeps it on. The
+ * setting is process-wide.
+ */
+void
+coro_set_accounting(bool is_on);
+
+/**
+ * Set the time quantum for coro_yield_if_quantum_expired(). Each
+ * coroutine gets a new quantum when it is switched in. 0 means
+ * no quantum, the default. A quantum turns the accounting on. The
+ * setting is process-wide.
+ */
+void
+coro_set_quantum(uint64_t ns);
+
+/**
+ * Coroutine clock. It is a CPU counter when available, so as it
+ * is cheap enough to be read on each iteration of a hot loop.
+ */
+static inline uint64_t
+coro_ticks(void)
+{
+#if defined(__x86_64__)
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/** Switch to another not finished coroutine. */
+void
+coro_yield(void);
+
+/**
+ * Check if the current coroutine has spent its quantum. It is not
+ * inline, because in the multi-threaded mode the coroutine can
+ * move to another thread, and the caller could keep using the
+ * deadline of the old one.
+ */
+bool
+coro_quantum_is_expired(void);
+
+/**
+ * Yield only if the quantum of the current coroutine is spent.
+ * Without a quantum it never yields. No syscalls.
+ */
+void
+coro_yield_if_quantum_expired(void);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
@@ -42,6 +155,173 @@ coro_is_finished(const struct coro *c);
 void
 coro_delete(struct coro *c);
 
-/** Switch to another not finished coroutine. */
+/**
+ * Suspend the current coroutine. It won't be scheduled until
+ * somebody calls coro_wakeup() on it.
+ */
 void
-coro_yield(void);
+coro_suspend(void);
+
+/**
+ * Make a suspended coroutine ready to run. It is put to the end
+ * of the scheduler queue. Does nothing if @a c is not suspended.
+ * It can be called from the scheduler context too.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Synchronization primitives. Waiters are suspended and do not
+ * consume CPU. Functions which can block can be called only from
+ * a coroutine.
+ */
+
+struct coro_mutex;
+struct coro_cond;
+struct coro_chan;
+
+/** Create a new unlocked mutex. */
+struct coro_mutex *
+coro_mutex_new(void);
+
+/** Delete a mutex. It must not be locked nor have waiters. */
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/**
+ * Lock the mutex. If it is locked, then wait. Waiters get the
+ * mutex in the order of arrival.
+ */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Unlock the mutex and pass it to the first waiter if any. */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Create a new condition variable. */
+struct coro_cond *
+coro_cond_new(void);
+
+/** Delete a condition variable. It must not have waiters. */
+void
+coro_cond_delete(struct coro_cond *cond);
+
+/**
+ * Unlock @a m, wait for a signal, and lock @a m again. Spurious
+ * wakeups are possible, so the condition has to be checked in a
+ * loop.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *m);
+
+/** Wakeup one waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wakeup all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/**
+ * Create a new channel of pointers which can store up to
+ * @a capacity messages. 0 capacity is treated as 1.
+ */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+/** Delete a channel. It must not have waiters. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send a message into the channel. If it is full, then wait for
+ * a free place.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message from the channel. If it is empty, then wait
+ * for a message.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and has no more messages.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Close the channel. All the waiters are woken up. Already sent
+ * messages still can be received.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/**
+ * Pool of coroutines running submitted jobs. The coroutines and
+ * their stacks are created once and reused for all the jobs, so a
+ * job costs no allocations. The pool coroutines are never
+ * returned by coro_sched_wait(). Only for the single-threaded
+ * scheduler.
+ */
+
+struct coro_pool;
+
+/** Create a pool of @a coro_count coroutines. */
+struct coro_pool *
+coro_pool_new(int coro_count);
+
+/**
+ * Wait for all the jobs to end, then stop and delete the pool
+ * coroutines and the pool itself.
+ */
+void
+coro_pool_delete(struct coro_pool *p);
+
+/**
+ * Queue a job. It is run by the first free pool coroutine. The
+ * return value of @a func is ignored. Never blocks.
+ */
+void
+coro_pool_submit(struct coro_pool *p, coro_f func, void *arg);
+
+/**
+ * Wait until all the submitted jobs have ended. Can be called
+ * both from a coroutine and from the scheduler context, but not
+ * from a job of the same pool. In the scheduler context the other
+ * coroutines are run too, and the finished ones stay for
+ * coro_sched_wait().
+ */
+void
+coro_pool_wait(struct coro_pool *p);
+
+/**
+ * I/O which does not block the other coroutines. The calling
+ * coroutine is suspended until the operation is done, and the
+ * others keep working. The scheduler waits for the I/O only when
+ * nobody is ready to run. On Linux io_uring is used if the
+ * kernel allows it, otherwise poll(). poll() does not wait for
+ * regular files, so with it their I/O is done by a few helper
+ * threads. Outside of a coroutine these are the usual blocking
+ * calls.
+ */
+
+/**
+ * Same as read(), but does not block other coroutines. Reads
+ * from the current file position.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/**
+ * Same as write(), but does not block other coroutines. Writes
+ * to the current file position.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Sleep for @a timeout seconds letting the others work. */
+void
+coro_sleep(double timeout);
@@ -1,92 +1,269 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "libcoro.h"
+#include "sorter.h"
 
 /**
- * You can compile and run this code using the commands:
+ * Merge sort of files with integers in coroutines. Build and run:
  *
- * $> gcc solution.c libcoro.c
- * $> ./a.out
+ * $> make
+ * $> ./main [-l latency_us] [-c coro_count] [-j thread_count]
+ *           [-m mem_mb] [-t tmp_dir] [-o output] file1.txt ...
+ *
+ * Each of the coroutines takes a next unsorted file until none is
+ * left. With several threads each of them has its own scheduler
+ * and a share of the coroutines, and the merge is parallel too.
+ * The target latency is split into equal time quanta of the
+ * coroutines. Without it they yield on each sorting loop step.
+ * Files larger than the memory limit are sorted in chunks which
+ * are spilled into temporary files, and are merged in the end.
  */
 
-/**
- * A function, called from inside of coroutines recursively. Just to demonstrate
- * the example. You can split your code into multiple functions, that usually
- * helps to keep the individual code blocks simple.
- */
-static void
-other_function(const char *name, int depth)
+enum {
+	SOLUTION_DEFAULT_MEM_MB = 256,
+	/** Smaller chunks would make too many runs. */
+	SOLUTION_MIN_CHUNK_COUNT = 64 * 1024,
+};
+
+/** Files to sort, shared by all the coroutines. */
+struct solution_ctx {
+	struct sort_engine engine;
+	char **files;
+	int file_count;
+	/** Index of the next file to take. */
+	int next_file;
+	/** Numbers in a chunk of each coroutine. */
+	size_t chunk_count;
+	/** Protects the failure info. */
+	pthread_mutex_t mutex;
+	/** Name of the failed file, if any. */
+	const char *failed_file;
+	int failed_errno;
+};
+
+/** Statistics of a finished coroutine. */
+struct solution_coro_stat {
+	uint64_t run_time_ns;
+	long long switch_count;
+};
+
+/** A thread sorting files in its own coroutines. */
+struct solution_thread {
+	struct solution_ctx *ctx;
+	pthread_t thread;
+	int coro_count;
+	struct solution_coro_stat *stats;
+	double time;
+	double cpu_time;
+};
+
+static double
+solution_clock(clockid_t id)
 {
-	printf("%s: entered function, depth = %d\n", name, depth);
-	coro_yield();
-	if (depth < 3)
-		other_function(name, depth + 1);
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+solution_now(void)
+{
+	return solution_clock(CLOCK_MONOTONIC);
 }
 
 /**
- * Coroutine body. This code is executed by all the coroutines. Here you
- * implement your solution, sort each individual file.
+ * Coroutine body. Sort the files one by one while there are
+ * unsorted ones.
  */
 static int
-coroutine_func_f(void *context)
+solution_coro_f(void *arg)
 {
-	/* IMPLEMENT SORTING OF INDIVIDUAL FILES HERE. */
-
-	struct coro *this = coro_this();
-	char *name = context;
-	printf("Started coroutine %s\n", name);
-	printf("%s: switch count %lld\n", name, coro_switch_count(this));
-	printf("%s: yield\n", name);
-	coro_yield();
-
-	printf("%s: switch count %lld\n", name, coro_switch_count(this));
-	printf("%s: yield\n", name);
-	coro_yield();
-
-	printf("%s: switch count %lld\n", name, coro_switch_count(this));
-	other_function(name, 1);
-	printf("%s: switch count after other function %lld\n", name,
-	       coro_switch_count(this));
-	free(name);
-	/* This will be returned from coro_status(). */
-	return 0;
+	struct solution_ctx *ctx = (struct solution_ctx *) arg;
+	while (true) {
+		int i = __atomic_fetch_add(&ctx->next_file, 1, __ATOMIC_RELAXED);
+		if (i >= ctx->file_count)
+			return 0;
+		const char *file = ctx->files[i];
+		if (sort_engine_add_file(&ctx->engine, file,
+					 ctx->chunk_count) != 0) {
+			pthread_mutex_lock(&ctx->mutex);
+			if (ctx->failed_file == NULL) {
+				ctx->failed_file = file;
+				ctx->failed_errno = errno;
+			}
+			pthread_mutex_unlock(&ctx->mutex);
+			/* Let the others stop too. */
+			__atomic_store_n(&ctx->next_file, ctx->file_count,
+					 __ATOMIC_RELAXED);
+			return -1;
+		}
+	}
 }
 
-int
-main(int argc, char **argv)
+/** Run the coroutines of a thread in its own scheduler. */
+static void *
+solution_thread_f(void *arg)
 {
-	/* Initialize our coroutine global cooperative scheduler. */
+	struct solution_thread *t = (struct solution_thread *) arg;
+	double start = solution_now();
+	double cpu_start = solution_clock(CLOCK_THREAD_CPUTIME_ID);
 	coro_sched_init();
-	/* Start several coroutines. */
-	for (int i = 0; i < 3; ++i) {
-		/*
-		 * The coroutines can take any 'void *' interpretation of which
-		 * depends on what you want. Here as an example I give them
-		 * some names.
-		 */
-		char name[16];
-		sprintf(name, "coro_%d", i);
-		/*
-		 * I have to copy the name. Otherwise all the coroutines would
-		 * have the same name when they finally start.
-		 */
-		coro_new(coroutine_func_f, strdup(name));
-	}
-	/* Wait for all the coroutines to end. */
+	for (int i = 0; i < t->coro_count; ++i)
+		coro_new(solution_coro_f, t->ctx);
+	int id = 0;
 	struct coro *c;
 	while ((c = coro_sched_wait()) != NULL) {
-		/*
-		 * Each 'wait' returns a finished coroutine with which you can
-		 * do anything you want. Like check its exit status, for
-		 * example. Don't forget to free the coroutine afterwards.
-		 */
-		printf("Finished %d\n", coro_status(c));
+		t->stats[id].run_time_ns = coro_run_time_ns(c);
+		t->stats[id].switch_count = coro_switch_count(c);
+		++id;
 		coro_delete(c);
 	}
-	/* All coroutines have finished. */
+	coro_sched_destroy();
+	t->time = solution_now() - start;
+	t->cpu_time = solution_clock(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+	return NULL;
+}
+
+static void
+solution_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-l latency_us] [-c coro_count] "
+		"[-j thread_count] [-m mem_mb] [-t tmp_dir] [-o output] "
+		"files...\n", name);
+}
 
-	/* IMPLEMENT MERGING OF THE SORTED ARRAYS HERE. */
+int
+main(int argc, char **argv)
+{
+	double latency_us = 0;
+	int coro_count = 0;
+	int thread_count = 1;
+	size_t mem_mb = SOLUTION_DEFAULT_MEM_MB;
+	const char *tmp_dir = getenv("TMPDIR");
+	const char *output = "result.txt";
+	int opt;
+	while ((opt = getopt(argc, argv, "l:c:j:m:t:o:")) != -1) {
+		switch (opt) {
+		case 'l':
+			latency_us = atof(optarg);
+			break;
+		case 'c':
+			coro_count = atoi(optarg);
+			break;
+		case 'j':
+			thread_count = atoi(optarg);
+			break;
+		case 'm':
+			mem_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			tmp_dir = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			solution_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc || mem_mb == 0 || thread_count <= 0) {
+		solution_usage(argv[0]);
+		return 1;
+	}
+	if (tmp_dir == NULL)
+		tmp_dir = "/tmp";
+	struct solution_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.files = argv + optind;
+	ctx.file_count = argc - optind;
+	if (coro_count <= 0 || coro_count > ctx.file_count)
+		coro_count = ctx.file_count;
+	/* Even one file can give many runs to merge in parallel. */
+	int merge_thread_count = thread_count;
+	if (thread_count > coro_count)
+		thread_count = coro_count;
+	pthread_mutex_init(&ctx.mutex, NULL);
+	size_t mem_limit = mem_mb * 1024 * 1024;
+	sort_engine_create(&ctx.engine, mem_limit, tmp_dir);
+	/*
+	 * Half of the memory is for the sort buffers. Each
+	 * coroutine needs 2 of them.
+	 */
+	ctx.chunk_count = mem_limit / 2 / coro_count / 2 / sizeof(int);
+	if (ctx.chunk_count < SOLUTION_MIN_CHUNK_COUNT)
+		ctx.chunk_count = SOLUTION_MIN_CHUNK_COUNT;
 
-	return 0;
+	double start = solution_now();
+	coro_set_accounting(true);
+	/* Without a target latency yield on each step. */
+	double quantum_ns = latency_us * 1000 / coro_count;
+	coro_set_quantum(quantum_ns >= 1 ? (uint64_t) quantum_ns : 1);
+	struct solution_thread *threads = (struct solution_thread *)
+		calloc(thread_count, sizeof(threads[0]));
+	for (int i = 0; i < thread_count; ++i) {
+		struct solution_thread *t = &threads[i];
+		t->ctx = &ctx;
+		/* The coroutines are split among the threads evenly. */
+		t->coro_count = coro_count * (i + 1) / thread_count -
+				coro_count * i / thread_count;
+		t->stats = (struct solution_coro_stat *)
+			calloc(t->coro_count, sizeof(t->stats[0]));
+		if (thread_count == 1) {
+			solution_thread_f(t);
+		} else if (pthread_create(&t->thread, NULL, solution_thread_f,
+					  t) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		struct solution_thread *t = &threads[i];
+		if (thread_count > 1) {
+			pthread_join(t->thread, NULL);
+			printf("thread %d: time %.3f ms, cpu time %.3f ms\n", i,
+			       t->time * 1000, t->cpu_time * 1000);
+		}
+		for (int j = 0; j < t->coro_count; ++j) {
+			const char *indent = thread_count > 1 ? "  " : "";
+			printf("%scoro %d: run time %.3f ms, %lld switches\n",
+			       indent, j, t->stats[j].run_time_ns / 1e6,
+			       t->stats[j].switch_count);
+		}
+		free(t->stats);
+	}
+	free(threads);
+	coro_set_quantum(0);
+	int rc = 0;
+	double sort_time = solution_now() - start;
+	if (ctx.failed_file != NULL) {
+		fprintf(stderr, "Can not sort %s: %s\n", ctx.failed_file,
+			strerror(ctx.failed_errno));
+		rc = 1;
+		goto end;
+	}
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 ||
+	    sort_engine_merge_mt(&ctx.engine, fd, merge_thread_count) != 0) {
+		fprintf(stderr, "Can not write %s: %s\n", output,
+			strerror(errno));
+		rc = 1;
+	}
+	if (fd >= 0)
+		close(fd);
+	double total_time = solution_now() - start;
+	printf("sort time: %.3f ms, merge time: %.3f ms, %zu runs\n",
+	       sort_time * 1000, (total_time - sort_time) * 1000,
+	       ctx.engine.run_count);
+	printf("total time: %.3f ms\n", total_time * 1000);
+end:
+	sort_engine_destroy(&ctx.engine);
+	pthread_mutex_destroy(&ctx.mutex);
+	return rc;
 }
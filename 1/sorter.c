@@ -0,0 +1,1218 @@
+#define _GNU_SOURCE
+#include "sorter.h"
+#include "libcoro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SORT_HAVE_X86_SIMD
+#endif
+
+enum {
+	/** Size of the input read buffer. */
+	SORT_READ_BUF_SIZE = 1024 * 1024,
+	/** Size of the output write buffer. */
+	SORT_WRITE_BUF_SIZE = 1024 * 1024,
+	/** Each that many numbers the sort checks the time quantum. */
+	SORT_YIELD_STEP = 16 * 1024,
+	/** Limits of a read buffer of a file run, in numbers. */
+	SORT_MERGE_BUF_MIN = 16 * 1024,
+	SORT_MERGE_BUF_MAX = 256 * 1024,
+};
+
+/** Two decimal digits of each number from 0 to 99. */
+static const char sort_digit_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static inline void
+sort_yield(void)
+{
+	coro_yield_if_quantum_expired();
+}
+
+void
+sort_engine_create(struct sort_engine *e, size_t mem_limit,
+		   const char *tmp_dir)
+{
+	memset(e, 0, sizeof(*e));
+	e->mem_limit = mem_limit;
+	e->tmp_dir = tmp_dir;
+	pthread_mutex_init(&e->mutex, NULL);
+}
+
+void
+sort_engine_destroy(struct sort_engine *e)
+{
+	for (size_t i = 0; i < e->run_count; ++i) {
+		struct sort_run *r = &e->runs[i];
+		free(r->data);
+		if (r->is_fd_owner)
+			close(r->fd);
+	}
+	free(e->runs);
+	pthread_mutex_destroy(&e->mutex);
+}
+
+static void
+sort_engine_add_run(struct sort_engine *e, const struct sort_run *r)
+{
+	pthread_mutex_lock(&e->mutex);
+	if (e->run_count == e->run_capacity) {
+		e->run_capacity = e->run_capacity == 0 ? 16 :
+				  e->run_capacity * 2;
+		e->runs = (struct sort_run *) realloc(e->runs,
+			e->run_capacity * sizeof(e->runs[0]));
+		if (e->runs == NULL)
+			abort();
+	}
+	e->runs[e->run_count++] = *r;
+	pthread_mutex_unlock(&e->mutex);
+}
+
+/** Map a number to an unsigned key with the same order. */
+static inline uint32_t
+sort_key(int value)
+{
+	return (uint32_t) value ^ 0x80000000u;
+}
+
+void
+sort_radix(int *data, int *tmp, size_t count)
+{
+	if (count == 0)
+		return;
+	/* Histograms of all the 4 bytes are built in one pass. */
+	size_t counts[4][256];
+	memset(counts, 0, sizeof(counts));
+	for (size_t begin = 0; begin < count; begin += SORT_YIELD_STEP) {
+		size_t end = begin + SORT_YIELD_STEP;
+		if (end > count)
+			end = count;
+		for (size_t i = begin; i < end; ++i) {
+			uint32_t key = sort_key(data[i]);
+			++counts[0][key & 0xff];
+			++counts[1][(key >> 8) & 0xff];
+			++counts[2][(key >> 16) & 0xff];
+			++counts[3][key >> 24];
+		}
+		sort_yield();
+	}
+	int *src = data;
+	int *dst = tmp;
+	for (int pass = 0; pass < 4; ++pass) {
+		size_t *offsets = counts[pass];
+		int shift = pass * 8;
+		/* All the numbers have the same byte here. */
+		if (offsets[(sort_key(src[0]) >> shift) & 0xff] == count)
+			continue;
+		size_t pos = 0;
+		for (int b = 0; b < 256; ++b) {
+			size_t n = offsets[b];
+			offsets[b] = pos;
+			pos += n;
+		}
+		for (size_t begin = 0; begin < count;
+		     begin += SORT_YIELD_STEP) {
+			size_t end = begin + SORT_YIELD_STEP;
+			if (end > count)
+				end = count;
+			for (size_t i = begin; i < end; ++i) {
+				uint32_t b = (sort_key(src[i]) >> shift) & 0xff;
+				dst[offsets[b]++] = src[i];
+			}
+			sort_yield();
+		}
+		int *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != data)
+		memcpy(data, src, count * sizeof(data[0]));
+}
+
+static int
+sort_write_all(int fd, const void *buf, size_t size)
+{
+	const char *pos = (const char *) buf;
+	while (size > 0) {
+		ssize_t rc = coro_write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+size_t
+sort_parse_scalar(struct sort_parser *p, const char *buf, size_t size,
+		  int *out, size_t *count, size_t capacity)
+{
+	uint32_t value = p->value;
+	bool is_in_number = p->is_in_number;
+	bool is_negative = p->is_negative;
+	size_t n = *count;
+	size_t i = 0;
+	while (i < size && n < capacity) {
+		char c = buf[i++];
+		unsigned digit = (unsigned char) c - '0';
+		if (digit < 10) {
+			value = value * 10 + digit;
+			is_in_number = true;
+			continue;
+		}
+		if (! is_in_number) {
+			is_negative = c == '-';
+			continue;
+		}
+		/*
+		 * Any other byte ends the number, a minus too. Then
+		 * it is a sign of the next one, like in the SIMD
+		 * parsers.
+		 */
+		out[n++] = is_negative ? (int) -value : (int) value;
+		value = 0;
+		is_in_number = false;
+		is_negative = c == '-';
+	}
+	p->value = value;
+	p->is_in_number = is_in_number;
+	p->is_negative = is_negative;
+	*count = n;
+	return i;
+}
+
+#ifdef SORT_HAVE_X86_SIMD
+
+/**
+ * Convert @a len <= 16 digits ending at @a end. The digits are
+ * loaded into the high lanes of a vector, and the pairs, quads,
+ * and octets of digits are combined with multiply-adds.
+ */
+static inline __attribute__((target("sse4.2"), always_inline)) uint32_t
+sort_sse_atoi(const char *end, size_t len)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) (end - 16));
+	__m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+				      12, 13, 14, 15);
+	d = _mm_and_si128(d, _mm_cmpgt_epi8(lanes,
+					     _mm_set1_epi8(15 - len)));
+	__m128i pairs = _mm_maddubs_epi16(d, _mm_setr_epi8(10, 1, 10, 1, 10,
+			1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1));
+	__m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1,
+			100, 1, 100, 1));
+	quads = _mm_packus_epi32(quads, quads);
+	__m128i octets = _mm_madd_epi16(quads, _mm_setr_epi16(10000, 1,
+			10000, 1, 10000, 1, 10000, 1));
+	uint64_t high = (uint32_t) _mm_cvtsi128_si32(octets);
+	uint64_t low = (uint32_t) _mm_extract_epi32(octets, 1);
+	return high * 100000000 + low;
+}
+
+/** Bit mask of the digits among 16 bytes at @a pos. */
+static inline __attribute__((target("sse4.2"), always_inline)) uint32_t
+sort_sse_digit_mask(const char *pos)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) pos);
+	__m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)),
+					  d);
+	return _mm_movemask_epi8(is_digit);
+}
+
+/** Bit mask of the digits among 32 bytes at @a pos. */
+static inline __attribute__((target("avx2"), always_inline)) uint32_t
+sort_avx2_digit_mask(const char *pos)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) pos);
+	__m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+	__m256i is_digit = _mm256_cmpeq_epi8(
+		_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	return _mm256_movemask_epi8(is_digit);
+}
+
+/**
+ * Generic SIMD parser. A digit mask of a vector gives both the
+ * start and the end of a number, and the number is converted at
+ * once. Numbers split between buffers and numbers longer than 16
+ * digits are rare, and go to the scalar code.
+ */
+#define SORT_PARSE_SIMD_BODY(digit_mask, width) do {			\
+	const uint32_t all = (uint32_t) ((1ull << (width)) - 1);	\
+	size_t n = *count;						\
+	size_t i = 0;							\
+	if (p->is_in_number) {						\
+		while ((digit_mask(buf + i) & all) == all)		\
+			i += (width);					\
+		i += __builtin_ctz(~digit_mask(buf + i));		\
+		size_t end = i < size ? i + 1 : size;			\
+		i = sort_parse_scalar(p, buf, end, out, &n, capacity);	\
+		if (p->is_in_number) {					\
+			*count = n;					\
+			return i;					\
+		}							\
+	}								\
+	while (n < capacity) {						\
+		size_t base = i;					\
+		uint32_t mask = digit_mask(buf + base);			\
+		while (mask == 0 && base + (width) < size) {		\
+			base += (width);				\
+			mask = digit_mask(buf + base);			\
+		}							\
+		size_t start = mask != 0 ? base + __builtin_ctz(mask) :	\
+					   size;			\
+		if (start >= size) {					\
+			p->is_negative = size > i &&			\
+					 buf[size - 1] == '-';		\
+			*count = n;					\
+			return size;					\
+		}							\
+		bool is_negative = start > 0 ? buf[start - 1] == '-' :	\
+					       p->is_negative;		\
+		p->is_negative = false;					\
+		/* Usually the number ends in the same vector. */	\
+		uint32_t ends = ~mask & (all << (start - base)) & all;	\
+		size_t end;						\
+		if (ends != 0) {					\
+			end = base + __builtin_ctz(ends);		\
+		} else {						\
+			end = base + (width);				\
+			while ((digit_mask(buf + end) & all) == all)	\
+				end += (width);				\
+			end += __builtin_ctz(~digit_mask(buf + end));	\
+		}							\
+		if (end >= size) {					\
+			/* Can continue in the next buffer. */		\
+			p->is_negative = is_negative;			\
+			sort_parse_scalar(p, buf + start, size - start,	\
+					  out, &n, capacity);		\
+			*count = n;					\
+			return size;					\
+		}							\
+		uint32_t value;						\
+		if (end - start <= 16) {				\
+			value = sort_sse_atoi(buf + end, end - start);	\
+		} else {						\
+			value = 0;					\
+			for (size_t k = start; k < end; ++k)		\
+				value = value * 10 + buf[k] - '0';	\
+		}							\
+		out[n++] = is_negative ? (int) -value : (int) value;	\
+		i = end;						\
+	}								\
+	*count = n;							\
+	return i;							\
+} while (0)
+
+static __attribute__((target("sse4.2"))) size_t
+sort_parse_sse42_f(struct sort_parser *p, const char *buf, size_t size,
+		   int *out, size_t *count, size_t capacity)
+{
+	SORT_PARSE_SIMD_BODY(sort_sse_digit_mask, 16);
+}
+
+static __attribute__((target("avx2"))) size_t
+sort_parse_avx2_f(struct sort_parser *p, const char *buf, size_t size,
+		  int *out, size_t *count, size_t capacity)
+{
+	SORT_PARSE_SIMD_BODY(sort_avx2_digit_mask, 32);
+}
+
+#undef SORT_PARSE_SIMD_BODY
+
+#endif /* SORT_HAVE_X86_SIMD */
+
+sort_parse_f
+sort_parse_sse42(void)
+{
+#ifdef SORT_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		return sort_parse_sse42_f;
+#endif
+	return NULL;
+}
+
+sort_parse_f
+sort_parse_avx2(void)
+{
+#ifdef SORT_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return sort_parse_avx2_f;
+#endif
+	return NULL;
+}
+
+size_t
+sort_parse(struct sort_parser *p, const char *buf, size_t size,
+	   int *out, size_t *count, size_t capacity)
+{
+	/* Can be chosen by several threads, but always the same. */
+	static sort_parse_f parse = NULL;
+	sort_parse_f f = __atomic_load_n(&parse, __ATOMIC_RELAXED);
+	if (f == NULL) {
+		f = sort_parse_avx2();
+		if (f == NULL)
+			f = sort_parse_sse42();
+		if (f == NULL)
+			f = sort_parse_scalar;
+		__atomic_store_n(&parse, f, __ATOMIC_RELAXED);
+	}
+	return f(p, buf, size, out, count, capacity);
+}
+
+/** State of one file being sorted. */
+struct sort_job {
+	struct sort_engine *e;
+	/** Chunk of the file numbers being accumulated. */
+	int *data;
+	size_t count;
+	size_t capacity;
+	/** Buffer for the radix sort. */
+	int *tmp;
+	/** Temporary file for the spilled runs. -1 if none yet. */
+	int fd;
+	/** Size of the temporary file. */
+	off_t fd_size;
+};
+
+/** Create an unlinked temporary file. */
+static int
+sort_tmp_file_new(const char *dir)
+{
+	char path[4096];
+	int rc = snprintf(path, sizeof(path), "%s/sortXXXXXX", dir);
+	if (rc < 0 || (size_t) rc >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	return fd;
+}
+
+/** Sort the current chunk and write it into the temporary file. */
+static int
+sort_job_spill(struct sort_job *j)
+{
+	sort_radix(j->data, j->tmp, j->count);
+	struct sort_run r;
+	r.data = NULL;
+	r.is_fd_owner = j->fd < 0;
+	if (j->fd < 0) {
+		j->fd = sort_tmp_file_new(j->e->tmp_dir);
+		if (j->fd < 0)
+			return -1;
+	}
+	r.fd = j->fd;
+	r.offset = j->fd_size;
+	r.count = j->count;
+	size_t size = j->count * sizeof(j->data[0]);
+	if (sort_write_all(j->fd, j->data, size) != 0) {
+		if (r.is_fd_owner) {
+			close(j->fd);
+			j->fd = -1;
+		}
+		return -1;
+	}
+	j->fd_size += size;
+	j->count = 0;
+	sort_engine_add_run(j->e, &r);
+	return 0;
+}
+
+/**
+ * Sort the last chunk of the file. It stays in memory if the
+ * limit allows.
+ */
+static int
+sort_job_finish(struct sort_job *j)
+{
+	if (j->count == 0)
+		return 0;
+	struct sort_engine *e = j->e;
+	size_t size = j->count * sizeof(j->data[0]);
+	pthread_mutex_lock(&e->mutex);
+	bool is_kept = e->mem_kept + size <= e->mem_limit / 2;
+	if (is_kept)
+		e->mem_kept += size;
+	pthread_mutex_unlock(&e->mutex);
+	if (! is_kept)
+		return sort_job_spill(j);
+	sort_radix(j->data, j->tmp, j->count);
+	struct sort_run r;
+	r.data = (int *) realloc(j->data, size);
+	if (r.data == NULL)
+		r.data = j->data;
+	j->data = NULL;
+	r.fd = -1;
+	r.is_fd_owner = false;
+	r.offset = 0;
+	r.count = j->count;
+	sort_engine_add_run(e, &r);
+	return 0;
+}
+
+int
+sort_engine_add_file(struct sort_engine *e, const char *path,
+		     size_t chunk_count)
+{
+	if (chunk_count == 0)
+		chunk_count = 1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct sort_job j;
+	j.e = e;
+	j.count = 0;
+	j.capacity = chunk_count;
+	j.fd = -1;
+	j.fd_size = 0;
+	j.data = (int *) malloc(chunk_count * sizeof(j.data[0]));
+	j.tmp = (int *) malloc(chunk_count * sizeof(j.tmp[0]));
+	char *mem = (char *) calloc(1, SORT_READ_BUF_SIZE +
+					2 * SORT_PARSE_PADDING);
+	char *buf = mem + SORT_PARSE_PADDING;
+	if (j.data == NULL || j.tmp == NULL || mem == NULL) {
+		errno = ENOMEM;
+		goto error;
+	}
+	struct sort_parser parser;
+	memset(&parser, 0, sizeof(parser));
+	while (true) {
+		ssize_t size = coro_read(fd, buf, SORT_READ_BUF_SIZE);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+		/* The end of file ends the last number. */
+		bool is_eof = size == 0;
+		if (is_eof)
+			buf[size++] = ' ';
+		buf[size] = 0;
+		size_t done = 0;
+		while (done < (size_t) size) {
+			done += sort_parse(&parser, buf + done, size - done,
+					   j.data, &j.count, j.capacity);
+			if (j.count == j.capacity && sort_job_spill(&j) != 0)
+				goto error;
+		}
+		if (is_eof)
+			break;
+		sort_yield();
+	}
+	if (sort_job_finish(&j) != 0)
+		goto error;
+	close(fd);
+	free(mem);
+	free(j.data);
+	free(j.tmp);
+	return 0;
+error:;
+	int err = errno;
+	close(fd);
+	free(mem);
+	free(j.data);
+	free(j.tmp);
+	errno = err;
+	return -1;
+}
+
+/** Buffered output of numbers as text. */
+struct sort_writer {
+	int fd;
+	char *buf;
+	size_t size;
+	/** True, if no number has been printed before. */
+	bool is_first;
+	/** Bytes flushed into the file. */
+	off_t total;
+};
+
+static int
+sort_writer_create(struct sort_writer *w, int fd, bool is_first)
+{
+	w->fd = fd;
+	w->size = 0;
+	w->is_first = is_first;
+	w->total = 0;
+	w->buf = (char *) malloc(SORT_WRITE_BUF_SIZE);
+	if (w->buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+sort_writer_destroy(struct sort_writer *w)
+{
+	free(w->buf);
+}
+
+static int
+sort_writer_flush(struct sort_writer *w)
+{
+	if (sort_write_all(w->fd, w->buf, w->size) != 0)
+		return -1;
+	w->total += w->size;
+	w->size = 0;
+	return 0;
+}
+
+char *
+sort_itoa_scalar(char *pos, int value)
+{
+	char tmp[SORT_INT_MAX_LEN];
+	char *end = tmp + sizeof(tmp);
+	char *begin = end;
+	uint32_t u = value < 0 ? -(uint32_t) value : (uint32_t) value;
+	while (u >= 100) {
+		uint32_t r = u % 100;
+		u /= 100;
+		begin -= 2;
+		memcpy(begin, &sort_digit_pairs[r * 2], 2);
+	}
+	if (u >= 10) {
+		begin -= 2;
+		memcpy(begin, &sort_digit_pairs[u * 2], 2);
+	} else {
+		*--begin = '0' + u;
+	}
+	if (value < 0)
+		*--begin = '-';
+	memcpy(pos, begin, end - begin);
+	return pos + (end - begin);
+}
+
+#ifdef __SSE2__
+
+/**
+ * 8 decimal digits of @a value < 10^8 as 8 bytes, the first digit
+ * is the lowest byte. The value is split into 2 halves of 4
+ * digits, and each half is divided by 1000, 100, 10, 1 in
+ * parallel lanes with multiplications by the reciprocals. The
+ * remainders are obtained as a[i] - a[i - 1] * 10.
+ */
+static inline uint64_t
+sort_sse2_digits8(uint32_t value)
+{
+	const __m128i div10000 = _mm_set1_epi32(0xd1b71759);
+	const __m128i mul10000 = _mm_set1_epi32(10000);
+	const __m128i div_powers = _mm_setr_epi16(8389, 5243, 13108, -32768,
+						  8389, 5243, 13108, -32768);
+	const __m128i shift_powers = _mm_setr_epi16(1 << 7, 1 << 11, 1 << 13,
+						    -32768, 1 << 7, 1 << 11,
+						    1 << 13, -32768);
+	__m128i v = _mm_cvtsi32_si128(value);
+	/* abcd = abcdefgh / 10000, efgh = abcdefgh % 10000. */
+	__m128i abcd = _mm_srli_epi64(_mm_mul_epu32(v, div10000), 45);
+	__m128i efgh = _mm_sub_epi32(v, _mm_mul_epu32(abcd, mul10000));
+	__m128i v1 = _mm_slli_epi64(_mm_unpacklo_epi16(abcd, efgh), 2);
+	__m128i v2 = _mm_unpacklo_epi16(v1, v1);
+	v2 = _mm_unpacklo_epi32(v2, v2);
+	/* a, ab, abc, abcd, e, ef, efg, efgh. */
+	__m128i v3 = _mm_mulhi_epu16(_mm_mulhi_epu16(v2, div_powers),
+				     shift_powers);
+	__m128i v4 = _mm_mullo_epi16(v3, _mm_set1_epi16(10));
+	__m128i digits = _mm_sub_epi16(v3, _mm_slli_epi64(v4, 16));
+	__m128i ascii = _mm_add_epi8(_mm_packus_epi16(digits, digits),
+				     _mm_set1_epi8('0'));
+	return (uint64_t) _mm_cvtsi128_si64(ascii);
+}
+
+static inline int
+sort_digit_count8(uint32_t value)
+{
+	return 1 + (value >= 10) + (value >= 100) + (value >= 1000) +
+	       (value >= 10000) + (value >= 100000) +
+	       (value >= 1000000) + (value >= 10000000);
+}
+
+/** sort_itoa() with all the 8 low digits converted at once. */
+static inline char *
+sort_itoa_sse2(char *pos, int value)
+{
+	if (value < 0)
+		*pos++ = '-';
+	uint32_t u = value < 0 ? -(uint32_t) value : (uint32_t) value;
+	if (u < 100000000) {
+		int count = sort_digit_count8(u);
+		uint64_t digits = sort_sse2_digits8(u) >> ((8 - count) * 8);
+		memcpy(pos, &digits, sizeof(digits));
+		return pos + count;
+	}
+	uint32_t high = u / 100000000;
+	uint64_t digits = sort_sse2_digits8(u - high * 100000000);
+	if (high >= 10) {
+		memcpy(pos, &sort_digit_pairs[high * 2], 2);
+		pos += 2;
+	} else {
+		*pos++ = '0' + high;
+	}
+	memcpy(pos, &digits, sizeof(digits));
+	return pos + 8;
+}
+
+#endif /* __SSE2__ */
+
+char *
+sort_itoa(char *pos, int value)
+{
+#ifdef __SSE2__
+	return sort_itoa_sse2(pos, value);
+#else
+	return sort_itoa_scalar(pos, value);
+#endif
+}
+
+static inline int
+sort_writer_put(struct sort_writer *w, int value)
+{
+	/* Keep a byte for the final new line. */
+	if (w->size + SORT_INT_MAX_LEN >= SORT_WRITE_BUF_SIZE &&
+	    sort_writer_flush(w) != 0)
+		return -1;
+	char *pos = w->buf + w->size;
+	if (! w->is_first)
+		*pos++ = ' ';
+	w->is_first = false;
+	w->size = sort_itoa(pos, value) - w->buf;
+	return 0;
+}
+
+/** Reader of one run during the merge. */
+struct sort_source {
+	/** Numbers available right now. */
+	const int *pos;
+	const int *end;
+	/** Position of the not read part of a file run. */
+	int fd;
+	off_t offset;
+	/** Numbers in the file, not read yet. */
+	size_t left;
+	int *buf;
+	size_t buf_capacity;
+};
+
+/** Read a next portion of a file run. */
+static int
+sort_source_fill(struct sort_source *s)
+{
+	size_t count = s->left < s->buf_capacity ? s->left : s->buf_capacity;
+	size_t size = count * sizeof(s->buf[0]);
+	size_t done = 0;
+	while (done < size) {
+		ssize_t rc = pread(s->fd, (char *) s->buf + done, size - done,
+				   s->offset + done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0) {
+			errno = EIO;
+			return -1;
+		}
+		done += rc;
+	}
+	s->offset += size;
+	s->left -= count;
+	s->pos = s->buf;
+	s->end = s->buf + count;
+	return 0;
+}
+
+/**
+ * Loser tree of the runs. Each inner node keeps the run which
+ * lost the match in it, and node 0 keeps the overall winner. So
+ * replacing the winner takes log(k) comparisons on the path from
+ * its leaf to the root, with no comparisons of the siblings.
+ */
+struct sort_tree {
+	/** Number of the runs. */
+	int k;
+	/**
+	 * The current number of each run. INT64_MAX for an ended
+	 * run. Key k is a sentinel less than everything.
+	 */
+	int64_t *keys;
+	int *nodes;
+};
+
+static inline void
+sort_tree_adjust(struct sort_tree *t, int s)
+{
+	for (int n = (s + t->k) / 2; n > 0; n /= 2) {
+		if (t->keys[s] > t->keys[t->nodes[n]]) {
+			int loser = s;
+			s = t->nodes[n];
+			t->nodes[n] = loser;
+		}
+	}
+	t->nodes[0] = s;
+}
+
+static int
+sort_tree_create(struct sort_tree *t, int k)
+{
+	t->k = k;
+	t->keys = (int64_t *) malloc((k + 1) * sizeof(t->keys[0]));
+	t->nodes = (int *) malloc((k + 1) * sizeof(t->nodes[0]));
+	if (t->keys == NULL || t->nodes == NULL) {
+		free(t->keys);
+		free(t->nodes);
+		errno = ENOMEM;
+		return -1;
+	}
+	t->keys[k] = INT64_MIN;
+	for (int i = 0; i < k; ++i)
+		t->nodes[i] = k;
+	return 0;
+}
+
+static void
+sort_tree_destroy(struct sort_tree *t)
+{
+	free(t->keys);
+	free(t->nodes);
+}
+
+/** Take a next number of the source into its key. */
+static inline int
+sort_source_next(struct sort_source *s, int64_t *key)
+{
+	if (s->pos == s->end) {
+		if (s->left == 0) {
+			*key = INT64_MAX;
+			return 0;
+		}
+		if (sort_source_fill(s) != 0)
+			return -1;
+	}
+	*key = *s->pos++;
+	return 0;
+}
+
+/**
+ * Size of a read buffer of each file run, when the merge is done
+ * by @a thread_count threads. The memory not taken by the kept
+ * runs is for the buffers.
+ */
+static size_t
+sort_merge_buf_capacity(const struct sort_engine *e, int thread_count)
+{
+	size_t file_run_count = 0;
+	for (size_t i = 0; i < e->run_count; ++i)
+		file_run_count += e->runs[i].data == NULL;
+	if (file_run_count == 0)
+		return SORT_MERGE_BUF_MIN;
+	size_t capacity = (e->mem_limit - e->mem_kept) / thread_count /
+			  file_run_count / sizeof(int);
+	if (capacity < SORT_MERGE_BUF_MIN)
+		capacity = SORT_MERGE_BUF_MIN;
+	if (capacity > SORT_MERGE_BUF_MAX)
+		capacity = SORT_MERGE_BUF_MAX;
+	return capacity;
+}
+
+/**
+ * Merge the parts [@a begin[i], @a end[i]) of each run i into the
+ * writer.
+ */
+static int
+sort_merge_ranges(struct sort_engine *e, const size_t *begin,
+		  const size_t *end, size_t buf_capacity,
+		  struct sort_writer *w)
+{
+	int rc = -1;
+	int k = e->run_count;
+	struct sort_source *sources = (struct sort_source *)
+		calloc(k > 0 ? k : 1, sizeof(sources[0]));
+	struct sort_tree t;
+	if (sources == NULL || sort_tree_create(&t, k) != 0) {
+		free(sources);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0; i < k; ++i) {
+		struct sort_run *r = &e->runs[i];
+		struct sort_source *s = &sources[i];
+		if (r->data != NULL) {
+			s->pos = r->data + begin[i];
+			s->end = r->data + end[i];
+			continue;
+		}
+		s->fd = r->fd;
+		s->offset = r->offset + begin[i] * sizeof(int);
+		s->left = end[i] - begin[i];
+		s->buf_capacity = buf_capacity;
+		s->buf = (int *) malloc(buf_capacity * sizeof(s->buf[0]));
+		if (s->buf == NULL) {
+			errno = ENOMEM;
+			goto end;
+		}
+	}
+	for (int i = k - 1; i >= 0; --i) {
+		if (sort_source_next(&sources[i], &t.keys[i]) != 0)
+			goto end;
+		sort_tree_adjust(&t, i);
+	}
+	while (k > 0) {
+		int s = t.nodes[0];
+		if (t.keys[s] == INT64_MAX)
+			break;
+		if (sort_writer_put(w, (int) t.keys[s]) != 0 ||
+		    sort_source_next(&sources[s], &t.keys[s]) != 0)
+			goto end;
+		sort_tree_adjust(&t, s);
+	}
+	rc = 0;
+end:;
+	int err = errno;
+	for (int i = 0; i < k; ++i)
+		free(sources[i].buf);
+	free(sources);
+	sort_tree_destroy(&t);
+	errno = err;
+	return rc;
+}
+
+int
+sort_engine_merge(struct sort_engine *e, int fd)
+{
+	size_t k = e->run_count;
+	size_t *begin = (size_t *) calloc(k + 1, sizeof(begin[0]));
+	size_t *end = (size_t *) malloc((k + 1) * sizeof(end[0]));
+	struct sort_writer w;
+	if (begin == NULL || end == NULL ||
+	    sort_writer_create(&w, fd, true) != 0) {
+		free(begin);
+		free(end);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size_t i = 0; i < k; ++i)
+		end[i] = e->runs[i].count;
+	int rc = sort_merge_ranges(e, begin, end,
+				   sort_merge_buf_capacity(e, 1), &w);
+	if (rc == 0) {
+		if (! w.is_first)
+			w.buf[w.size++] = '\n';
+		rc = sort_writer_flush(&w);
+	}
+	int err = errno;
+	sort_writer_destroy(&w);
+	free(begin);
+	free(end);
+	errno = err;
+	return rc;
+}
+
+/** Get a number @a i of a run. */
+static int
+sort_run_get(const struct sort_run *r, size_t i, int *value)
+{
+	if (r->data != NULL) {
+		*value = r->data[i];
+		return 0;
+	}
+	off_t offset = r->offset + i * sizeof(int);
+	ssize_t rc;
+	while ((rc = pread(r->fd, value, sizeof(*value), offset)) < 0 &&
+	       errno == EINTR);
+	if (rc == sizeof(*value))
+		return 0;
+	if (rc >= 0)
+		errno = EIO;
+	return -1;
+}
+
+/** Count numbers less than @a value in a run. */
+static int
+sort_run_count_less(const struct sort_run *r, int64_t value, size_t *count)
+{
+	size_t begin = 0;
+	size_t end = r->count;
+	while (begin < end) {
+		size_t mid = begin + (end - begin) / 2;
+		int v;
+		if (sort_run_get(r, mid, &v) != 0)
+			return -1;
+		if (v < value)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	*count = begin;
+	return 0;
+}
+
+/** Count numbers less than @a value in all the runs. */
+static int
+sort_engine_count_less(const struct sort_engine *e, int64_t value,
+		       size_t *counts, size_t *total)
+{
+	*total = 0;
+	for (size_t i = 0; i < e->run_count; ++i) {
+		if (sort_run_count_less(&e->runs[i], value, &counts[i]) != 0)
+			return -1;
+		*total += counts[i];
+	}
+	return 0;
+}
+
+/**
+ * Find how many numbers of each run go before the number of the
+ * global rank @a rank in the merged output. The number value is
+ * found by a binary search, and the ties are distributed among
+ * the runs in their order. So the split of a bigger rank is never
+ * before the split of a smaller rank in any run.
+ */
+static int
+sort_engine_split(const struct sort_engine *e, size_t rank, size_t *pos)
+{
+	size_t k = e->run_count;
+	size_t *less = (size_t *) malloc((k + 1) * sizeof(less[0]));
+	if (less == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	int rc = -1;
+	/* The smallest value which has 'rank' numbers before or at it. */
+	int64_t low = INT32_MIN;
+	int64_t high = INT32_MAX;
+	size_t total;
+	while (low < high) {
+		int64_t mid = low + (high - low) / 2;
+		if (sort_engine_count_less(e, mid + 1, less, &total) != 0)
+			goto end;
+		if (total >= rank)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	if (sort_engine_count_less(e, low, less, &total) != 0 ||
+	    sort_engine_count_less(e, low + 1, pos, &total) != 0)
+		goto end;
+	size_t left = rank;
+	for (size_t i = 0; i < k; ++i)
+		left -= less[i];
+	for (size_t i = 0; i < k; ++i) {
+		size_t equal = pos[i] - less[i];
+		size_t take = equal < left ? equal : left;
+		pos[i] = less[i] + take;
+		left -= take;
+	}
+	rc = 0;
+end:
+	free(less);
+	return rc;
+}
+
+/** Copy @a size bytes of @a from into @a to at @a offset. */
+static int
+sort_copy(int from, int to, off_t offset, off_t size)
+{
+	loff_t in = 0;
+	loff_t out = offset;
+	while (size > 0) {
+		ssize_t rc = copy_file_range(from, &in, to, &out, size, 0);
+		if (rc > 0) {
+			size -= rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc == 0 || errno == EXDEV || errno == ENOSYS ||
+		    errno == EINVAL || errno == EOPNOTSUPP)
+			break;
+		return -1;
+	}
+	if (size == 0)
+		return 0;
+	/* Not supported between these files, copy via memory. */
+	char *buf = (char *) malloc(SORT_WRITE_BUF_SIZE);
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	while (size > 0) {
+		size_t part = size < SORT_WRITE_BUF_SIZE ? size :
+			      SORT_WRITE_BUF_SIZE;
+		ssize_t rc = pread(from, buf, part, in);
+		if (rc <= 0) {
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc == 0)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+		for (ssize_t done = 0; done < rc;) {
+			ssize_t n = pwrite(to, buf + done, rc - done,
+					   out + done);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				free(buf);
+				return -1;
+			}
+			done += n;
+		}
+		in += rc;
+		out += rc;
+		size -= rc;
+	}
+	free(buf);
+	return 0;
+}
+
+/** A thread merging one slice of the output. */
+struct sort_merge_thread {
+	struct sort_engine *e;
+	pthread_t thread;
+	int id;
+	int thread_count;
+	/** All the threads, to find the offset of this slice. */
+	struct sort_merge_thread *threads;
+	pthread_barrier_t *barrier;
+	/** Total number of numbers. */
+	size_t total;
+	size_t buf_capacity;
+	int fd;
+	/** Text size of the slice. */
+	off_t size;
+	int rc;
+	int err;
+};
+
+/** Merge the slice into a temporary file. */
+static int
+sort_merge_slice(struct sort_merge_thread *m, int tmp_fd)
+{
+	struct sort_engine *e = m->e;
+	size_t k = e->run_count;
+	size_t rank_begin = m->total * m->id / m->thread_count;
+	size_t rank_end = m->total * (m->id + 1) / m->thread_count;
+	size_t *begin = (size_t *) malloc((k + 1) * sizeof(begin[0]));
+	size_t *end = (size_t *) malloc((k + 1) * sizeof(end[0]));
+	struct sort_writer w;
+	if (begin == NULL || end == NULL ||
+	    sort_writer_create(&w, tmp_fd, rank_begin == 0) != 0) {
+		free(begin);
+		free(end);
+		errno = ENOMEM;
+		return -1;
+	}
+	int rc = -1;
+	if (sort_engine_split(e, rank_begin, begin) != 0 ||
+	    sort_engine_split(e, rank_end, end) != 0 ||
+	    sort_merge_ranges(e, begin, end, m->buf_capacity, &w) != 0)
+		goto end;
+	if (m->id == m->thread_count - 1 && m->total > 0)
+		w.buf[w.size++] = '\n';
+	if (sort_writer_flush(&w) != 0)
+		goto end;
+	m->size = w.total;
+	rc = 0;
+end:;
+	int err = errno;
+	sort_writer_destroy(&w);
+	free(begin);
+	free(end);
+	errno = err;
+	return rc;
+}
+
+static void *
+sort_merge_thread_f(void *arg)
+{
+	struct sort_merge_thread *m = (struct sort_merge_thread *) arg;
+	int tmp_fd = sort_tmp_file_new(m->e->tmp_dir);
+	m->rc = tmp_fd >= 0 ? sort_merge_slice(m, tmp_fd) : -1;
+	m->err = errno;
+	/* The slice offset is known when all are merged. */
+	pthread_barrier_wait(m->barrier);
+	if (m->rc != 0)
+		goto end;
+	off_t offset = 0;
+	for (int i = 0; i < m->id; ++i) {
+		if (m->threads[i].rc != 0)
+			goto end;
+		offset += m->threads[i].size;
+	}
+	if (sort_copy(tmp_fd, m->fd, offset, m->size) != 0) {
+		m->rc = -1;
+		m->err = errno;
+	}
+end:
+	if (tmp_fd >= 0)
+		close(tmp_fd);
+	return NULL;
+}
+
+int
+sort_engine_merge_mt(struct sort_engine *e, int fd, int thread_count)
+{
+	if (thread_count <= 1)
+		return sort_engine_merge(e, fd);
+	struct sort_merge_thread *threads = (struct sort_merge_thread *)
+		calloc(thread_count, sizeof(threads[0]));
+	if (threads == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < e->run_count; ++i)
+		total += e->runs[i].count;
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, thread_count);
+	size_t buf_capacity = sort_merge_buf_capacity(e, thread_count);
+	for (int i = 0; i < thread_count; ++i) {
+		struct sort_merge_thread *m = &threads[i];
+		m->e = e;
+		m->id = i;
+		m->thread_count = thread_count;
+		m->threads = threads;
+		m->barrier = &barrier;
+		m->total = total;
+		m->buf_capacity = buf_capacity;
+		m->fd = fd;
+		if (pthread_create(&m->thread, NULL, sort_merge_thread_f,
+				   m) != 0)
+			abort();
+	}
+	int rc = 0;
+	int err = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].rc != 0 && rc == 0) {
+			rc = -1;
+			err = threads[i].err;
+		}
+	}
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+	errno = err;
+	return rc;
+}
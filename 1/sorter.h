@@ -0,0 +1,171 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * External merge sort of text files with integers. Each file is
+ * parsed and sorted in chunks which fit into a memory limit. The
+ * sorted chunks (runs) are spilled into temporary files when the
+ * memory is over, and in the end all the runs are merged into the
+ * output.
+ *
+ * Files are sorted in coroutines. The long loops check the time
+ * quantum via coro_yield_if_quantum_expired(), and the I/O is done
+ * with coro_read() and coro_write().
+ */
+
+/** A sorted sequence of numbers, in memory or in a file. */
+struct sort_run {
+	/** Numbers of a run kept in memory. NULL for a file run. */
+	int *data;
+	/** Temporary file of a spilled run. -1 for a memory run. */
+	int fd;
+	/** True, if the file has to be closed with this run. */
+	bool is_fd_owner;
+	/** Position of the run in the file, in bytes. */
+	off_t offset;
+	/** Number of numbers in the run. */
+	size_t count;
+};
+
+struct sort_engine {
+	/**
+	 * Memory limit in bytes. Half of it is given to the runs
+	 * kept in memory, the other half to the sort buffers.
+	 */
+	size_t mem_limit;
+	/** Memory taken by the runs kept in memory. */
+	size_t mem_kept;
+	/** Directory for the temporary files. */
+	const char *tmp_dir;
+	/**
+	 * Protects the runs and the memory accounting. Files can be
+	 * sorted by several threads.
+	 */
+	pthread_mutex_t mutex;
+	/** All the sorted runs of all the files. */
+	struct sort_run *runs;
+	size_t run_count;
+	size_t run_capacity;
+};
+
+/** Create an engine with no runs. */
+void
+sort_engine_create(struct sort_engine *e, size_t mem_limit,
+		   const char *tmp_dir);
+
+/** Free all the runs and close their files. */
+void
+sort_engine_destroy(struct sort_engine *e);
+
+/**
+ * Parse the file @a path and sort it into runs. The file is
+ * processed in chunks of @a chunk_count numbers. It needs
+ * 2 * @a chunk_count numbers of memory. Must be called from a
+ * coroutine. Several coroutines and threads can do it at once.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+sort_engine_add_file(struct sort_engine *e, const char *path,
+		     size_t chunk_count);
+
+/**
+ * Merge all the runs into @a fd as text.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+sort_engine_merge(struct sort_engine *e, int fd);
+
+/**
+ * Same as sort_engine_merge(), but in @a thread_count threads. The
+ * output is split into equal slices by rank, and each thread finds
+ * the bounds of its slice in all the runs with a binary search
+ * (merge path). The slices are merged into temporary files in
+ * parallel, and then copied into @a fd at their offsets.
+ */
+int
+sort_engine_merge_mt(struct sort_engine *e, int fd, int thread_count);
+
+/**
+ * Sort @a data of @a count numbers. @a tmp is a buffer of the same
+ * size. Least significant digit radix sort, a byte per pass.
+ */
+void
+sort_radix(int *data, int *tmp, size_t count);
+
+/**
+ * Number parsing. The input is split into buffers arbitrarily, so
+ * a number can be split between them. The parser state keeps the
+ * beginning of such a number.
+ */
+struct sort_parser {
+	/** Value of the digits seen so far. */
+	unsigned value;
+	/** True, if the previous buffer ended inside a number. */
+	bool is_in_number;
+	/** True, if the previous buffer ended with a minus. */
+	bool is_negative;
+};
+
+enum {
+	/**
+	 * The SIMD parsers read whole vectors, so the buffer must
+	 * have that many readable bytes before its start and after
+	 * its end.
+	 */
+	SORT_PARSE_PADDING = 64,
+	/** Max length of a printed int with a separator. */
+	SORT_INT_MAX_LEN = 12,
+};
+
+/**
+ * Parse numbers from @a buf of @a size bytes, and append them to
+ * @a out which has @a *count of @a capacity numbers filled. The
+ * byte at @a buf[size] must not be a digit. The parsing stops
+ * when @a out is full.
+ * @return Number of the parsed bytes.
+ */
+typedef size_t
+(*sort_parse_f)(struct sort_parser *p, const char *buf, size_t size,
+		int *out, size_t *count, size_t capacity);
+
+/**
+ * The fastest parser supported by the CPU. Chosen on the first
+ * call.
+ */
+size_t
+sort_parse(struct sort_parser *p, const char *buf, size_t size,
+	   int *out, size_t *count, size_t capacity);
+
+/** Byte by byte parser, works everywhere. */
+size_t
+sort_parse_scalar(struct sort_parser *p, const char *buf, size_t size,
+		  int *out, size_t *count, size_t capacity);
+
+/**
+ * Parsers which find the number boundaries 16 or 32 bytes at
+ * once, and convert up to 16 digits at once. NULL if the CPU does
+ * not support them.
+ */
+sort_parse_f
+sort_parse_sse42(void);
+
+sort_parse_f
+sort_parse_avx2(void);
+
+/**
+ * Print @a value into @a pos. Up to SORT_INT_MAX_LEN bytes can be
+ * changed, even if the number is shorter.
+ * @return The end of the printed number.
+ */
+char *
+sort_itoa(char *pos, int value);
+
+/** sort_itoa() without SIMD, 2 digits per step. */
+char *
+sort_itoa_scalar(char *pos, int value);
@@ -0,0 +1,220 @@
+#include "exec.h"
+#include "parser.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmark of the pipeline start latency with posix_spawn() and
+ * with fork(). Each pipeline is 'true | true | ...' of 1 to 16
+ * stages, so the time is spent almost only on starting and
+ * reaping the processes. fork() copies the page tables of the
+ * shell, so the shell is made bigger with a ballast of touched
+ * memory to show how it scales.
+ *
+ * Then the throughput of the data moved by 'cat' stages is
+ * measured, with the stages done by the shell in the zero-copy
+ * mode, and with the real cat started with fork() and exec. The
+ * file is in the page cache after it is made, so it is the memory
+ * bandwidth which is measured, not the disk.
+ *
+ * In the end a script of independent lines is run as the
+ * background jobs with different job limits:
+ *
+ * $> ./bench [-r ballast_mb] [-s file_mb] [-t tmp_dir]
+ */
+
+enum {
+	BENCH_PROCESS_COUNT = 2000,
+	BENCH_MAX_STAGES = 16,
+	BENCH_DEFAULT_BALLAST_MB = 256,
+	BENCH_DEFAULT_FILE_MB = 1024,
+	BENCH_COPY_REPEATS = 3,
+	BENCH_MAX_LINE = 1024,
+	BENCH_BATCH_LINES = 64,
+	BENCH_MAX_JOB_LIMIT = 16,
+};
+
+/** Mostly waits, so the jobs overlap even on one CPU. */
+static const char *BENCH_BATCH_LINE = "sleep 0.02";
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct command_line *
+bench_line_new(const char *text)
+{
+	struct parser *p = parser_new();
+	parser_feed(p, text, strlen(text));
+	parser_feed(p, "\n", 1);
+	struct command_line *line;
+	if (parser_pop_next(p, &line) != PARSER_ERR_NONE || line == NULL)
+		abort();
+	parser_delete(p);
+	return line;
+}
+
+static void
+bench_run(const char *name, enum exec_mode mode, size_t ballast_mb)
+{
+	struct exec_ctx ctx;
+	if (exec_ctx_create(&ctx, mode) != 0)
+		abort();
+	for (int stages = 1; stages <= BENCH_MAX_STAGES; stages *= 2) {
+		char text[BENCH_MAX_LINE] = "true";
+		for (int i = 1; i < stages; ++i)
+			strcat(text, " | true");
+		int count = BENCH_PROCESS_COUNT / stages;
+		double start = bench_now();
+		for (int i = 0; i < count; ++i) {
+			/* The line is deleted by the executor. */
+			exec_command_line(&ctx, bench_line_new(text));
+			if (ctx.status != 0)
+				abort();
+		}
+		double time = (bench_now() - start) / count;
+		printf("%-6s %4zu MB %2d stages %9.1f us/pipeline "
+		       "%7.1f us/process\n", name, ballast_mb, stages,
+		       time * 1e6, time * 1e6 / stages);
+	}
+	exec_ctx_destroy(&ctx);
+}
+
+/**
+ * Run the lines of a script as the background jobs, at most
+ * @a job_limit at once.
+ */
+static void
+bench_batch(int job_limit)
+{
+	struct exec_ctx ctx;
+	if (exec_ctx_create(&ctx, EXEC_MODE_SPAWN) != 0)
+		abort();
+	ctx.is_all_background = true;
+	ctx.job_limit = job_limit;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_BATCH_LINES; ++i)
+		exec_command_line(&ctx, bench_line_new(BENCH_BATCH_LINE));
+	exec_reap_background(&ctx, true);
+	double time = bench_now() - start;
+	printf("batch  -j %2d %4d lines '%s' %8.1f ms\n", job_limit,
+	       BENCH_BATCH_LINES, BENCH_BATCH_LINE, time * 1e3);
+	exec_ctx_destroy(&ctx);
+}
+
+/**
+ * Run a line made of @a format with the source and the destination
+ * file names, and report the GB/s of @a size bytes.
+ */
+static void
+bench_copy(const char *format, const char *src, const char *dst,
+	   size_t size)
+{
+	char text[BENCH_MAX_LINE];
+	snprintf(text, sizeof(text), format, src, dst, size);
+	for (int is_zero_copy = 1; is_zero_copy >= 0; --is_zero_copy) {
+		struct exec_ctx ctx;
+		if (exec_ctx_create(&ctx, is_zero_copy ? EXEC_MODE_SPAWN :
+				    EXEC_MODE_FORK) != 0)
+			abort();
+		ctx.is_zero_copy = is_zero_copy;
+		double best = 0;
+		for (int i = 0; i < BENCH_COPY_REPEATS; ++i) {
+			struct command_line *line = bench_line_new(text);
+			double start = bench_now();
+			exec_command_line(&ctx, line);
+			double time = bench_now() - start;
+			if (ctx.status != 0)
+				abort();
+			if (best == 0 || time < best)
+				best = time;
+		}
+		printf("%-9s %6.2f GB/s  %s\n",
+		       is_zero_copy ? "zero-copy" : "fork", size / best / 1e9,
+		       text);
+		exec_ctx_destroy(&ctx);
+	}
+	unlink(dst);
+}
+
+static void
+bench_copy_all(size_t file_mb, const char *tmp_dir)
+{
+	char src[BENCH_MAX_LINE], dst[BENCH_MAX_LINE];
+	snprintf(src, sizeof(src), "%s/bench_src.txt", tmp_dir);
+	snprintf(dst, sizeof(dst), "%s/bench_dst.txt", tmp_dir);
+	size_t size = file_mb * 1024 * 1024;
+	int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(src);
+		exit(1);
+	}
+	size_t buf_size = 1024 * 1024;
+	char *buf = (char *) malloc(buf_size);
+	for (size_t i = 0; i < buf_size; ++i)
+		buf[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	for (size_t done = 0; done < size; done += buf_size) {
+		if (write(fd, buf, buf_size) != (ssize_t) buf_size) {
+			perror(src);
+			exit(1);
+		}
+	}
+	free(buf);
+	close(fd);
+	bench_copy("cat %1$s > %2$s", src, dst, size);
+	bench_copy("cat %1$s > /dev/null", src, dst, size);
+	bench_copy("cat %1$s | wc -c > /dev/null", src, dst, size);
+	bench_copy("head -c %3$zu /dev/zero | cat > %2$s", src, dst, size);
+	unlink(src);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t ballast_mb = BENCH_DEFAULT_BALLAST_MB;
+	size_t file_mb = BENCH_DEFAULT_FILE_MB;
+	const char *tmp_dir = "/tmp";
+	int opt;
+	while ((opt = getopt(argc, argv, "r:s:t:")) != -1) {
+		switch (opt) {
+		case 'r':
+			ballast_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			file_mb = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			tmp_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r ballast_mb] "
+				"[-s file_mb] [-t tmp_dir]\n", argv[0]);
+			return 1;
+		}
+	}
+	bench_run("spawn", EXEC_MODE_SPAWN, 0);
+	bench_run("fork", EXEC_MODE_FORK, 0);
+	if (ballast_mb > 0) {
+		size_t size = ballast_mb * 1024 * 1024;
+		char *ballast = (char *) malloc(size);
+		/* Touch it, so the pages are really mapped. */
+		memset(ballast, 1, size);
+		bench_run("spawn", EXEC_MODE_SPAWN, ballast_mb);
+		bench_run("fork", EXEC_MODE_FORK, ballast_mb);
+		free(ballast);
+	}
+	if (file_mb > 0)
+		bench_copy_all(file_mb, tmp_dir);
+	for (int limit = 1; limit <= BENCH_MAX_JOB_LIMIT; limit *= 2)
+		bench_batch(limit);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmark of the command line parser. A script of typical lines
+ * is made in memory and fed to the parser in pieces, like they
+ * come from read(). memcpy() of the same script is the reference
+ * of the memory bandwidth. Then one long line of the same size is
+ * parsed, to check that its pieces are not parsed again and again:
+ *
+ * $> ./bench_parser [script_mb] [piece_size]
+ */
+
+enum {
+	BENCH_DEFAULT_SCRIPT_MB = 100,
+	BENCH_DEFAULT_PIECE_SIZE = 64 * 1024,
+	BENCH_LONG_LINE_SIZE = 10 * 1024 * 1024,
+};
+
+static const char *bench_lines[] = {
+	"echo 'hello world' \"quoted \\\"text\\\"\" plain\\ word\n",
+	"cat file.txt | grep -v pattern | sort | uniq -c > out.txt\n",
+	"false && echo 123 || echo 456 >> log.txt\n",
+	"# A comment line which is skipped entirely by the parser\n",
+	"python3 -c 'print(1 + 2)' arg1 arg2 arg3 arg4 arg5 arg6 \\\n"
+	"\targ7 arg8 # a comment after the arguments\n",
+	"sleep 0.1 &\n",
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_parse(const char *name, const char *script, size_t size,
+	    size_t piece_size)
+{
+	struct parser *p = parser_new();
+	size_t line_count = 0;
+	size_t arg_count = 0;
+	double start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos;
+		if (len > piece_size)
+			len = piece_size;
+		parser_feed(p, script + pos, len);
+		while (true) {
+			struct command_line *line;
+			if (parser_pop_next(p, &line) != PARSER_ERR_NONE)
+				abort();
+			if (line == NULL)
+				break;
+			++line_count;
+			for (struct expr *e = line->head; e != NULL; e = e->next)
+				arg_count += e->cmd.arg_count;
+			command_line_delete(line);
+		}
+	}
+	double time = bench_now() - start;
+	parser_delete(p);
+	printf("%-10s %8.1f MB/s, %5.2f M lines/s, %zu lines, %zu args\n",
+	       name, size / time / 1024 / 1024, line_count / time / 1e6,
+	       line_count, arg_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) :
+		       BENCH_DEFAULT_SCRIPT_MB) * 1024 * 1024;
+	size_t piece_size = argc > 2 ? strtoull(argv[2], NULL, 10) :
+			    BENCH_DEFAULT_PIECE_SIZE;
+	int line_type_count = sizeof(bench_lines) / sizeof(bench_lines[0]);
+	char *script = (char *) malloc(size + 1024);
+	size_t script_size = 0;
+	size_t source_lines = 0;
+	while (script_size < size) {
+		const char *line = bench_lines[source_lines++ % line_type_count];
+		size_t len = strlen(line);
+		memcpy(script + script_size, line, len);
+		script_size += len;
+	}
+	char *copy = (char *) malloc(script_size);
+	/* Fault the pages in, to measure only the copy. */
+	memset(copy, 0, script_size);
+	double start = bench_now();
+	memcpy(copy, script, script_size);
+	/* Do not let the compiler drop the copy. */
+	__asm__ volatile("" : : "r"(copy) : "memory");
+	double time = bench_now() - start;
+	printf("%-10s %8.1f MB/s\n", "memcpy",
+	       script_size / time / 1024 / 1024);
+	free(copy);
+	bench_parse("script", script, script_size, piece_size);
+
+	size_t line_size = BENCH_LONG_LINE_SIZE;
+	if (line_size > script_size)
+		line_size = script_size;
+	memcpy(script, "echo", 4);
+	for (size_t i = 4; i < line_size - 1; i += 2)
+		memcpy(script + i, " a", 2);
+	script[line_size - 1] = '\n';
+	bench_parse("long line", script, line_size, piece_size);
+	free(script);
+	return 0;
+}
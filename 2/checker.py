@@ -1,7 +1,13 @@
 import subprocess
 import argparse
+import shutil
+import socket
+import struct
 import sys
 import os
+import tempfile
+import threading
+import time
 
 parser = argparse.ArgumentParser(description='Tests for shell')
 parser.add_argument('-e', type=str, default='./a.out',
@@ -11,6 +17,15 @@ parser.add_argument('-t', action='store_true', default=False,
 		    help='run without checks')
 parser.add_argument('--max', type=int, choices=[15, 20, 25], default=15,
 		    help='max points number')
+parser.add_argument('--bench', action='store_true', default=False,
+		    help='measure performance instead of the checks')
+parser.add_argument('--bench-scale', type=float, default=1,
+		    help='multiplier of the sizes of the scaled-up benchmarks')
+parser.add_argument('--bench-baseline', type=str, default='/bin/bash',
+		    help='shell to compare with, empty to skip')
+parser.add_argument('--bench-max-ratio', type=float, default=2,
+		    help='fail if the shell is that many times slower than '\
+		    'the baseline')
 args = parser.parse_args()
 
 tests = [
@@ -95,6 +110,244 @@ def exit_failure():
 	print('{}\nThe tests did not pass'.format(prefix))
 	finish(-1)
 
+# Benchmark mode. Each test section and each scaled-up case is run
+# in a new shell in an empty directory, and the same is done with
+# the baseline shell. For each run the wall time, the forks and
+# execs in the process tree of the shell, and the peak RSS of the
+# shell process itself are recorded.
+
+class ProcCounter:
+	'''Counts forks and execs of the descendants of a process with
+	the kernel process events connector. It needs CAP_NET_ADMIN.
+	Without it only the forks are counted, system-wide, from
+	/proc/stat.'''
+
+	NETLINK_CONNECTOR = 11
+	CN_IDX_PROC = 1
+	CN_VAL_PROC = 1
+	PROC_CN_MCAST_LISTEN = 1
+	PROC_CN_MCAST_IGNORE = 2
+	PROC_EVENT_FORK = 0x1
+	PROC_EVENT_EXEC = 0x2
+	SO_RCVBUFFORCE = 33
+	# nlmsghdr, cn_msg, and the proc_event header.
+	EVENT_OFFSET = 16 + 20
+	DATA_OFFSET = EVENT_OFFSET + 16
+
+	def __init__(self):
+		self.events = []
+		self.sock = None
+		self.forks_before = None
+		try:
+			self.sock = socket.socket(socket.AF_NETLINK,
+						  socket.SOCK_DGRAM,
+						  self.NETLINK_CONNECTOR)
+			try:
+				self.sock.setsockopt(socket.SOL_SOCKET,
+						     self.SO_RCVBUFFORCE,
+						     64 * 1024 * 1024)
+			except OSError:
+				pass
+			self.sock.bind((0, self.CN_IDX_PROC))
+			self.control(self.PROC_CN_MCAST_LISTEN)
+		except OSError:
+			if self.sock is not None:
+				self.sock.close()
+			self.sock = None
+			self.forks_before = self.system_fork_count()
+			return
+		self.sock.settimeout(0.05)
+		self.is_running = True
+		self.thread = threading.Thread(target=self.read)
+		self.thread.start()
+
+	@staticmethod
+	def system_fork_count():
+		with open('/proc/stat') as f:
+			for line in f:
+				if line.startswith('processes '):
+					return int(line.split()[1])
+		return 0
+
+	def control(self, op):
+		cn = struct.pack('=IIIIHHI', self.CN_IDX_PROC,
+				 self.CN_VAL_PROC, 0, 0, 4, 0, op)
+		nl = struct.pack('=IHHII', 16 + len(cn), 3, 0, 0,
+				 self.sock.getsockname()[0])
+		self.sock.sendto(nl + cn, (0, 0))
+
+	def read(self):
+		while self.is_running:
+			try:
+				self.events.append(self.sock.recv(4096))
+			except socket.timeout:
+				continue
+			except OSError:
+				break
+
+	def stop(self, root):
+		'''Return forks and execs of the descendants of root. Execs
+		are None, if they can not be counted.'''
+		if self.sock is None:
+			# The shell itself is a fork too.
+			forks = self.system_fork_count() - self.forks_before - 1
+			return forks, None
+		# Let the last events come.
+		time.sleep(0.05)
+		self.is_running = False
+		self.thread.join()
+		self.control(self.PROC_CN_MCAST_IGNORE)
+		self.sock.close()
+		tree = {root}
+		forks = 0
+		execs = 0
+		for data in self.events:
+			if len(data) < self.DATA_OFFSET + 8:
+				continue
+			what, = struct.unpack_from('=I', data, self.EVENT_OFFSET)
+			if what == self.PROC_EVENT_FORK:
+				_, parent, pid, tgid = struct.unpack_from(
+					'=IIII', data, self.DATA_OFFSET)
+				# Threads are not counted.
+				if parent in tree and pid == tgid:
+					tree.add(pid)
+					forks += 1
+			elif what == self.PROC_EVENT_EXEC:
+				_, tgid = struct.unpack_from('=II', data,
+							     self.DATA_OFFSET)
+				if tgid in tree and tgid != root:
+					execs += 1
+		return forks, execs
+
+class PeakRssMonitor:
+	'''Samples VmHWM of a process until it ends. VmHWM only grows,
+	so the last sample is close to the peak.'''
+
+	def __init__(self, pid):
+		self.path = '/proc/{}/status'.format(pid)
+		self.peak_kb = 0
+		self.is_running = True
+		self.thread = threading.Thread(target=self.read)
+		self.thread.start()
+
+	def read(self):
+		while self.is_running:
+			try:
+				with open(self.path) as f:
+					for line in f:
+						if line.startswith('VmHWM:'):
+							self.peak_kb = max(self.peak_kb,
+								int(line.split()[1]))
+			except (OSError, ValueError):
+				break
+			time.sleep(0.005)
+
+	def stop(self):
+		self.is_running = False
+		self.thread.join()
+		return self.peak_kb
+
+def bench_run(shell, script, timeout):
+	'''Run the script in a new shell in an empty directory. Return
+	the output and the stats.'''
+	workdir = tempfile.mkdtemp(prefix='shell_bench_')
+	counter = ProcCounter()
+	start = time.perf_counter()
+	p = subprocess.Popen([shell], shell=False, stdin=subprocess.PIPE,
+			     stdout=subprocess.PIPE,
+			     stderr=subprocess.STDOUT, cwd=workdir)
+	monitor = PeakRssMonitor(p.pid)
+	try:
+		output = p.communicate(script.encode(), timeout)[0]
+	except subprocess.TimeoutExpired:
+		p.kill()
+		output = p.communicate()[0]
+		print('{}: timeout'.format(shell))
+	elapsed = time.perf_counter() - start
+	peak_kb = monitor.stop()
+	forks, execs = counter.stop(p.pid)
+	shutil.rmtree(workdir, ignore_errors=True)
+	return output, {'time': elapsed, 'forks': forks, 'execs': execs,
+			'rss_kb': peak_kb}
+
+def bench_cases():
+	'''The test sections and the scaled-up cases as name, script.'''
+	cases = []
+	for section_i, section in enumerate(tests, 1):
+		if section_i == 5 and args.max == 15:
+			break
+		if section_i == 6 and args.max != 25:
+			break
+		cases.append(('section {}'.format(section_i),
+			      '\n'.join(section) + '\n'))
+	scale = args.bench_scale
+	stages = max(1, int(1000 * scale))
+	cases.append(('{}-stage pipeline'.format(stages),
+		      'echo pipeline' + ' | cat' * stages + '\n'))
+	size = max(1, int(1024 * 1024 * 1024 * scale))
+	cases.append(('{} MB through yes | head | wc'.format(size >> 20),
+		      'yes | head -c {} | wc -c\n'.format(size)))
+	count = max(1, int(10000 * scale))
+	cases.append(('{} x true && echo'.format(count),
+		      'true && echo 1\n' * count))
+	count = max(1, int(100 * 1000 * scale))
+	cases.append(('{} args'.format(count),
+		      'echo' + ' a' * count + ' | wc -c\n'))
+	count = max(1, int(100 * scale))
+	cases.append(('{} x background sleep'.format(count),
+		      'sleep 0.05 &\n' * count + 'wait\n'))
+	return cases
+
+# Bash runs echo, true, test and others as builtins, while the shell
+# under test has only cd, exit and wait, and starts a process for any
+# other command. The baseline bash turns off its other builtins,
+# which exist as programs, so both shells start the same processes.
+bash_no_builtins = 'for b in $(compgen -b); do case $b in cd|exit|wait) '\
+	'continue ;; esac; for d in ${PATH//:/ }; do if [[ -x $d/$b ]]; '\
+	'then enable -n "$b"; break; fi; done; done\n'
+
+def bench_format_stats(stats):
+	execs = '-' if stats['execs'] is None else stats['execs']
+	return '{:9.3f} s {:7} forks {:7} execs {:8} KB'.format(
+		stats['time'], stats['forks'], execs, stats['rss_kb'])
+
+def bench():
+	shell = os.path.abspath(args.e)
+	baseline = args.bench_baseline
+	if baseline:
+		baseline = shutil.which(baseline)
+	timeout = max(60, 600 * args.bench_scale)
+	is_error = False
+	for name, script in bench_cases():
+		output, stats = bench_run(shell, script, timeout)
+		print('{:32} {}'.format(name, bench_format_stats(stats)))
+		if not baseline:
+			continue
+		base_script = script
+		if os.path.basename(baseline) == 'bash':
+			base_script = bash_no_builtins + script
+		base_output, base_stats = bench_run(baseline, base_script,
+						    timeout)
+		ratio = stats['time'] / base_stats['time']
+		print('{:32} {} x{:.2f}'.format('  ' + os.path.basename(baseline),
+			bench_format_stats(base_stats), ratio))
+		# The sections of the checks test the output themselves.
+		if not name.startswith('section') and output != base_output:
+			print('  different output from the baseline')
+			is_error = True
+		if ratio > args.bench_max_ratio:
+			print('  slower than the baseline more than '\
+			      'x{}'.format(args.bench_max_ratio))
+			is_error = True
+	if is_error:
+		print('{}\nThe benchmark did not pass'.format(prefix))
+		sys.exit(-1)
+	print('{}\nThe benchmark passed'.format(prefix))
+	sys.exit(0)
+
+if args.bench:
+	bench()
+
 command = ''
 for section_i, section in enumerate(tests, 1):
 	if section_i == 5 and args.max == 15:
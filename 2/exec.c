@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+#include "exec.h"
+#include "parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+enum {
+	EXEC_STATUS_NOT_FOUND = 127,
+	/** Max size of one splice(), sendfile() or copy_file_range(). */
+	EXEC_COPY_CHUNK = 1 << 30,
+	/** Buffer of the copy when the kernel can not do it. */
+	EXEC_COPY_BUF_SIZE = 64 * 1024,
+	/** Pipes are made bigger for splice(), for fewer wakeups. */
+	EXEC_COPY_PIPE_SIZE = 1024 * 1024,
+};
+
+enum exec_copy_method {
+	EXEC_COPY_SPLICE,
+	EXEC_COPY_FILE_RANGE,
+	EXEC_COPY_SENDFILE,
+	EXEC_COPY_READ_WRITE,
+};
+
+int
+exec_ctx_create(struct exec_ctx *ctx, enum exec_mode mode)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->mode = mode;
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	return ctx->epoll_fd < 0 ? -1 : 0;
+}
+
+static inline bool
+exec_is_builtin(const struct command *cmd)
+{
+	return strcmp(cmd->exe, "cd") == 0 || strcmp(cmd->exe, "exit") == 0 ||
+	       strcmp(cmd->exe, "wait") == 0;
+}
+
+/** Run a builtin in the current process. @return Exit status. */
+static int
+exec_builtin(struct exec_ctx *ctx, const struct command *cmd)
+{
+	if (strcmp(cmd->exe, "exit") == 0)
+		return cmd->arg_count > 1 ? atoi(cmd->args[1]) : ctx->status;
+	if (strcmp(cmd->exe, "wait") == 0) {
+		/* A child has no jobs to wait for. */
+		exec_reap_background(ctx, true);
+		return 0;
+	}
+	const char *dir = cmd->arg_count > 1 ? cmd->args[1] : getenv("HOME");
+	if (dir == NULL || chdir(dir) != 0) {
+		fprintf(stderr, "cd: %s: %s\n", dir == NULL ? "" : dir,
+			strerror(dir == NULL ? ENOENT : errno));
+		return 1;
+	}
+	return 0;
+}
+
+/** True, if the command is a 'cat' which the shell can do itself. */
+static bool
+exec_is_zero_copy(const struct exec_ctx *ctx, const struct command *cmd)
+{
+	if (!ctx->is_zero_copy || strcmp(cmd->exe, "cat") != 0)
+		return false;
+	for (uint32_t i = 1; i < cmd->arg_count; ++i) {
+		if (cmd->args[i][0] == '-')
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Move all the data from @a in to @a out. The fastest method the
+ * descriptor types allow is tried first. When the kernel rejects
+ * it, the next one is tried. The descriptor offsets are used and
+ * moved, so a method can be changed at any moment.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+static int
+exec_copy(int in, int out)
+{
+	struct stat in_st, out_st;
+	if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0)
+		return -1;
+	enum exec_copy_method method;
+	if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+		method = EXEC_COPY_SPLICE;
+		/* Can fail on the limit of the user. Not critical. */
+		if (S_ISFIFO(in_st.st_mode))
+			fcntl(in, F_SETPIPE_SZ, EXEC_COPY_PIPE_SIZE);
+		if (S_ISFIFO(out_st.st_mode))
+			fcntl(out, F_SETPIPE_SZ, EXEC_COPY_PIPE_SIZE);
+	} else if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+		method = EXEC_COPY_FILE_RANGE;
+	else if (S_ISREG(in_st.st_mode))
+		method = EXEC_COPY_SENDFILE;
+	else
+		method = EXEC_COPY_READ_WRITE;
+	char *buf = NULL;
+	ssize_t rc;
+	while (true) {
+		switch (method) {
+		case EXEC_COPY_SPLICE:
+			rc = splice(in, NULL, out, NULL, EXEC_COPY_CHUNK,
+				    SPLICE_F_MOVE);
+			break;
+		case EXEC_COPY_FILE_RANGE:
+			rc = copy_file_range(in, NULL, out, NULL,
+					     EXEC_COPY_CHUNK, 0);
+			break;
+		case EXEC_COPY_SENDFILE:
+			rc = sendfile(out, in, NULL, EXEC_COPY_CHUNK);
+			break;
+		default:
+			if (buf == NULL)
+				buf = (char *) malloc(EXEC_COPY_BUF_SIZE);
+			rc = read(in, buf, EXEC_COPY_BUF_SIZE);
+			for (ssize_t done = 0; rc > 0 && done < rc;) {
+				ssize_t n = write(out, buf + done, rc - done);
+				if (n < 0 && errno != EINTR)
+					rc = n;
+				else if (n > 0)
+					done += n;
+			}
+			break;
+		}
+		if (rc == 0)
+			break;
+		if (rc > 0 || errno == EINTR)
+			continue;
+		if (method == EXEC_COPY_READ_WRITE ||
+		    (errno != EINVAL && errno != ENOSYS && errno != EXDEV &&
+		     errno != EBADF && errno != EOPNOTSUPP))
+			break;
+		/* Can not do it for these descriptors. Try the next. */
+		if (method == EXEC_COPY_FILE_RANGE)
+			method = EXEC_COPY_SENDFILE;
+		else
+			method = EXEC_COPY_READ_WRITE;
+	}
+	int save_errno = errno;
+	free(buf);
+	errno = save_errno;
+	return rc == 0 ? 0 : -1;
+}
+
+/**
+ * Do a 'cat' stage in the shell, from @a in or from the files of
+ * the command into @a out.
+ * @return Exit status.
+ */
+static int
+exec_cat(const struct command *cmd, int in, int out)
+{
+	/*
+	 * The readers can exit before the end. Get EPIPE instead of
+	 * the signal killing the shell.
+	 */
+	sigset_t set, old;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &set, &old);
+	int status = 0;
+	for (uint32_t i = 1; i < cmd->arg_count || i == 1; ++i) {
+		int fd = in;
+		const char *name = "stdin";
+		if (cmd->arg_count > 1) {
+			name = cmd->args[i];
+			fd = open(name, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				fprintf(stderr, "cat: %s: %s\n", name,
+					strerror(errno));
+				status = 1;
+				continue;
+			}
+		}
+		int rc = exec_copy(fd, out);
+		int err = errno;
+		if (fd != in)
+			close(fd);
+		if (rc == 0)
+			continue;
+		if (err == EPIPE) {
+			/* As if the real cat was killed by SIGPIPE. */
+			status = 128 + SIGPIPE;
+			break;
+		}
+		fprintf(stderr, "cat: %s: %s\n", name, strerror(err));
+		status = 1;
+	}
+	sigset_t pending;
+	sigpending(&pending);
+	if (sigismember(&pending, SIGPIPE) && !sigismember(&old, SIGPIPE)) {
+		struct timespec zero = {0, 0};
+		sigtimedwait(&set, NULL, &zero);
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return status;
+}
+
+static int
+exec_status(int wstatus)
+{
+	if (WIFEXITED(wstatus))
+		return WEXITSTATUS(wstatus);
+	return 128 + WTERMSIG(wstatus);
+}
+
+/**
+ * Start @a cmd with @a in as stdin and @a out as stdout. All the
+ * other descriptors of the shell are close-on-exec.
+ * @return Pid of the child, or -1 on error.
+ */
+static pid_t
+exec_start(struct exec_ctx *ctx, const struct command *cmd, int in, int out)
+{
+	pid_t pid;
+	if (ctx->mode == EXEC_MODE_SPAWN && !exec_is_builtin(cmd)) {
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		if (in != STDIN_FILENO)
+			posix_spawn_file_actions_adddup2(&actions, in,
+							 STDIN_FILENO);
+		if (out != STDOUT_FILENO)
+			posix_spawn_file_actions_adddup2(&actions, out,
+							 STDOUT_FILENO);
+		int rc = posix_spawnp(&pid, cmd->exe, &actions, NULL,
+				      cmd->args, environ);
+		posix_spawn_file_actions_destroy(&actions);
+		if (rc != 0) {
+			fprintf(stderr, "%s: %s\n", cmd->exe, strerror(rc));
+			return -1;
+		}
+		return pid;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid > 0)
+		return pid;
+	if (in != STDIN_FILENO)
+		dup2(in, STDIN_FILENO);
+	if (out != STDOUT_FILENO)
+		dup2(out, STDOUT_FILENO);
+	if (exec_is_builtin(cmd)) {
+		/* The jobs of the shell are not the child's. */
+		ctx->background_count = 0;
+		ctx->procs = NULL;
+		_exit(exec_builtin(ctx, cmd));
+	}
+	execvp(cmd->exe, cmd->args);
+	fprintf(stderr, "%s: %s\n", cmd->exe, strerror(errno));
+	_exit(EXEC_STATUS_NOT_FOUND);
+}
+
+/** A started process of a job. */
+struct exec_proc {
+	struct exec_job *job;
+	pid_t pid;
+	/** pidfd of the process in the epoll, or -1. */
+	int fd;
+	/** All the running processes are in a list. */
+	struct exec_proc *prev;
+	struct exec_proc *next;
+};
+
+/** A command line being executed pipeline by pipeline. */
+struct exec_job {
+	struct command_line *line;
+	/** The first command of the running pipeline. */
+	const struct expr *pipeline;
+	/** Output of the last command of the line. */
+	int out;
+	/** The not yet reaped processes of the running pipeline. */
+	int proc_count;
+	/** The last command of the pipeline. 0, if done by the shell. */
+	pid_t last_pid;
+	/** Exit status of the last finished pipeline. */
+	int status;
+	bool is_background;
+};
+
+/** @return The operator after the pipeline, or NULL. */
+static const struct expr *
+exec_pipeline_end(const struct expr *first)
+{
+	const struct expr *op = first->next;
+	while (op != NULL && op->type == EXPR_TYPE_PIPE)
+		op = op->next->next;
+	return op;
+}
+
+static void
+exec_proc_add(struct exec_ctx *ctx, struct exec_job *job, pid_t pid)
+{
+	struct exec_proc *proc = (struct exec_proc *) malloc(sizeof(*proc));
+	proc->job = job;
+	proc->pid = pid;
+	proc->fd = syscall(SYS_pidfd_open, pid, 0);
+	if (proc->fd >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = proc;
+		if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, proc->fd, &ev) != 0) {
+			close(proc->fd);
+			proc->fd = -1;
+		}
+	}
+	if (proc->fd < 0)
+		++ctx->proc_without_fd_count;
+	proc->prev = NULL;
+	proc->next = ctx->procs;
+	if (ctx->procs != NULL)
+		ctx->procs->prev = proc;
+	ctx->procs = proc;
+	++job->proc_count;
+}
+
+/**
+ * Start the commands of the job's current pipeline. A builtin
+ * alone in a foreground job is done right here.
+ */
+static void
+exec_pipeline_start(struct exec_ctx *ctx, struct exec_job *job)
+{
+	const struct expr *first = job->pipeline;
+	const struct expr *op = exec_pipeline_end(first);
+	const struct command *cmd = &first->cmd;
+	job->last_pid = 0;
+	if (first->next == op && exec_is_builtin(cmd) && !job->is_background) {
+		/* A builtin alone affects the shell itself. */
+		job->status = exec_builtin(ctx, cmd);
+		if (strcmp(cmd->exe, "exit") == 0)
+			ctx->is_exit = true;
+		return;
+	}
+	/* Only the last command of the line is redirected. */
+	int out = op == NULL ? job->out : STDOUT_FILENO;
+	job->status = EXEC_STATUS_NOT_FOUND;
+	int in = STDIN_FILENO;
+	const struct command *copy_cmd = NULL;
+	int copy_in = -1, copy_out = -1;
+	bool is_copy_out_owned = false;
+	bool is_copy_last = false;
+	const struct expr *e = first;
+	while (true) {
+		const struct expr *next = e->next;
+		bool is_last = next == op;
+		int fds[2] = {-1, -1};
+		int stage_out = out;
+		if (!is_last) {
+			if (pipe2(fds, O_CLOEXEC) != 0) {
+				perror("pipe");
+				break;
+			}
+			stage_out = fds[1];
+		}
+		/*
+		 * The copy blocks the shell until the stage ends, so
+		 * a background job runs a real 'cat'.
+		 */
+		if (copy_cmd == NULL && !job->is_background &&
+		    exec_is_zero_copy(ctx, &e->cmd)) {
+			/* Keep the descriptors until the copy is done. */
+			copy_cmd = &e->cmd;
+			copy_in = in;
+			copy_out = stage_out;
+			is_copy_out_owned = !is_last;
+			is_copy_last = is_last;
+		} else {
+			pid_t pid = exec_start(ctx, &e->cmd, in, stage_out);
+			if (pid > 0)
+				exec_proc_add(ctx, job, pid);
+			if (is_last)
+				job->last_pid = pid;
+			if (in != STDIN_FILENO)
+				close(in);
+			if (fds[1] >= 0)
+				close(fds[1]);
+		}
+		in = fds[0];
+		if (is_last)
+			break;
+		e = next->next;
+	}
+	if (in >= 0 && in != STDIN_FILENO)
+		close(in);
+	if (copy_cmd != NULL) {
+		int copy_status = exec_cat(copy_cmd, copy_in, copy_out);
+		if (copy_in != STDIN_FILENO)
+			close(copy_in);
+		if (is_copy_out_owned)
+			close(copy_out);
+		if (is_copy_last)
+			job->status = copy_status;
+	}
+}
+
+static void
+exec_job_delete(struct exec_ctx *ctx, struct exec_job *job)
+{
+	if (job->out != STDOUT_FILENO)
+		close(job->out);
+	if (job->is_background)
+		--ctx->background_count;
+	else
+		ctx->foreground = NULL;
+	command_line_delete(job->line);
+	free(job);
+}
+
+/**
+ * The current pipeline of the job has ended. Start the next one,
+ * which has to run, or end the job.
+ */
+static void
+exec_job_next(struct exec_ctx *ctx, struct exec_job *job)
+{
+	while (true) {
+		if (ctx->is_exit && !job->is_background)
+			break;
+		const struct expr *op = exec_pipeline_end(job->pipeline);
+		/* The skipped pipelines keep the status as is. */
+		while (op != NULL &&
+		       (op->type == EXPR_TYPE_AND) != (job->status == 0))
+			op = exec_pipeline_end(op->next);
+		if (op == NULL)
+			break;
+		job->pipeline = op->next;
+		exec_pipeline_start(ctx, job);
+		if (job->proc_count > 0)
+			return;
+	}
+	if (!job->is_background)
+		ctx->status = job->status;
+	exec_job_delete(ctx, job);
+}
+
+static void
+exec_proc_end(struct exec_ctx *ctx, struct exec_proc *proc, int status)
+{
+	if (proc->fd >= 0) {
+		/*
+		 * The forked children can still have a copy of the
+		 * descriptor, so closing it does not remove it from
+		 * the epoll.
+		 */
+		epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, proc->fd, NULL);
+		close(proc->fd);
+	} else {
+		--ctx->proc_without_fd_count;
+	}
+	if (proc->prev != NULL)
+		proc->prev->next = proc->next;
+	else
+		ctx->procs = proc->next;
+	if (proc->next != NULL)
+		proc->next->prev = proc->prev;
+	struct exec_job *job = proc->job;
+	if (proc->pid == job->last_pid)
+		job->status = status;
+	free(proc);
+	if (--job->proc_count == 0)
+		exec_job_next(ctx, job);
+}
+
+/**
+ * Reap one ended process and move its job on.
+ * @retval true A process was reaped.
+ * @retval false No process ended, or no process is running.
+ */
+static bool
+exec_wait_event(struct exec_ctx *ctx, bool is_blocking)
+{
+	if (ctx->procs == NULL)
+		return false;
+	if (ctx->proc_without_fd_count > 0) {
+		int wstatus;
+		pid_t pid = waitpid(-1, &wstatus, is_blocking ? 0 : WNOHANG);
+		if (pid <= 0)
+			return false;
+		struct exec_proc *proc = ctx->procs;
+		while (proc != NULL && proc->pid != pid)
+			proc = proc->next;
+		if (proc != NULL)
+			exec_proc_end(ctx, proc, exec_status(wstatus));
+		return true;
+	}
+	/*
+	 * One event at a time. Handling of one process can end the
+	 * others, and their events would be stale.
+	 */
+	struct epoll_event ev;
+	int rc = epoll_wait(ctx->epoll_fd, &ev, 1, is_blocking ? -1 : 0);
+	if (rc <= 0)
+		return rc < 0 && errno == EINTR;
+	struct exec_proc *proc = (struct exec_proc *) ev.data.ptr;
+	siginfo_t info;
+	memset(&info, 0, sizeof(info));
+	while (waitid(P_PIDFD, proc->fd, &info, WEXITED) != 0 &&
+	       errno == EINTR)
+		continue;
+	int status = info.si_code == CLD_EXITED ? info.si_status :
+		     128 + info.si_status;
+	exec_proc_end(ctx, proc, status);
+	return true;
+}
+
+void
+exec_command_line(struct exec_ctx *ctx, struct command_line *line)
+{
+	const struct expr *first = line->head;
+	if (ctx->is_all_background &&
+	    (first->next != NULL || !exec_is_builtin(&first->cmd)))
+		line->is_background = true;
+	if (line->is_background) {
+		while (ctx->job_limit > 0 &&
+		       ctx->background_count >= ctx->job_limit)
+			exec_wait_event(ctx, true);
+	}
+	int out = STDOUT_FILENO;
+	if (line->out_type != OUTPUT_TYPE_STDOUT) {
+		int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+		if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+			flags |= O_TRUNC;
+		else
+			flags |= O_APPEND;
+		out = open(line->out_file, flags, 0644);
+		if (out < 0) {
+			fprintf(stderr, "%s: %s\n", line->out_file,
+				strerror(errno));
+			if (!line->is_background)
+				ctx->status = 1;
+			command_line_delete(line);
+			return;
+		}
+	}
+	struct exec_job *job = (struct exec_job *) calloc(1, sizeof(*job));
+	job->line = line;
+	job->pipeline = first;
+	job->out = out;
+	job->is_background = line->is_background;
+	if (job->is_background) {
+		++ctx->background_count;
+		ctx->status = 0;
+	} else {
+		ctx->foreground = job;
+	}
+	exec_pipeline_start(ctx, job);
+	if (job->proc_count == 0)
+		exec_job_next(ctx, job);
+	while (ctx->foreground != NULL)
+		exec_wait_event(ctx, true);
+}
+
+void
+exec_reap_background(struct exec_ctx *ctx, bool is_blocking)
+{
+	if (!is_blocking) {
+		while (exec_wait_event(ctx, false))
+			continue;
+		return;
+	}
+	while (ctx->background_count > 0)
+		exec_wait_event(ctx, true);
+}
+
+int
+exec_event_fd(const struct exec_ctx *ctx)
+{
+	return ctx->epoll_fd;
+}
+
+void
+exec_ctx_destroy(struct exec_ctx *ctx)
+{
+	exec_reap_background(ctx, true);
+	close(ctx->epoll_fd);
+}
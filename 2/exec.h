@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Execution of the parsed command lines. The commands of a
+ * pipeline are started with posix_spawn(), which in glibc is a
+ * clone() with CLONE_VM | CLONE_VFORK. The child shares the memory
+ * of the shell until exec, so the start does not depend on how
+ * much memory the shell has, unlike fork(), which copies the page
+ * tables. Only the builtins in a pipeline are started with fork(),
+ * because they run shell code in the child.
+ *
+ * In the zero-copy mode a 'cat' stage without options is not
+ * started at all. The shell itself moves its data from the files
+ * or from the input pipe into the stage output with splice(),
+ * copy_file_range() or sendfile(), so the data never goes through
+ * the user space. It is done after all the other stages of the
+ * pipeline are started, so they can drain the pipes meanwhile.
+ *
+ * Each command line is a job, which runs its pipelines one by one,
+ * as the && and || operators say. Nothing waits for a particular
+ * process. Each started process has a pidfd in an epoll, and one
+ * event loop reaps the ended ones and starts the next pipelines of
+ * their jobs, both of the foreground job and of the background
+ * ones. So the background jobs move on while the shell waits for
+ * the foreground one, and the number of them can be limited.
+ */
+
+struct command_line;
+struct exec_job;
+struct exec_proc;
+
+enum exec_mode {
+	/** posix_spawn() for all but the builtins. */
+	EXEC_MODE_SPAWN,
+	/** fork() and execvp() for everything. */
+	EXEC_MODE_FORK,
+};
+
+struct exec_ctx {
+	enum exec_mode mode;
+	/** True, if 'cat' stages are done by the shell. */
+	bool is_zero_copy;
+	/**
+	 * True, if all the lines are background jobs, as if they
+	 * end with '&'. Except for a builtin alone, which has to
+	 * affect the shell.
+	 */
+	bool is_all_background;
+	/**
+	 * Max number of the background jobs at once. A new one
+	 * waits for a free place. 0 is no limit.
+	 */
+	int job_limit;
+	/** Exit status of the last foreground command line. */
+	int status;
+	/** True, if the shell has to exit with the status. */
+	bool is_exit;
+	/** Number of the running background jobs. */
+	int background_count;
+	/** The running foreground job. */
+	struct exec_job *foreground;
+	/** The pidfds of the running processes. */
+	int epoll_fd;
+	/** All the running processes. */
+	struct exec_proc *procs;
+	/**
+	 * The processes without a pidfd. pidfd_open() can fail, and
+	 * then waitpid() is used.
+	 */
+	int proc_without_fd_count;
+};
+
+/**
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+exec_ctx_create(struct exec_ctx *ctx, enum exec_mode mode);
+
+/** Wait for all the jobs and free the context. */
+void
+exec_ctx_destroy(struct exec_ctx *ctx);
+
+/**
+ * Execute @a line. The foreground one is waited for, and the
+ * result is saved in @a ctx. The background one is started, when
+ * there is a free place for it. @a line is deleted when its job
+ * ends.
+ */
+void
+exec_command_line(struct exec_ctx *ctx, struct command_line *line);
+
+/**
+ * Handle the ended processes of the background jobs and start
+ * their next pipelines. With @a is_blocking wait until all the
+ * jobs end.
+ */
+void
+exec_reap_background(struct exec_ctx *ctx, bool is_blocking);
+
+/**
+ * The descriptor which is readable, when there are ended
+ * processes to reap with exec_reap_background().
+ */
+int
+exec_event_fd(const struct exec_ctx *ctx);
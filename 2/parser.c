@@ -0,0 +1,504 @@
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/** The first block of a line arena. Fits most of the lines. */
+	ARENA_FIRST_BLOCK_SIZE = 4096,
+	PARSER_FIRST_ARG_CAPACITY = 8,
+	PARSER_FIRST_RESULT_CAPACITY = 16,
+};
+
+struct arena_block {
+	struct arena_block *next;
+	char data[];
+};
+
+/**
+ * Memory of one command line. Nothing is freed separately, only
+ * the whole arena at once. Each next block is twice bigger, so a
+ * line needs O(log(size)) mallocs, and usually just one.
+ */
+struct arena {
+	/** The newest block is the first. */
+	struct arena_block *blocks;
+	/** Free space of the newest block. */
+	char *pos;
+	char *end;
+	size_t block_size;
+};
+
+/** A command line together with its arena. */
+struct parser_line {
+	struct command_line line;
+	struct arena arena;
+};
+
+enum lex_state {
+	/** Between the tokens. */
+	LEX_SPACE,
+	LEX_WORD,
+	/** After a backslash out of quotes. */
+	LEX_ESCAPE,
+	LEX_SINGLE_QUOTE,
+	LEX_DOUBLE_QUOTE,
+	/** After a backslash in double quotes. */
+	LEX_DOUBLE_QUOTE_ESCAPE,
+	LEX_COMMENT,
+	/** After an operator char, which can be doubled. */
+	LEX_OPERATOR,
+};
+
+/** A parsed line or an error, waiting to be popped. */
+struct parser_result {
+	struct command_line *line;
+	enum parser_error err;
+};
+
+/**
+ * The parser is a state machine. The fed input is parsed right
+ * away and is not kept, so no byte is parsed twice, however the
+ * input is split.
+ */
+struct parser {
+	enum lex_state state;
+	/** The operator char in LEX_OPERATOR state. */
+	char op;
+	/** The line being parsed. NULL before its first token. */
+	struct parser_line *line;
+	/**
+	 * The word being parsed. It is always on top of the line
+	 * arena, so it grows in place. NULL, if there is none.
+	 */
+	char *word;
+	/** The first error of the line. The rest of it is skipped. */
+	enum parser_error err;
+	bool is_out_file_expected;
+	/** The parsed lines, not yet popped. */
+	struct parser_result *results;
+	uint32_t result_head;
+	uint32_t result_count;
+	uint32_t result_capacity;
+};
+
+/** Chars which end a plain part of a word. */
+static const bool parser_is_word_special[256] = {
+	[' '] = true, ['\t'] = true, ['\n'] = true, ['|'] = true,
+	['&'] = true, ['>'] = true, ['\\'] = true, ['\''] = true,
+	['"'] = true,
+};
+
+static void
+arena_grow(struct arena *a, size_t size)
+{
+	size_t block_size = a->block_size * 2;
+	while (block_size < size + sizeof(struct arena_block))
+		block_size *= 2;
+	struct arena_block *b = (struct arena_block *) malloc(block_size);
+	b->next = a->blocks;
+	a->blocks = b;
+	a->pos = b->data;
+	a->end = (char *) b + block_size;
+	a->block_size = block_size;
+}
+
+static void *
+arena_alloc(struct arena *a, size_t size)
+{
+	/* The words are not aligned, so the position can be not. */
+	uintptr_t align = sizeof(void *) - 1;
+	char *pos = (char *) (((uintptr_t) a->pos + align) & ~align);
+	if (pos > a->end || (size_t) (a->end - pos) < size) {
+		arena_grow(a, size);
+		pos = a->pos;
+	}
+	a->pos = pos + size;
+	return pos;
+}
+
+static void
+arena_destroy(struct arena *a)
+{
+	struct arena_block *b = a->blocks;
+	while (b != NULL) {
+		/* The arena itself can be in the freed block. */
+		struct arena_block *next = b->next;
+		free(b);
+		b = next;
+	}
+}
+
+static void
+parser_line_open(struct parser *p)
+{
+	struct arena_block *b = (struct arena_block *)
+		malloc(ARENA_FIRST_BLOCK_SIZE);
+	b->next = NULL;
+	struct parser_line *line = (struct parser_line *) b->data;
+	memset(&line->line, 0, sizeof(line->line));
+	struct arena *a = &line->arena;
+	a->blocks = b;
+	a->pos = (char *) (line + 1);
+	a->end = (char *) b + ARENA_FIRST_BLOCK_SIZE;
+	a->block_size = ARENA_FIRST_BLOCK_SIZE;
+	p->line = line;
+}
+
+static void
+parser_push(struct parser *p, struct command_line *line,
+	    enum parser_error err)
+{
+	if (p->result_head == p->result_count) {
+		p->result_head = 0;
+		p->result_count = 0;
+	}
+	if (p->result_count == p->result_capacity) {
+		p->result_capacity = p->result_capacity == 0 ?
+				     PARSER_FIRST_RESULT_CAPACITY :
+				     p->result_capacity * 2;
+		p->results = (struct parser_result *) realloc(p->results,
+			p->result_capacity * sizeof(p->results[0]));
+	}
+	struct parser_result *r = &p->results[p->result_count++];
+	r->line = line;
+	r->err = err;
+}
+
+static inline void
+parser_word_open(struct parser *p)
+{
+	if (p->line == NULL)
+		parser_line_open(p);
+	p->word = p->line->arena.pos;
+}
+
+static inline void
+parser_word_append(struct parser *p, const char *data, size_t size)
+{
+	struct arena *a = &p->line->arena;
+	/* Keep a place for the terminating zero. */
+	if ((size_t) (a->end - a->pos) <= size) {
+		size_t len = a->pos - p->word;
+		char *word = p->word;
+		arena_grow(a, len + size + 1);
+		memcpy(a->pos, word, len);
+		p->word = a->pos;
+		a->pos += len;
+	}
+	memcpy(a->pos, data, size);
+	a->pos += size;
+}
+
+static struct expr *
+parser_append_expr(struct parser *p, enum expr_type type)
+{
+	struct command_line *line = &p->line->line;
+	struct expr *e = (struct expr *) arena_alloc(&p->line->arena,
+						     sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	if (line->tail == NULL)
+		line->head = e;
+	else
+		line->tail->next = e;
+	line->tail = e;
+	return e;
+}
+
+static void
+parser_append_arg(struct parser *p, struct command *cmd, char *arg)
+{
+	/* One more place for the terminating NULL. */
+	if (cmd->arg_count + 1 >= cmd->arg_capacity) {
+		uint32_t capacity = cmd->arg_capacity == 0 ?
+				    PARSER_FIRST_ARG_CAPACITY :
+				    cmd->arg_capacity * 2;
+		char **args = (char **) arena_alloc(&p->line->arena,
+						    capacity * sizeof(char *));
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, cmd->arg_count * sizeof(char *));
+		cmd->args = args;
+		cmd->arg_capacity = capacity;
+	}
+	cmd->args[cmd->arg_count++] = arg;
+	cmd->args[cmd->arg_count] = NULL;
+	cmd->exe = cmd->args[0];
+}
+
+static void
+parser_word_close(struct parser *p)
+{
+	parser_word_append(p, "", 1);
+	char *word = p->word;
+	p->word = NULL;
+	if (p->err != PARSER_ERR_NONE)
+		return;
+	struct command_line *line = &p->line->line;
+	if (p->is_out_file_expected) {
+		line->out_file = word;
+		p->is_out_file_expected = false;
+		return;
+	}
+	if (line->out_file != NULL) {
+		p->err = PARSER_ERR_TOO_LATE_ARGUMENTS;
+		return;
+	}
+	struct expr *last = line->tail;
+	if (last == NULL || last->type != EXPR_TYPE_COMMAND)
+		last = parser_append_expr(p, EXPR_TYPE_COMMAND);
+	parser_append_arg(p, &last->cmd, word);
+}
+
+static void
+parser_line_close(struct parser *p, bool is_background)
+{
+	if (p->line == NULL) {
+		/* Empty lines are skipped, but not an empty job. */
+		if (is_background)
+			parser_push(p, NULL, PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+		return;
+	}
+	struct command_line *line = &p->line->line;
+	enum parser_error err = p->err;
+	if (err == PARSER_ERR_NONE) {
+		if (p->is_out_file_expected)
+			err = PARSER_ERR_OUTPUT_REDIRECT_BAD_ARG;
+		else if (line->tail == NULL ||
+			 line->tail->type != EXPR_TYPE_COMMAND)
+			err = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	}
+	if (err != PARSER_ERR_NONE) {
+		command_line_delete(line);
+		line = NULL;
+	} else {
+		line->is_background = is_background;
+	}
+	parser_push(p, line, err);
+	p->line = NULL;
+	p->err = PARSER_ERR_NONE;
+	p->is_out_file_expected = false;
+}
+
+/** Handle an operator of @a op char, doubled or not. */
+static void
+parser_operator(struct parser *p, char op, bool is_double)
+{
+	if (op == '&' && !is_double) {
+		parser_line_close(p, true);
+		return;
+	}
+	if (p->line == NULL)
+		parser_line_open(p);
+	if (p->err != PARSER_ERR_NONE)
+		return;
+	struct command_line *line = &p->line->line;
+	bool is_after_command = line->tail != NULL &&
+				line->tail->type == EXPR_TYPE_COMMAND &&
+				!p->is_out_file_expected;
+	if (op == '>') {
+		if (line->out_type != OUTPUT_TYPE_STDOUT || !is_after_command) {
+			p->err = PARSER_ERR_OUTPUT_REDIRECT_BAD_ARG;
+			return;
+		}
+		line->out_type = is_double ? OUTPUT_TYPE_FILE_APPEND :
+				 OUTPUT_TYPE_FILE_NEW;
+		p->is_out_file_expected = true;
+		return;
+	}
+	if (line->out_type != OUTPUT_TYPE_STDOUT)
+		p->err = PARSER_ERR_PIPE_AFTER_OUTPUT_REDIRECT;
+	else if (!is_after_command)
+		p->err = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	else if (op == '&')
+		parser_append_expr(p, EXPR_TYPE_AND);
+	else if (is_double)
+		parser_append_expr(p, EXPR_TYPE_OR);
+	else
+		parser_append_expr(p, EXPR_TYPE_PIPE);
+}
+
+struct parser *
+parser_new(void)
+{
+	return (struct parser *) calloc(1, sizeof(struct parser));
+}
+
+void
+parser_feed(struct parser *p, const char *str, uint32_t size)
+{
+	const char *pos = str;
+	const char *end = str + size;
+	const char *run;
+	while (pos < end) {
+		char c = *pos;
+		switch (p->state) {
+		case LEX_SPACE:
+			++pos;
+			switch (c) {
+			case ' ':
+			case '\t':
+				break;
+			case '\n':
+				parser_line_close(p, false);
+				break;
+			case '#':
+				p->state = LEX_COMMENT;
+				break;
+			case '|':
+			case '&':
+			case '>':
+				p->op = c;
+				p->state = LEX_OPERATOR;
+				break;
+			case '\\':
+				p->state = LEX_ESCAPE;
+				break;
+			case '\'':
+				parser_word_open(p);
+				p->state = LEX_SINGLE_QUOTE;
+				break;
+			case '"':
+				parser_word_open(p);
+				p->state = LEX_DOUBLE_QUOTE;
+				break;
+			default:
+				parser_word_open(p);
+				p->state = LEX_WORD;
+				--pos;
+				break;
+			}
+			break;
+		case LEX_WORD:
+			run = pos;
+			while (pos < end &&
+			       !parser_is_word_special[(unsigned char) *pos])
+				++pos;
+			parser_word_append(p, run, pos - run);
+			if (pos == end)
+				break;
+			c = *pos++;
+			if (c == '\\') {
+				p->state = LEX_ESCAPE;
+			} else if (c == '\'') {
+				p->state = LEX_SINGLE_QUOTE;
+			} else if (c == '"') {
+				p->state = LEX_DOUBLE_QUOTE;
+			} else {
+				/* The end char is a token itself. */
+				parser_word_close(p);
+				p->state = LEX_SPACE;
+				--pos;
+			}
+			break;
+		case LEX_ESCAPE:
+			++pos;
+			/* Escaped new line continues the line. */
+			if (c != '\n') {
+				if (p->word == NULL)
+					parser_word_open(p);
+				parser_word_append(p, &c, 1);
+			}
+			p->state = p->word == NULL ? LEX_SPACE : LEX_WORD;
+			break;
+		case LEX_SINGLE_QUOTE:
+			run = pos;
+			pos = memchr(pos, '\'', end - pos);
+			if (pos == NULL) {
+				parser_word_append(p, run, end - run);
+				pos = end;
+				break;
+			}
+			parser_word_append(p, run, pos - run);
+			++pos;
+			p->state = LEX_WORD;
+			break;
+		case LEX_DOUBLE_QUOTE:
+			run = pos;
+			while (pos < end && *pos != '"' && *pos != '\\')
+				++pos;
+			parser_word_append(p, run, pos - run);
+			if (pos == end)
+				break;
+			p->state = *pos == '"' ? LEX_WORD :
+				   LEX_DOUBLE_QUOTE_ESCAPE;
+			++pos;
+			break;
+		case LEX_DOUBLE_QUOTE_ESCAPE:
+			++pos;
+			p->state = LEX_DOUBLE_QUOTE;
+			if (c == '\n')
+				break;
+			/* Only these are escaped in double quotes. */
+			if (c != '"' && c != '\\' && c != '$' && c != '`')
+				parser_word_append(p, "\\", 1);
+			parser_word_append(p, &c, 1);
+			break;
+		case LEX_COMMENT:
+			/* The new line is handled as usual. */
+			pos = memchr(pos, '\n', end - pos);
+			if (pos == NULL)
+				pos = end;
+			else
+				p->state = LEX_SPACE;
+			break;
+		case LEX_OPERATOR:
+			p->state = LEX_SPACE;
+			if (c == p->op)
+				++pos;
+			parser_operator(p, p->op, c == p->op);
+			break;
+		}
+	}
+}
+
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	if (p->result_head == p->result_count) {
+		*out = NULL;
+		return PARSER_ERR_NONE;
+	}
+	struct parser_result *r = &p->results[p->result_head++];
+	*out = r->line;
+	return r->err;
+}
+
+void
+parser_delete(struct parser *p)
+{
+	for (uint32_t i = p->result_head; i < p->result_count; ++i)
+		command_line_delete(p->results[i].line);
+	if (p->line != NULL)
+		command_line_delete(&p->line->line);
+	free(p->results);
+	free(p);
+}
+
+void
+command_line_delete(struct command_line *line)
+{
+	if (line == NULL)
+		return;
+	struct parser_line *pl = (struct parser_line *) line;
+	arena_destroy(&pl->arena);
+}
+
+const char *
+parser_strerror(enum parser_error err)
+{
+	switch (err) {
+	case PARSER_ERR_NONE:
+		return "no error";
+	case PARSER_ERR_PIPE_AFTER_OUTPUT_REDIRECT:
+		return "an operator after the output redirect";
+	case PARSER_ERR_ENDS_NOT_WITH_A_COMMAND:
+		return "the line does not end with a command";
+	case PARSER_ERR_OUTPUT_REDIRECT_BAD_ARG:
+		return "bad output redirect";
+	case PARSER_ERR_TOO_LATE_ARGUMENTS:
+		return "arguments after the output redirect";
+	}
+	return "unknown error";
+}
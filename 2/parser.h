@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Parser of the shell command lines. The input is fed in pieces
+ * of any size, and the complete command lines are popped out of
+ * it one by one. Each piece is parsed when it is fed, from where
+ * the previous one stopped, even inside a word or quotes.
+ *
+ * All the memory of a command line, with its words and arrays, is
+ * in one arena, freed by command_line_delete() at once.
+ */
+
+struct parser;
+
+struct command {
+	/** Name of the executable. The same as args[0]. */
+	char *exe;
+	/** Arguments with the name, ended by NULL like for exec*(). */
+	char **args;
+	uint32_t arg_count;
+	uint32_t arg_capacity;
+};
+
+enum expr_type {
+	EXPR_TYPE_COMMAND,
+	EXPR_TYPE_PIPE,
+	EXPR_TYPE_AND,
+	EXPR_TYPE_OR,
+};
+
+/**
+ * A command line is a list of expressions: the commands and the
+ * operators between them.
+ */
+struct expr {
+	enum expr_type type;
+	/** Only for EXPR_TYPE_COMMAND. */
+	struct command cmd;
+	struct expr *next;
+};
+
+enum output_type {
+	OUTPUT_TYPE_STDOUT,
+	OUTPUT_TYPE_FILE_NEW,
+	OUTPUT_TYPE_FILE_APPEND,
+};
+
+struct command_line {
+	struct expr *head;
+	struct expr *tail;
+	/** Where the last command of the line writes its output. */
+	enum output_type out_type;
+	/** Only for OUTPUT_TYPE_FILE_*. */
+	char *out_file;
+	/** True, if the line is ended with '&'. */
+	bool is_background;
+};
+
+enum parser_error {
+	PARSER_ERR_NONE,
+	PARSER_ERR_PIPE_AFTER_OUTPUT_REDIRECT,
+	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_OUTPUT_REDIRECT_BAD_ARG,
+	PARSER_ERR_TOO_LATE_ARGUMENTS,
+};
+
+struct parser *
+parser_new(void);
+
+/**
+ * Parse @a size bytes of @a str. @a str is not used after the
+ * call.
+ */
+void
+parser_feed(struct parser *p, const char *str, uint32_t size);
+
+/**
+ * Pop the next complete command line. @a out is set to NULL, if
+ * there is no complete line in the input yet. Empty lines and
+ * comments are skipped. On error the bad line is skipped too.
+ */
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out);
+
+void
+parser_delete(struct parser *p);
+
+void
+command_line_delete(struct command_line *line);
+
+/** Human-readable text of an error. */
+const char *
+parser_strerror(enum parser_error err);
@@ -0,0 +1,169 @@
+#include "exec.h"
+#include "parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * The shell. Reads the command lines from stdin or from a script
+ * and executes them until EOF or 'exit'. Build and run:
+ *
+ * $> make
+ * $> ./a.out [-m spawn|fork] [-z] [-j job_limit] [-a] [script]
+ *
+ * -m fork starts all the commands with fork() instead of
+ * posix_spawn(), to compare. -z turns on the zero-copy mode, in
+ * which the shell does the 'cat' stages itself.
+ *
+ * The lines ended with '&' run in parallel, at most -j at once.
+ * -a runs all the lines like that, for the scripts made of the
+ * independent commands. 'wait' waits for all of them.
+ *
+ * While reading the input, the shell also waits for the ended
+ * processes of the background jobs, to start their next
+ * pipelines in time.
+ */
+
+enum {
+	SOLUTION_READ_SIZE = 64 * 1024,
+};
+
+static void
+solution_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-m spawn|fork] [-z] [-j job_limit] [-a] "
+		"[script]\n", name);
+}
+
+/**
+ * Execute all the complete lines of the input.
+ * @retval true The shell has to exit.
+ */
+static bool
+solution_execute(struct parser *p, struct exec_ctx *ctx)
+{
+	while (true) {
+		struct command_line *line;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			fprintf(stderr, "Syntax error: %s\n",
+				parser_strerror(err));
+			continue;
+		}
+		if (line == NULL)
+			return false;
+		exec_command_line(ctx, line);
+		exec_reap_background(ctx, false);
+		if (ctx->is_exit)
+			return true;
+	}
+}
+
+/**
+ * Wait until @a fd is readable, handling the background jobs
+ * meanwhile.
+ */
+static void
+solution_wait_input(struct exec_ctx *ctx, int fd)
+{
+	while (ctx->background_count > 0) {
+		struct pollfd fds[2];
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = exec_event_fd(ctx);
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) < 0 && errno != EINTR)
+			return;
+		if (fds[1].revents != 0)
+			exec_reap_background(ctx, false);
+		if (fds[0].revents != 0)
+			return;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	enum exec_mode mode = EXEC_MODE_SPAWN;
+	bool is_zero_copy = false;
+	bool is_all_background = false;
+	int job_limit = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:zj:a")) != -1) {
+		switch (opt) {
+		case 'z':
+			is_zero_copy = true;
+			break;
+		case 'j':
+			job_limit = atoi(optarg);
+			break;
+		case 'a':
+			is_all_background = true;
+			break;
+		case 'm':
+			if (strcmp(optarg, "spawn") == 0) {
+				mode = EXEC_MODE_SPAWN;
+				break;
+			}
+			if (strcmp(optarg, "fork") == 0) {
+				mode = EXEC_MODE_FORK;
+				break;
+			}
+			/* Fallthrough. */
+		default:
+			solution_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind > 1) {
+		solution_usage(argv[0]);
+		return 1;
+	}
+	int fd = STDIN_FILENO;
+	if (optind < argc) {
+		fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+	struct exec_ctx ctx;
+	if (exec_ctx_create(&ctx, mode) != 0) {
+		perror("exec_ctx_create");
+		return 1;
+	}
+	ctx.is_zero_copy = is_zero_copy;
+	ctx.is_all_background = is_all_background;
+	ctx.job_limit = job_limit;
+	struct parser *p = parser_new();
+	static char buf[SOLUTION_READ_SIZE];
+	bool is_exit = false;
+	while (!is_exit) {
+		solution_wait_input(&ctx, fd);
+		ssize_t rc = read(fd, buf, sizeof(buf));
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		if (rc == 0) {
+			/* The last line can be not ended. */
+			parser_feed(p, "\n", 1);
+			solution_execute(p, &ctx);
+			break;
+		}
+		parser_feed(p, buf, rc);
+		is_exit = solution_execute(p, &ctx);
+	}
+	parser_delete(p);
+	exec_ctx_destroy(&ctx);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return ctx.status;
+}
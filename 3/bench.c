@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include "userfs.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmark of userfs. A file of the max size is written and read
+ * sequentially in pieces, and then read at random offsets. memcpy()
+ * of the same amount in the same pieces is the reference of the
+ * memory bandwidth. The file is sent into a pipe through a buffer
+ * and through the read views without a copy. A thread drains the
+ * pipe, so the kernel really copies the sent pages. The file is
+ * cloned, and the clone is overwritten, which copies its extents.
+ * The same file is written into a mounted image, flushed, and
+ * mounted again cold. Then many files are created, opened and
+ * deleted, to measure the namespace:
+ *
+ * $> ./bench [piece_size] [file_count]
+ */
+
+enum {
+	BENCH_FILE_SIZE = 100 * 1024 * 1024,
+	BENCH_DEFAULT_PIECE_SIZE = 64 * 1024,
+	BENCH_RANDOM_READ_SIZE = 4096,
+	BENCH_RANDOM_READ_COUNT = 1000 * 1000,
+	BENCH_DEFAULT_FILE_COUNT = 1000 * 1000,
+	BENCH_PIPE_SIZE = 1024 * 1024,
+};
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_report(const char *name, size_t size, double time)
+{
+	printf("%-14s %8.1f MB/s\n", name, size / time / 1024 / 1024);
+}
+
+static void
+bench_report_ops(const char *name, size_t count, double time)
+{
+	printf("%-14s %8.1f ns/op, %.2f M ops/s\n", name,
+	       time * 1e9 / count, count / time / 1e6);
+}
+
+/** Read the pipe until all its writers are closed. */
+static void *
+bench_drain_f(void *arg)
+{
+	int fd = *(int *) arg;
+	char *buf = malloc(BENCH_PIPE_SIZE);
+	while (read(fd, buf, BENCH_PIPE_SIZE) > 0)
+		;
+	free(buf);
+	return NULL;
+}
+
+static void
+bench_image(const char *src, size_t piece_size)
+{
+	const char *path = "bench.img";
+	size_t size = BENCH_FILE_SIZE;
+	if (ufs_format(path, 4 * size) != 0 || ufs_mount(path) != 0)
+		abort();
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		abort();
+	double start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		if (ufs_write(fd, src + pos, len) != (ssize_t)len)
+			abort();
+	}
+	bench_report("image write", size, bench_now() - start);
+	start = bench_now();
+	if (ufs_sync() != 0)
+		abort();
+	bench_report("image sync", size, bench_now() - start);
+	ufs_close(fd);
+	if (ufs_unmount() != 0)
+		abort();
+	start = bench_now();
+	if (ufs_mount(path) != 0)
+		abort();
+	double time = bench_now() - start;
+	printf("%-14s %8.1f us\n", "image mount", time * 1e6);
+	if (ufs_unmount() != 0)
+		abort();
+	unlink(path);
+}
+
+/**
+ * Create @a count files, then open each of them by name, then
+ * delete them all. The names are like in a cache directory.
+ */
+static void
+bench_namespace(size_t count)
+{
+	char name[64];
+	double start = bench_now();
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "cache/object-%zu.bin", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_close(fd) != 0)
+			abort();
+	}
+	bench_report_ops("create", count, bench_now() - start);
+	start = bench_now();
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "cache/object-%zu.bin", (i * 7919) % count);
+		int fd = ufs_open(name, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			abort();
+	}
+	bench_report_ops("open", count, bench_now() - start);
+	start = bench_now();
+	for (size_t i = 0; i < count; ++i) {
+		sprintf(name, "cache/object-%zu.bin", i);
+		if (ufs_delete(name) != 0)
+			abort();
+	}
+	bench_report_ops("delete", count, bench_now() - start);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t piece_size = argc > 1 ? strtoull(argv[1], NULL, 10) :
+			    BENCH_DEFAULT_PIECE_SIZE;
+	size_t file_count = argc > 2 ? strtoull(argv[2], NULL, 10) :
+			    BENCH_DEFAULT_FILE_COUNT;
+	size_t size = BENCH_FILE_SIZE;
+	char *src = malloc(size);
+	char *dst = malloc(size);
+	for (size_t i = 0; i < size; ++i)
+		src[i] = 'a' + i % 26;
+	/* Fault the pages in and warm up, to measure only the copy. */
+	memcpy(dst, src, size);
+	double start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		memcpy(dst + pos, src + pos, len);
+	}
+	/* Do not let the compiler drop the copy. */
+	__asm__ volatile("" : : "r"(dst) : "memory");
+	bench_report("memcpy", size, bench_now() - start);
+
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		abort();
+	start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		if (ufs_write(fd, src + pos, len) != (ssize_t)len)
+			abort();
+	}
+	bench_report("write", size, bench_now() - start);
+	/* Now the file memory is faulted in, overwrite it. */
+	ufs_seek(fd, 0, SEEK_SET);
+	start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		if (ufs_write(fd, src + pos, len) != (ssize_t)len)
+			abort();
+	}
+	bench_report("overwrite", size, bench_now() - start);
+
+	ufs_seek(fd, 0, SEEK_SET);
+	start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		if (ufs_read(fd, dst + pos, len) != (ssize_t)len)
+			abort();
+	}
+	bench_report("read", size, bench_now() - start);
+	if (memcmp(src, dst, size) != 0)
+		abort();
+
+	unsigned seed = 1;
+	size_t count = BENCH_RANDOM_READ_COUNT;
+	size_t len = BENCH_RANDOM_READ_SIZE;
+	start = bench_now();
+	for (size_t i = 0; i < count; ++i) {
+		size_t pos = (size_t)rand_r(&seed) % (size - len);
+		if (ufs_pread(fd, dst, len, pos) != (ssize_t)len)
+			abort();
+	}
+	double time = bench_now() - start;
+	bench_report("random pread", count * len, time);
+	printf("%-14s %8.1f ns/op\n", "", time * 1e9 / count);
+
+	int pipe_fds[2];
+	pthread_t drain;
+	if (pipe(pipe_fds) != 0 ||
+	    pthread_create(&drain, NULL, bench_drain_f, &pipe_fds[0]) != 0)
+		abort();
+	/* Not critical, a bigger pipe only makes less switches. */
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, BENCH_PIPE_SIZE);
+	ufs_seek(fd, 0, SEEK_SET);
+	start = bench_now();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, dst, piece_size)) > 0) {
+		if (write(pipe_fds[1], dst, rc) != rc)
+			abort();
+	}
+	bench_report("read+write", size, bench_now() - start);
+	ufs_seek(fd, 0, SEEK_SET);
+	start = bench_now();
+	struct ufs_view view;
+	while ((rc = ufs_read_view(fd, &view, piece_size)) > 0) {
+		if (writev(pipe_fds[1], view.iov, view.iovcnt) != rc)
+			abort();
+		ufs_view_release(&view);
+	}
+	bench_report("view+writev", size, bench_now() - start);
+	close(pipe_fds[1]);
+	pthread_join(drain, NULL);
+	close(pipe_fds[0]);
+
+	start = bench_now();
+	if (ufs_clone("file", "clone") != 0)
+		abort();
+	time = bench_now() - start;
+	printf("%-14s %8.1f us\n", "clone", time * 1e6);
+	int clone_fd = ufs_open("clone", 0);
+	if (clone_fd < 0)
+		abort();
+	start = bench_now();
+	for (size_t pos = 0; pos < size; pos += piece_size) {
+		size_t len = size - pos < piece_size ? size - pos : piece_size;
+		if (ufs_write(clone_fd, src + pos, len) != (ssize_t)len)
+			abort();
+	}
+	bench_report("clone write", size, bench_now() - start);
+	ufs_close(clone_fd);
+	ufs_delete("clone");
+
+	ufs_close(fd);
+	ufs_delete("file");
+	bench_image(src, piece_size);
+	free(src);
+	free(dst);
+
+	bench_namespace(file_count);
+	return 0;
+}
@@ -0,0 +1,583 @@
+#include "image.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	IMAGE_JOURNAL_OFFSET = IMAGE_BLOCK_SIZE,
+	IMAGE_JOURNAL_SIZE = 1024 * 1024,
+	IMAGE_INODE_OFFSET = IMAGE_JOURNAL_OFFSET + IMAGE_JOURNAL_SIZE,
+	/** Image bytes per one inode in the table. */
+	IMAGE_BYTES_PER_INODE = 64 * 1024,
+	/** The data area consists of the pieces of the max order. */
+	IMAGE_CHUNK_BLOCKS = 1 << IMAGE_ORDER_MAX,
+	IMAGE_CHUNK_SIZE = IMAGE_BLOCK_SIZE * IMAGE_CHUNK_BLOCKS,
+};
+
+static const uint32_t IMAGE_NO_BLOCK = UINT32_MAX;
+static const char image_magic[8] = "ufsimg1";
+
+_Static_assert(sizeof(struct image_inode) == 512, "inode size");
+
+struct image_super {
+	char magic[8];
+	uint64_t size;
+	/** Only the journal records of this generation are valid. */
+	uint64_t journal_gen;
+	uint64_t data_offset;
+	uint32_t inode_count;
+	uint32_t block_count;
+};
+
+struct image_record {
+	uint64_t gen;
+	/** Of all the other fields. */
+	uint64_t checksum;
+	uint32_t ino;
+	/**
+	 * Number of the next records of the same change. They are
+	 * replayed all or none.
+	 */
+	uint32_t more;
+	struct image_inode inode;
+};
+
+/** A freed piece, waiting for the next checkpoint. */
+struct image_pending {
+	uint32_t block;
+	int order;
+};
+
+struct image {
+	/** Protects everything below, except the mapping itself. */
+	pthread_mutex_t mutex;
+	char *map;
+	size_t size;
+	struct image_super *super;
+	struct image_record *journal;
+	/** Records of the current generation. */
+	int journal_count;
+	int journal_capacity;
+	struct image_inode *inodes;
+	char *data;
+	uint32_t block_count;
+	/**
+	 * Lists of the free pieces of each order. A free piece is
+	 * linked via the arrays by its first block, and that block
+	 * has its order in free_order. Other blocks have -1.
+	 */
+	uint32_t free_head[IMAGE_ORDER_MAX + 1];
+	uint32_t *free_next;
+	uint32_t *free_prev;
+	int8_t *free_order;
+	/** Used blocks, between open and image_use_done(). */
+	uint8_t *block_used;
+	struct image_pending *pending;
+	int pending_count;
+	int pending_capacity;
+	/** The pending pieces are kept over the checkpoints. */
+	bool is_free_held;
+	/** Stack of the free inodes. */
+	uint32_t *free_inodes;
+	uint32_t free_inode_count;
+	/** Allocated pieces. The closed image lives while there are any. */
+	size_t live;
+	bool is_closed;
+	/** A flush failed, the image on the disk can be behind. */
+	bool is_broken;
+};
+
+/** Fill the layout of an image of @a size bytes. */
+static int
+image_layout(size_t size, struct image_super *super)
+{
+	uint64_t inode_count = size / IMAGE_BYTES_PER_INODE;
+	uint64_t offset = IMAGE_INODE_OFFSET +
+			  inode_count * sizeof(struct image_inode);
+	offset = (offset + IMAGE_CHUNK_SIZE - 1) &
+		 ~(uint64_t)(IMAGE_CHUNK_SIZE - 1);
+	if (inode_count == 0 || inode_count > INT32_MAX ||
+	    size < offset + IMAGE_CHUNK_SIZE)
+		return -1;
+	uint64_t block_count = (size - offset) / IMAGE_CHUNK_SIZE *
+			       IMAGE_CHUNK_BLOCKS;
+	if (block_count >= IMAGE_NO_BLOCK)
+		return -1;
+	super->size = size;
+	super->data_offset = offset;
+	super->inode_count = inode_count;
+	super->block_count = block_count;
+	return 0;
+}
+
+int
+image_format(const char *path, size_t size)
+{
+	struct image_super super;
+	memset(&super, 0, sizeof(super));
+	if (image_layout(size, &super) != 0)
+		return -1;
+	memcpy(super.magic, image_magic, sizeof(super.magic));
+	/* The zeroed records are of the generation 0. */
+	super.journal_gen = 1;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	/* The file is sparse, the zeroed inodes are free. */
+	int rc = -1;
+	if (ftruncate(fd, size) == 0 &&
+	    pwrite(fd, &super, sizeof(super), 0) == sizeof(super) &&
+	    fsync(fd) == 0)
+		rc = 0;
+	close(fd);
+	return rc;
+}
+
+/** FNV-1a by 64 bit words. */
+static uint64_t
+image_record_checksum(const struct image_record *rec)
+{
+	uint64_t hash = (14695981039346656037ull ^ rec->gen) *
+			1099511628211ull;
+	const uint64_t *pos = (const uint64_t *)&rec->ino;
+	const uint64_t *end = (const uint64_t *)(rec + 1);
+	for (; pos < end; ++pos)
+		hash = (hash ^ *pos) * 1099511628211ull;
+	return hash;
+}
+
+static void
+image_free_push(struct image *img, uint32_t block, int order)
+{
+	uint32_t head = img->free_head[order];
+	img->free_next[block] = head;
+	img->free_prev[block] = IMAGE_NO_BLOCK;
+	if (head != IMAGE_NO_BLOCK)
+		img->free_prev[head] = block;
+	img->free_head[order] = block;
+	img->free_order[block] = order;
+}
+
+static void
+image_free_remove(struct image *img, uint32_t block)
+{
+	uint32_t next = img->free_next[block];
+	uint32_t prev = img->free_prev[block];
+	if (prev != IMAGE_NO_BLOCK)
+		img->free_next[prev] = next;
+	else
+		img->free_head[img->free_order[block]] = next;
+	if (next != IMAGE_NO_BLOCK)
+		img->free_prev[next] = prev;
+	img->free_order[block] = -1;
+}
+
+/** Free a piece, merging it with its free buddies. */
+static void
+image_block_free(struct image *img, uint32_t block, int order)
+{
+	for (; order < IMAGE_ORDER_MAX; ++order) {
+		uint32_t buddy = block ^ (1u << order);
+		if (img->free_order[buddy] != order)
+			break;
+		image_free_remove(img, buddy);
+		block &= ~(1u << order);
+	}
+	image_free_push(img, block, order);
+}
+
+/**
+ * Apply the journal to the inode table and start a new generation
+ * of the records. The freed pieces become free. @a is_data also
+ * flushes the data blocks.
+ */
+static void
+image_checkpoint(struct image *img, bool is_data)
+{
+	/* The records reach the disk before the table changes. */
+	size_t size = (char *)(img->journal + img->journal_count) - img->map;
+	if (is_data)
+		size = img->size;
+	if (msync(img->map, size, MS_SYNC) != 0)
+		img->is_broken = true;
+	if (img->journal_count > 0) {
+		for (int i = 0; i < img->journal_count; ++i) {
+			struct image_record *rec = &img->journal[i];
+			img->inodes[rec->ino] = rec->inode;
+		}
+		size = img->super->inode_count * sizeof(struct image_inode);
+		if (msync(img->inodes, size, MS_SYNC) != 0)
+			img->is_broken = true;
+		++img->super->journal_gen;
+		if (msync(img->map, IMAGE_BLOCK_SIZE, MS_SYNC) != 0)
+			img->is_broken = true;
+		img->journal_count = 0;
+	}
+	if (img->is_free_held)
+		return;
+	for (int i = 0; i < img->pending_count; ++i)
+		image_block_free(img, img->pending[i].block,
+				 img->pending[i].order);
+	img->pending_count = 0;
+}
+
+static void
+image_destroy(struct image *img)
+{
+	munmap(img->map, img->size);
+	free(img->free_next);
+	free(img->free_prev);
+	free(img->free_order);
+	free(img->block_used);
+	free(img->pending);
+	free(img->free_inodes);
+	pthread_mutex_destroy(&img->mutex);
+	free(img);
+}
+
+struct image *
+image_open(const char *path)
+{
+	int fd = open(path, O_RDWR);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	struct image_super super, layout;
+	memset(&layout, 0, sizeof(layout));
+	if (fstat(fd, &st) != 0 ||
+	    pread(fd, &super, sizeof(super), 0) != sizeof(super) ||
+	    memcmp(super.magic, image_magic, sizeof(super.magic)) != 0 ||
+	    super.size != (uint64_t)st.st_size ||
+	    image_layout(st.st_size, &layout) != 0 ||
+	    super.data_offset != layout.data_offset ||
+	    super.inode_count != layout.inode_count ||
+	    super.block_count != layout.block_count) {
+		close(fd);
+		return NULL;
+	}
+	char *map = mmap(NULL, super.size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	struct image *img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		munmap(map, super.size);
+		return NULL;
+	}
+	pthread_mutex_init(&img->mutex, NULL);
+	img->map = map;
+	img->size = super.size;
+	img->super = (struct image_super *)map;
+	img->journal = (struct image_record *)(map + IMAGE_JOURNAL_OFFSET);
+	img->journal_capacity = IMAGE_JOURNAL_SIZE / sizeof(*img->journal);
+	img->inodes = (struct image_inode *)(map + IMAGE_INODE_OFFSET);
+	img->data = map + super.data_offset;
+	img->block_count = super.block_count;
+	for (int i = 0; i <= IMAGE_ORDER_MAX; ++i)
+		img->free_head[i] = IMAGE_NO_BLOCK;
+	size_t count = img->block_count;
+	img->free_next = malloc(count * sizeof(*img->free_next));
+	img->free_prev = malloc(count * sizeof(*img->free_prev));
+	img->free_order = malloc(count * sizeof(*img->free_order));
+	img->block_used = calloc(count, sizeof(*img->block_used));
+	img->free_inodes = malloc(super.inode_count *
+				  sizeof(*img->free_inodes));
+	if (img->free_next == NULL || img->free_prev == NULL ||
+	    img->free_order == NULL || img->block_used == NULL ||
+	    img->free_inodes == NULL) {
+		image_destroy(img);
+		return NULL;
+	}
+	memset(img->free_order, -1, count * sizeof(*img->free_order));
+	/* Replay the records which are complete. */
+	const struct image_record *rec = img->journal;
+	const struct image_record *end = rec + img->journal_capacity;
+	int valid = 0;
+	for (; rec < end && rec->gen == super.journal_gen &&
+	       rec->ino < super.inode_count &&
+	       rec->checksum == image_record_checksum(rec); ++rec)
+		++valid;
+	/* A change, which was cut by a crash, is dropped whole. */
+	while (img->journal_count < valid) {
+		uint32_t more = img->journal[img->journal_count].more;
+		if (more >= (uint32_t)(valid - img->journal_count))
+			break;
+		img->journal_count += 1 + more;
+	}
+	bool is_new_gen = img->journal_count > 0;
+	image_checkpoint(img, false);
+	/*
+	 * The records behind the replayed ones are left by a crash.
+	 * They must not become valid when the journal is written
+	 * again, so the generation is always a new one.
+	 */
+	if (!is_new_gen) {
+		++img->super->journal_gen;
+		if (msync(img->map, IMAGE_BLOCK_SIZE, MS_SYNC) != 0)
+			img->is_broken = true;
+	}
+	if (img->is_broken) {
+		image_destroy(img);
+		return NULL;
+	}
+	/* The lower inodes go first. */
+	for (uint32_t ino = super.inode_count; ino-- > 0;) {
+		if (img->inodes[ino].name_len == 0)
+			img->free_inodes[img->free_inode_count++] = ino;
+	}
+	return img;
+}
+
+int
+image_close(struct image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	image_checkpoint(img, true);
+	img->is_closed = true;
+	bool is_broken = img->is_broken;
+	bool is_unused = img->live == 0;
+	pthread_mutex_unlock(&img->mutex);
+	if (is_unused)
+		image_destroy(img);
+	return is_broken ? -1 : 0;
+}
+
+int
+image_sync(struct image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	image_checkpoint(img, true);
+	bool is_broken = img->is_broken;
+	pthread_mutex_unlock(&img->mutex);
+	return is_broken ? -1 : 0;
+}
+
+uint32_t
+image_inode_count(const struct image *img)
+{
+	return img->super->inode_count;
+}
+
+const struct image_inode *
+image_inode(const struct image *img, uint32_t ino)
+{
+	return &img->inodes[ino];
+}
+
+uint32_t
+image_block_count(const struct image *img)
+{
+	return img->block_count;
+}
+
+char *
+image_block(const struct image *img, uint32_t block)
+{
+	return img->data + (size_t)block * IMAGE_BLOCK_SIZE;
+}
+
+uint32_t
+image_block_number(const struct image *img, const char *memory)
+{
+	return (memory - img->data) / IMAGE_BLOCK_SIZE;
+}
+
+int
+image_use(struct image *img, uint32_t block, int order)
+{
+	uint32_t count = 1u << order;
+	if (block >= img->block_count || (block & (count - 1)) != 0)
+		return -1;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (img->block_used[block + i])
+			return -1;
+	}
+	memset(img->block_used + block, 1, count);
+	++img->live;
+	return 0;
+}
+
+/** Add the unused blocks of the piece to the free lists. */
+static void
+image_use_piece(struct image *img, uint32_t block, int order)
+{
+	uint32_t count = 1u << order;
+	uint32_t i = 0;
+	while (i < count && !img->block_used[block + i])
+		++i;
+	if (i == count) {
+		image_free_push(img, block, order);
+	} else if (order > 0) {
+		image_use_piece(img, block, order - 1);
+		image_use_piece(img, block + count / 2, order - 1);
+	}
+}
+
+void
+image_use_done(struct image *img)
+{
+	for (uint32_t block = 0; block < img->block_count;
+	     block += IMAGE_CHUNK_BLOCKS)
+		image_use_piece(img, block, IMAGE_ORDER_MAX);
+	free(img->block_used);
+	img->block_used = NULL;
+}
+
+char *
+image_alloc(struct image *img, int order)
+{
+	pthread_mutex_lock(&img->mutex);
+	int found = order;
+	while (found <= IMAGE_ORDER_MAX &&
+	       img->free_head[found] == IMAGE_NO_BLOCK)
+		++found;
+	if (found > IMAGE_ORDER_MAX && img->pending_count > 0 &&
+	    !img->is_free_held) {
+		image_checkpoint(img, false);
+		found = order;
+		while (found <= IMAGE_ORDER_MAX &&
+		       img->free_head[found] == IMAGE_NO_BLOCK)
+			++found;
+	}
+	char *memory = NULL;
+	if (found <= IMAGE_ORDER_MAX) {
+		uint32_t block = img->free_head[found];
+		image_free_remove(img, block);
+		/* Return the halves which are not needed. */
+		while (found > order) {
+			--found;
+			image_free_push(img, block + (1u << found), found);
+		}
+		++img->live;
+		memory = image_block(img, block);
+	}
+	pthread_mutex_unlock(&img->mutex);
+	return memory;
+}
+
+/** Keep a freed piece until the next checkpoint. */
+static void
+image_pending_push(struct image *img, uint32_t block, int order)
+{
+	if (img->pending_count == img->pending_capacity) {
+		int capacity = img->pending_capacity * 2;
+		if (capacity == 0)
+			capacity = 64;
+		struct image_pending *pending =
+			realloc(img->pending, capacity * sizeof(*pending));
+		if (pending == NULL) {
+			/* The old inodes can see the new data then. */
+			image_block_free(img, block, order);
+			return;
+		}
+		img->pending = pending;
+		img->pending_capacity = capacity;
+	}
+	img->pending[img->pending_count].block = block;
+	img->pending[img->pending_count].order = order;
+	++img->pending_count;
+}
+
+void
+image_free(struct image *img, char *memory, int order)
+{
+	uint32_t block = image_block_number(img, memory);
+	pthread_mutex_lock(&img->mutex);
+	--img->live;
+	bool is_unused = img->is_closed && img->live == 0;
+	/* The closed image does not allocate anymore. */
+	if (!img->is_closed)
+		image_pending_push(img, block, order);
+	pthread_mutex_unlock(&img->mutex);
+	if (is_unused)
+		image_destroy(img);
+}
+
+/**
+ * Append a record, followed by @a more records of the same change.
+ * They all fit into the journal. The mutex is needed.
+ */
+static void
+image_append(struct image *img, int ino, const struct image_inode *inode,
+	     int more)
+{
+	if (img->journal_count + more >= img->journal_capacity)
+		image_checkpoint(img, false);
+	struct image_record *rec = &img->journal[img->journal_count++];
+	rec->gen = img->super->journal_gen;
+	rec->ino = ino;
+	rec->more = more;
+	rec->inode = *inode;
+	rec->checksum = image_record_checksum(rec);
+}
+
+int
+image_inode_alloc(struct image *img)
+{
+	int ino = -1;
+	pthread_mutex_lock(&img->mutex);
+	if (img->free_inode_count > 0)
+		ino = img->free_inodes[--img->free_inode_count];
+	pthread_mutex_unlock(&img->mutex);
+	return ino;
+}
+
+void
+image_inode_free(struct image *img, int ino)
+{
+	struct image_inode inode;
+	memset(&inode, 0, sizeof(inode));
+	pthread_mutex_lock(&img->mutex);
+	image_append(img, ino, &inode, 0);
+	img->free_inodes[img->free_inode_count++] = ino;
+	pthread_mutex_unlock(&img->mutex);
+}
+
+void
+image_log(struct image *img, int ino, const struct image_inode *inode)
+{
+	pthread_mutex_lock(&img->mutex);
+	image_append(img, ino, inode, 0);
+	pthread_mutex_unlock(&img->mutex);
+}
+
+int
+image_change_max(const struct image *img)
+{
+	return img->journal_capacity;
+}
+
+void
+image_log_change(struct image *img, const int *inos,
+		 const struct image_inode *inodes, int count)
+{
+	pthread_mutex_lock(&img->mutex);
+	for (int i = 0; i < count; ++i) {
+		image_append(img, inos[i], &inodes[i], count - 1 - i);
+		if (inodes[i].name_len == 0)
+			img->free_inodes[img->free_inode_count++] = inos[i];
+	}
+	pthread_mutex_unlock(&img->mutex);
+}
+
+void
+image_hold_frees(struct image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	img->is_free_held = true;
+	pthread_mutex_unlock(&img->mutex);
+}
+
+void
+image_release_frees(struct image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	img->is_free_held = false;
+	pthread_mutex_unlock(&img->mutex);
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Image of userfs in a file, mapped into the memory as a whole:
+ *
+ *     | super | journal | inode table | ... | data blocks ...  |
+ *     0       4K        1M + 4K             2M aligned
+ *
+ * The data area is split into blocks of 4KB by a buddy allocator,
+ * so a piece of 2^N blocks, up to 2MB, is contiguous and aligned by
+ * its size. An inode keeps the name of a file, its size and the
+ * first block of each extent. The free blocks are not stored: they
+ * are found from the inodes when the image is opened.
+ *
+ * The inodes are changed only via the journal. A record of it is a
+ * whole new inode with a checksum. A change of two inodes is two
+ * records, and a crash between them drops both. The records are
+ * applied to the table when the journal is full, on sync and on
+ * close, after the journal is flushed to the disk. On open the
+ * valid records are applied again. So after a crash each inode is
+ * either old or new, and the changes survive in their order. The
+ * data is written right into the mapped blocks, and is durable only
+ * after a sync.
+ */
+
+enum {
+	IMAGE_BLOCK_SIZE = 4096,
+	/** The biggest piece is 2^IMAGE_ORDER_MAX blocks, 2MB. */
+	IMAGE_ORDER_MAX = 9,
+	/** Max length of a file name, without the terminating 0. */
+	IMAGE_NAME_MAX = 255,
+	/** Enough for the extents of a file of the max size. */
+	IMAGE_INODE_EXTENT_MAX = 59,
+};
+
+struct image_inode {
+	/** File size in bytes. */
+	uint64_t size;
+	/** Length of the name. 0, if the inode is free. */
+	uint32_t name_len;
+	/** First block of each extent within the size. */
+	uint32_t extents[IMAGE_INODE_EXTENT_MAX];
+	char name[IMAGE_NAME_MAX + 1];
+	char padding[8];
+};
+
+struct image;
+
+/** Create an empty image of @a size bytes, or replace one. */
+int
+image_format(const char *path, size_t size);
+
+/**
+ * Map the image and replay its journal. Then all the used extents
+ * have to be marked with image_use(), and image_use_done() has to
+ * be called before any allocation.
+ * @retval NULL The file is not an image, or an IO error.
+ */
+struct image *
+image_open(const char *path);
+
+/**
+ * Flush and unmap the image. The blocks which are still allocated
+ * stay mapped, and the image is freed with the last one of them.
+ * @retval -1 Some data or metadata could not be written.
+ */
+int
+image_close(struct image *img);
+
+/**
+ * Flush the data and the journal to the disk.
+ * @retval -1 Some data or metadata could not be written.
+ */
+int
+image_sync(struct image *img);
+
+uint32_t
+image_inode_count(const struct image *img);
+
+/** The inode as it is in the table, valid right after open. */
+const struct image_inode *
+image_inode(const struct image *img, uint32_t ino);
+
+uint32_t
+image_block_count(const struct image *img);
+
+/** Memory of a block. */
+char *
+image_block(const struct image *img, uint32_t block);
+
+/**
+ * Mark the @a order piece at @a block used by a loaded inode.
+ * @retval -1 The piece is out of the data area, not aligned, or
+ *         overlaps another one.
+ */
+int
+image_use(struct image *img, uint32_t block, int order);
+
+void
+image_use_done(struct image *img);
+
+/** A free piece of 2^@a order blocks, or NULL. */
+char *
+image_alloc(struct image *img, int order);
+
+/**
+ * Free a piece. It can be allocated again only after the next
+ * checkpoint, when the inodes, which used it, are not in the
+ * journal anymore.
+ */
+void
+image_free(struct image *img, char *memory, int order);
+
+/** Block number of the memory of a piece. */
+uint32_t
+image_block_number(const struct image *img, const char *memory);
+
+/** A free inode, or -1. It is used, after it is logged. */
+int
+image_inode_alloc(struct image *img);
+
+/** Log the free inode, and make it available. */
+void
+image_inode_free(struct image *img, int ino);
+
+/** Write the new content of the inode into the journal. */
+void
+image_log(struct image *img, int ino, const struct image_inode *inode);
+
+/** Max number of the inodes in one change. */
+int
+image_change_max(const struct image *img);
+
+/**
+ * Log the new content of @a count inodes as one change: after a
+ * crash either all of them are new, or all are old. The inodes,
+ * which become empty, are made available. @a count is not above
+ * image_change_max().
+ */
+void
+image_log_change(struct image *img, const int *inos,
+		 const struct image_inode *inodes, int count);
+
+/**
+ * Keep the freed pieces allocated over the checkpoints, until
+ * image_release_frees(). Meanwhile the files can stop logging their
+ * inodes before the inodes are freed in the journal.
+ */
+void
+image_hold_frees(struct image *img);
+
+void
+image_release_frees(struct image *img);
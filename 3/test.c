@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <limits.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -441,6 +443,833 @@ test_resize(void)
 #endif
 }
 
+static void
+test_seek(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_seek(-1, 0, SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == 10, "position after write");
+	unit_check(ufs_seek(fd, 3, SEEK_SET) == 3, "seek from the start");
+	char buf[2048];
+	unit_check(ufs_read(fd, buf, 2) == 2, "read after seek");
+	unit_check(memcmp(buf, "34", 2) == 0, "data is from the position");
+	unit_check(ufs_seek(fd, -1, SEEK_CUR) == 4, "seek back");
+	unit_check(ufs_seek(fd, -2, SEEK_END) == 8, "seek from the end");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 2, "read the tail");
+	unit_check(memcmp(buf, "89", 2) == 0, "data is correct");
+
+	unit_check(ufs_seek(fd, -11, SEEK_END) == -1, "negative position");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, 0, 12345) == -1, "bad whence");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == 10,
+		   "position is not changed on error");
+	/*
+	 * Seek behind the end and in other blocks.
+	 */
+	unit_check(ufs_seek(fd, 1500, SEEK_SET) == 1500, "seek beyond end");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 0, "it is EOF");
+	unit_check(ufs_write(fd, "x", 1) == 1, "write there");
+	unit_check(ufs_seek(fd, 0, SEEK_END) == 1501, "file has grown");
+	unit_fail_if(ufs_seek(fd, 0, SEEK_SET) != 0);
+	unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != 1501);
+	bool ok = memcmp(buf, "0123456789", 10) == 0 && buf[1500] == 'x';
+	for (int i = 10; i < 1500 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the gap is filled with zeros");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_pread_pwrite(void)
+{
+	unit_test_start();
+
+	char buf[2048];
+	unit_check(ufs_pread(-1, buf, 1, 0) == -1, "pread invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_pwrite(-1, buf, 1, 0) == -1, "pwrite invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	unit_check(ufs_pwrite(fd, buf, sizeof(buf), 1000) == sizeof(buf),
+		   "pwrite across blocks");
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == 0, "position is not moved");
+	unit_check(ufs_seek(fd, 0, SEEK_END) == 1000 + sizeof(buf),
+		   "size is updated");
+
+	char buf2[2048];
+	unit_check(ufs_pread(fd, buf2, sizeof(buf2), 1000) == sizeof(buf2),
+		   "pread across blocks");
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "data is correct");
+	unit_check(ufs_pread(fd, buf2, sizeof(buf2), 2048) == 1000,
+		   "pread near the end is partial");
+	unit_check(memcmp(buf2, buf + 1048, 1000) == 0, "data is correct");
+	unit_check(ufs_pread(fd, buf2, 1, 1000000) == 0, "pread beyond end");
+	unit_fail_if(ufs_pread(fd, buf2, 1000, 0) != 1000);
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i)
+		ok = buf2[i] == 0;
+	unit_check(ok, "the gap before pwrite is zeros");
+	/*
+	 * Random access in a big file.
+	 */
+	unit_fail_if(ufs_pwrite(fd, "end", 3, 50 * 1024 * 1024) != 3);
+	for (int i = 0; i < 1000; ++i) {
+		size_t offset = (size_t)i * 52361 % (50 * 1024 * 1024);
+		unit_fail_if(ufs_pwrite(fd, (char *)&i, sizeof(i), offset) !=
+			     sizeof(i));
+	}
+	ok = true;
+	for (int i = 0; i < 1000 && ok; ++i) {
+		size_t offset = (size_t)i * 52361 % (50 * 1024 * 1024);
+		int value;
+		ok = ufs_pread(fd, (char *)&value, sizeof(value), offset) ==
+		     sizeof(value) && value == i;
+	}
+	unit_check(ok, "random access in a big file");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "a", 1, 0) == -1, "no pwrite in read-only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buf, 1, 0) == -1, "no pread in write-only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_namespace_name(char *name, int i)
+{
+	if (i % 2 == 0)
+		sprintf(name, "f%d", i);
+	else
+		sprintf(name, "file-with-a-long-name-and-a-number-%d", i);
+}
+
+static void
+test_namespace(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[64];
+	unit_msg("create %d files", count);
+	for (int i = 0; i < count; ++i) {
+		test_namespace_name(name, i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, (char *)&i, sizeof(i)) != sizeof(i));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete every third");
+	for (int i = 0; i < count; i += 3) {
+		test_namespace_name(name, i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		test_namespace_name(name, i);
+		int fd = ufs_open(name, 0);
+		if (i % 3 == 0) {
+			ok = fd == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		int value = -1;
+		ok = fd != -1 &&
+		     ufs_read(fd, (char *)&value, sizeof(value)) == sizeof(value) &&
+		     value == i && ufs_close(fd) == 0;
+	}
+	unit_check(ok, "the rest are found with their data");
+	for (int i = 0; i < count; ++i) {
+		if (i % 3 == 0)
+			continue;
+		test_namespace_name(name, i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	test_namespace_name(name, 1);
+	unit_check(ufs_open(name, 0) == -1, "all are deleted");
+
+	unit_test_finish();
+}
+
+static void
+test_vector_io(void)
+{
+	unit_test_start();
+
+	struct iovec iov[3];
+	unit_check(ufs_writev(-1, iov, 1) == -1, "writev into invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_readv(-1, iov, 1) == -1, "readv from invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char big[5000];
+	memset(big, 'b', sizeof(big));
+	iov[0].iov_base = "aaa";
+	iov[0].iov_len = 3;
+	iov[1].iov_base = big;
+	iov[1].iov_len = sizeof(big);
+	iov[2].iov_base = "ccc";
+	iov[2].iov_len = 3;
+	unit_check(ufs_writev(fd, iov, 3) == 5006, "writev");
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == 5006, "position is moved");
+	unit_check(ufs_writev(fd, iov, -1) == -1, "negative count");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	char a[2], b[5001], c[100];
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	iov[2].iov_base = c;
+	iov[2].iov_len = sizeof(c);
+	unit_fail_if(ufs_seek(fd, 0, SEEK_SET) != 0);
+	unit_check(ufs_readv(fd, iov, 3) == 5006, "readv till EOF");
+	unit_check(memcmp(a, "aa", 2) == 0 && b[0] == 'a' &&
+		   memcmp(b + 1, big, 5000) == 0 &&
+		   memcmp(c, "ccc", 3) == 0, "buffers are filled in order");
+	unit_check(ufs_readv(fd, iov, 3) == 0, "then EOF");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+	unit_test_start();
+
+	struct ufs_view view;
+	unit_check(ufs_read_view(-1, &view, 1) == -1, "view of invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read_view(fd, &view, 100) == 0, "empty file is EOF");
+	unit_check(view.iovcnt == 0, "view is empty");
+
+	int size = 100000;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_seek(fd, 10, SEEK_SET) != 10);
+	unit_check(ufs_read_view(fd, &view, size) == size - 10,
+		   "view till the end");
+	unit_check(view.iovcnt > 1, "it is in several pieces");
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == size, "position is moved");
+	/*
+	 * The view outlives truncation, close and deletion of the file.
+	 */
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	bool ok = true;
+	int pos = 10;
+	for (int i = 0; i < view.iovcnt && ok; ++i) {
+		ok = memcmp(view.iov[i].iov_base, data + pos,
+			    view.iov[i].iov_len) == 0;
+		pos += view.iov[i].iov_len;
+	}
+	unit_check(ok && pos == size, "view memory is the data");
+	ufs_view_release(&view);
+	unit_check(view.iovcnt == 0, "released view is empty");
+	/*
+	 * Size limit and the number of pieces.
+	 */
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_seek(fd, 0, SEEK_SET) != 0);
+	unit_check(ufs_read_view(fd, &view, 5) == 5, "small view");
+	unit_check(view.iovcnt == 1 && view.iov[0].iov_len == 5 &&
+		   memcmp(view.iov[0].iov_base, data, 5) == 0, "one piece");
+	unit_fail_if(ufs_pwrite(fd, "12345", 5, 0) != 5);
+	unit_check(memcmp(view.iov[0].iov_base, data, 5) == 0,
+		   "write into the file does not change the view");
+	char buf[5];
+	unit_check(ufs_pread(fd, buf, 5, 0) == 5 &&
+		   memcmp(buf, "12345", 5) == 0, "file has the new data");
+	ufs_view_release(&view);
+	unit_fail_if(ufs_resize(fd, 10 * 1024 * 1024) != 0);
+	ssize_t rc = ufs_read_view(fd, &view, 10 * 1024 * 1024);
+	unit_check(rc > 256 * 1024 && rc < 10 * 1024 * 1024,
+		   "big view is partial");
+	unit_check(view.iovcnt == UFS_VIEW_IOV_MAX, "all pieces are used");
+	ufs_view_release(&view);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read_view(fd, &view, 1) == -1, "no view in write-only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_pread_view(void)
+{
+	unit_test_start();
+
+	struct ufs_view view;
+	unit_check(ufs_pread_view(-1, &view, 1, 0) == -1, "view of invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int size = 100000;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_seek(fd, 7, SEEK_SET) != 7);
+	int offset = 50000;
+	unit_check(ufs_pread_view(fd, &view, size, offset) == size - offset,
+		   "view from the offset till the end");
+	unit_check(ufs_seek(fd, 0, SEEK_CUR) == 7, "position is not moved");
+	bool ok = true;
+	int pos = offset;
+	for (int i = 0; i < view.iovcnt && ok; ++i) {
+		ok = memcmp(view.iov[i].iov_base, data + pos,
+			    view.iov[i].iov_len) == 0;
+		pos += view.iov[i].iov_len;
+	}
+	unit_check(ok && pos == size, "view memory is the data");
+	ufs_view_release(&view);
+	unit_check(ufs_pread_view(fd, &view, 10, size) == 0, "EOF");
+	unit_check(view.iovcnt == 0, "view is empty");
+	unit_check(ufs_pread_view(fd, &view, 10, size + 100) == 0,
+		   "beyond EOF");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread_view(fd, &view, 1, 0) == -1,
+		   "no view in write-only");
+	unit_check(ufs_errno() == UFS_ERR_NO_PERMISSION, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("no file", "copy") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_open("copy", 0) == -1, "copy is not created");
+
+	int size = 3 * 1024 * 1024;
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	unit_check(ufs_clone("file", "file") == 0, "clone into itself");
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, size + 1) == size &&
+		   memcmp(buf, data, size) == 0, "copy has the data");
+	/*
+	 * The writes into either of them are not visible in the other.
+	 */
+	unit_fail_if(ufs_pwrite(fd, "xyz", 3, 100) != 3);
+	unit_fail_if(ufs_pwrite(fd2, "123", 3, size - 1) != 3);
+	unit_check(ufs_pread(fd2, buf, 3, 100) == 3 &&
+		   memcmp(buf, data + 100, 3) == 0, "copy is not changed");
+	unit_check(ufs_pread(fd, buf, 3, 100) == 3 &&
+		   memcmp(buf, "xyz", 3) == 0, "file is changed");
+	unit_check(ufs_seek(fd, 0, SEEK_END) == size, "file size is the same");
+	unit_check(ufs_seek(fd2, 0, SEEK_END) == size + 2, "copy is grown");
+	unit_check(ufs_pread(fd, buf, size, size - 1) == 1 &&
+		   buf[0] == data[size - 1], "file end is not changed");
+	/*
+	 * Growth into a shared extent zeroes only the copy.
+	 */
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	unit_check(ufs_seek(fd2, 0, SEEK_CUR) == 10,
+		   "copy descriptor proceeds from the new end");
+	unit_fail_if(ufs_resize(fd2, 100) != 0);
+	unit_check(ufs_pread(fd2, buf, 100, 0) == 100 &&
+		   memcmp(buf, data, 10) == 0 && buf[10] == 0 &&
+		   buf[99] == 0, "copy is grown with zeros");
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_check(ufs_pread(fd, buf, 100, 0) == 100 &&
+		   memcmp(buf, data, 10) == 0 && buf[10] == 0,
+		   "file is grown with zeros");
+	/* The copy outlives the source. */
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(ufs_pread(fd2, buf, 10, 0) == 10 &&
+		   memcmp(buf, data, 10) == 0, "copy outlives the source");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	free(data);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	char name[32], buf[32];
+	int count = 100;
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name)) !=
+			     (ssize_t)strlen(name));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_check(snap != NULL, "snapshot is created");
+	/*
+	 * Change, delete and create files after the snapshot.
+	 */
+	int fd = ufs_open("file0", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "changed", 7) != 7);
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	int fd2 = ufs_open("new file", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	unit_check(ufs_snapshot_restore(snap) == 0, "snapshot is restored");
+	unit_check(ufs_open("new file", 0) == -1, "new file is gone");
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		sprintf(name, "file%d", i);
+		fd2 = ufs_open(name, 0);
+		ok = fd2 != -1 &&
+		     ufs_read(fd2, buf, sizeof(buf)) == (ssize_t)strlen(name) &&
+		     memcmp(buf, name, strlen(name)) == 0;
+		ufs_close(fd2);
+	}
+	unit_check(ok, "all files are back with their data");
+	unit_check(ufs_pread(fd, buf, 7, 0) == 7 &&
+		   memcmp(buf, "changed", 7) == 0,
+		   "opened descriptor keeps the replaced file");
+	unit_fail_if(ufs_close(fd) != 0);
+	/*
+	 * The snapshot is not changed by the writes after a restore.
+	 */
+	fd = ufs_open("file0", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "again", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_snapshot_restore(snap) != 0);
+	fd = ufs_open("file0", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "file0", 5) == 0, "second restore");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_snapshot_delete(snap);
+
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	snap = ufs_snapshot_create();
+	unit_fail_if(snap == NULL);
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore of no files");
+	ufs_snapshot_delete(snap);
+
+	unit_test_finish();
+}
+
+static int
+test_foreach_f(const char *name, size_t size, void *arg)
+{
+	int *sum = arg;
+	int i;
+	if (sscanf(name, "file%d", &i) != 1 || (size_t)i != size)
+		return -1;
+	*sum += i;
+	return *sum >= 45 ? 1 : 0;
+}
+
+static void
+test_foreach(void)
+{
+	unit_test_start();
+
+	int sum = 0;
+	unit_check(ufs_foreach(test_foreach_f, &sum) == 0 && sum == 0,
+		   "no files");
+	char name[16];
+	for (int i = 0; i < 10; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_resize(fd, i) != 0);
+		unit_check(ufs_size(fd) == i, "size of the descriptor");
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(ufs_size(-1) == -1, "no size of invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_foreach(test_foreach_f, &sum) == 1 && sum == 45,
+		   "all files are listed with their sizes");
+	for (int i = 0; i < 10; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_test_finish();
+}
+
+static bool
+test_file_equals(const char *name, const char *data, int size)
+{
+	char *buf = malloc(size + 1);
+	int fd = ufs_open(name, 0);
+	bool ok = fd != -1 && ufs_read(fd, buf, size + 1) == size &&
+		  memcmp(buf, data, size) == 0;
+	if (fd != -1)
+		ufs_close(fd);
+	free(buf);
+	return ok;
+}
+
+static void
+test_rename(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_rename("none", "file") == -1, "rename of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd1 = ufs_open("old", UFS_CREATE);
+	unit_fail_if(fd1 == -1);
+	unit_fail_if(ufs_write(fd1, "abc", 3) != 3);
+	unit_check(ufs_rename("old", "old") == 0, "rename to itself");
+	unit_check(ufs_rename("old", "new") == 0, "rename");
+	unit_check(ufs_open("old", 0) == -1, "old name is gone");
+	int fd2 = ufs_open("new", 0);
+	unit_check(fd2 != -1, "new name is there");
+	unit_check(ufs_write(fd1, "def", 3) == 3,
+		   "write into an fd opened before rename");
+	char buf[6];
+	unit_check(ufs_read(fd2, buf, 6) == 6 &&
+		   memcmp(buf, "abcdef", 6) == 0,
+		   "it is the same file for the old and new fds");
+	unit_fail_if(ufs_close(fd2) != 0);
+	/*
+	 * The file with the new name is replaced, and lives while it
+	 * is opened.
+	 */
+	int fd3 = ufs_open("other", UFS_CREATE);
+	unit_fail_if(fd3 == -1);
+	unit_fail_if(ufs_write(fd3, "xyz", 3) != 3);
+	unit_check(ufs_rename("new", "other") == 0, "rename over a file");
+	unit_check(ufs_open("new", 0) == -1, "old name is gone");
+	unit_check(test_file_equals("other", "abcdef", 6),
+		   "new name is of the renamed file");
+	unit_check(ufs_pread(fd3, buf, 3, 0) == 3 &&
+		   memcmp(buf, "xyz", 3) == 0, "replaced file still lives");
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	/*
+	 * Many files across the shards keep being found.
+	 */
+	char name[32], name2[32];
+	for (int i = 0; i < 1000; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, strlen(name)) !=
+			     (ssize_t)strlen(name));
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i) {
+		sprintf(name, "file%d", i);
+		sprintf(name2, "renamed%d", i);
+		ok = ufs_rename(name, name2) == 0;
+	}
+	for (int i = 0; i < 1000 && ok; ++i) {
+		sprintf(name, "file%d", i);
+		sprintf(name2, "renamed%d", i);
+		ok = ufs_open(name, 0) == -1 &&
+		     test_file_equals(name2, name, strlen(name)) &&
+		     ufs_delete(name2) == 0;
+	}
+	unit_check(ok, "many renames");
+	unit_fail_if(ufs_delete("other") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_mount(void)
+{
+	unit_test_start();
+
+	const char *path = "test_userfs.img";
+	unit_check(ufs_unmount() == -1, "unmount without mount");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_format(path, 1024) == -1, "too small image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unit_fail_if(ufs_format(path, 64 * 1024 * 1024) != 0);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_mount(path) == -1, "no mount when there are files");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_check(ufs_mount(path) == 0, "mount");
+	unit_check(ufs_mount(path) == -1, "no second mount");
+	int size = 3 * 1024 * 1024;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("deleted") != 0);
+	unit_fail_if(ufs_clone("big", "clone") != 0);
+	fd = ufs_open("clone", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "xyz", 3, 100) != 3);
+	unit_check(ufs_unmount() == -1, "no unmount with opened files");
+	unit_fail_if(ufs_close(fd) != 0);
+	char name[300];
+	memset(name, 'n', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	unit_check(ufs_open(name, UFS_CREATE) == -1, "too long name");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_rename("small", name) == -1, "too long new name");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_fail_if(snap == NULL);
+	fd = ufs_open("small", 0);
+	unit_fail_if(fd == -1);
+	struct ufs_view view;
+	unit_fail_if(ufs_read_view(fd, &view, 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_sync() == 0, "sync");
+	unit_check(ufs_unmount() == 0, "unmount");
+	unit_check(ufs_open("small", 0) == -1, "files are unmounted");
+	unit_check(view.iovcnt == 1 &&
+		   memcmp(view.iov[0].iov_base, "small", 5) == 0,
+		   "view outlives the unmount");
+	ufs_view_release(&view);
+	unit_check(ufs_snapshot_restore(snap) == -1,
+		   "no restore of another mount");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	ufs_snapshot_delete(snap);
+	/*
+	 * All the files are back after the mount.
+	 */
+	unit_check(ufs_mount(path) == 0, "mount again");
+	unit_check(test_file_equals("big", data, size), "big file is kept");
+	unit_check(test_file_equals("small", "small", 5),
+		   "small file is kept");
+	unit_check(ufs_open("deleted", 0) == -1, "deleted file is gone");
+	memcpy(data + 100, "xyz", 3);
+	unit_check(test_file_equals("clone", data, size), "clone is kept");
+	unit_fail_if(ufs_unmount() != 0);
+	/*
+	 * A crash without unmount and sync keeps the metadata in the
+	 * journal.
+	 */
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (ufs_mount(path) != 0)
+			_exit(1);
+		fd = ufs_open("crash", UFS_CREATE);
+		if (fd == -1 || ufs_write(fd, data, size) != size)
+			_exit(2);
+		if (ufs_resize(fd, 1000) != 0 || ufs_delete("small") != 0)
+			_exit(3);
+		int fd1 = ufs_open("renamed", UFS_CREATE);
+		int fd2 = ufs_open("replaced", UFS_CREATE);
+		if (fd1 == -1 || fd2 == -1 ||
+		    ufs_write(fd1, "renamed", 7) != 7 ||
+		    ufs_write(fd2, "replaced", 8) != 8 ||
+		    ufs_rename("renamed", "replaced") != 0 ||
+		    ufs_rename("crash", "crash2") != 0)
+			_exit(4);
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_fail_if(!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+	unit_check(ufs_mount(path) == 0, "mount after a crash");
+	unit_check(ufs_open("crash", 0) == -1 &&
+		   test_file_equals("crash2", data, 1000),
+		   "changes are replayed");
+	unit_check(ufs_open("renamed", 0) == -1 &&
+		   test_file_equals("replaced", "renamed", 7),
+		   "rename over a file is replayed");
+	unit_fail_if(ufs_delete("replaced") != 0);
+	unit_check(ufs_open("small", 0) == -1, "deletion is replayed");
+	unit_check(test_file_equals("clone", data, size),
+		   "other files are kept");
+	/*
+	 * The image gets full, and is freed by deletion.
+	 */
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+	fd = ufs_open("full", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int count = 0;
+	while (ufs_write(fd, data, 1024 * 1024) > 0)
+		++count;
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "image is full");
+	unit_check(count > 50 && count < 64, "image has the space");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("full") != 0);
+	fd = ufs_open("full", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	int count2 = 0;
+	while (ufs_write(fd, data, 1024 * 1024) > 0)
+		++count2;
+	unit_check(count2 == count, "space is reused after deletion");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("full") != 0);
+	unit_fail_if(ufs_delete("crash2") != 0);
+	unit_fail_if(ufs_unmount() != 0);
+
+	FILE *f = fopen(path, "r+");
+	unit_fail_if(f == NULL);
+	fputs("garbage", f);
+	fclose(f);
+	unit_check(ufs_mount(path) == -1, "no mount of a broken image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unlink(path);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_mount_restore(void)
+{
+	unit_test_start();
+
+	const char *path = "test_userfs.img";
+	unit_fail_if(ufs_format(path, 128 * 1024 * 1024) != 0);
+	/*
+	 * A crash right after a restore keeps all of it.
+	 */
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (ufs_mount(path) != 0)
+			_exit(1);
+		int fd1 = ufs_open("a", UFS_CREATE);
+		int fd2 = ufs_open("b", UFS_CREATE);
+		if (fd1 == -1 || fd2 == -1 || ufs_write(fd1, "old", 3) != 3 ||
+		    ufs_close(fd1) != 0 || ufs_close(fd2) != 0)
+			_exit(2);
+		struct ufs_snapshot *snap = ufs_snapshot_create();
+		if (snap == NULL)
+			_exit(3);
+		fd1 = ufs_open("c", UFS_CREATE);
+		if (fd1 == -1 || ufs_close(fd1) != 0 ||
+		    ufs_delete("b") != 0 || ufs_delete("a") != 0)
+			_exit(4);
+		if (ufs_snapshot_restore(snap) != 0)
+			_exit(5);
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	unit_fail_if(!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+	unit_check(ufs_mount(path) == 0, "mount after a crash");
+	unit_check(test_file_equals("a", "old", 3) &&
+		   test_file_equals("b", "", 0) && ufs_open("c", 0) == -1,
+		   "restore is replayed");
+	/*
+	 * Too many files for one change are not restored.
+	 */
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_fail_if(snap == NULL);
+	char name[32];
+	for (int i = 0; i < 2000; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(ufs_snapshot_restore(snap) == -1,
+		   "no restore of too many files");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	int fd = ufs_open("file0", 0);
+	unit_check(fd != -1, "files are not changed");
+	unit_fail_if(ufs_close(fd) != 0);
+	for (int i = 0; i < 1000; ++i) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore of less files");
+	unit_check(ufs_open("file1999", 0) == -1 &&
+		   test_file_equals("a", "old", 3), "files are restored");
+	ufs_snapshot_delete(snap);
+	unit_fail_if(ufs_unmount() != 0);
+	unit_check(ufs_mount(path) == 0, "mount again");
+	unit_check(ufs_open("file1999", 0) == -1 &&
+		   test_file_equals("a", "old", 3) &&
+		   test_file_equals("b", "", 0), "restore is kept");
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	unit_fail_if(ufs_unmount() != 0);
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -454,6 +1283,18 @@ main(void)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_seek();
+	test_pread_pwrite();
+	test_namespace();
+	test_vector_io();
+	test_read_view();
+	test_pread_view();
+	test_clone();
+	test_rename();
+	test_snapshot();
+	test_foreach();
+	test_mount();
+	test_mount_restore();
 
 	unit_test_finish();
 	return 0;
@@ -0,0 +1,471 @@
+#include "userfs.h"
+#include "unit.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Tests of userfs used from many threads at once. Each of them
+ * checks the data, so a race shows up as a failure, and under
+ * -fsanitize=thread as a report. The last one is a throughput
+ * measurement of the parallel readers.
+ */
+
+enum {
+	THREAD_COUNT = 8,
+	SHARED_FILE_SIZE = 1024 * 1024,
+};
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+test_run_threads(void *(*func)(void *), int count)
+{
+	pthread_t threads[THREAD_COUNT];
+	long results[THREAD_COUNT];
+	for (long i = 0; i < count; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, func,
+					    (void *)i) != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		void *res;
+		pthread_join(threads[i], &res);
+		results[i] = (long)res;
+		ok = ok && results[i] == 0;
+	}
+	unit_fail_if(!ok);
+}
+
+/** Each thread works with its own files, all in one namespace. */
+static void *
+test_private_files_f(void *arg)
+{
+	long id = (long)arg;
+	char name[64], buf[64], data[64];
+	for (int i = 0; i < 2000; ++i) {
+		sprintf(name, "thread%ld-file%d", id, i % 100);
+		int len = sprintf(data, "%ld:%d", id, i) + 1;
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			return (void *)1;
+		if (ufs_write(fd, data, len) != len ||
+		    ufs_pread(fd, buf, sizeof(buf), 0) != len ||
+		    memcmp(buf, data, len) != 0 || ufs_close(fd) != 0)
+			return (void *)2;
+		if (i % 3 == 0 && ufs_delete(name) != 0)
+			return (void *)3;
+	}
+	for (int i = 0; i < 100; ++i) {
+		sprintf(name, "thread%ld-file%d", id, i);
+		if (ufs_delete(name) != 0 && ufs_errno() != UFS_ERR_NO_FILE)
+			return (void *)4;
+	}
+	return NULL;
+}
+
+static void
+test_private_files(void)
+{
+	unit_test_start();
+	test_run_threads(test_private_files_f, THREAD_COUNT);
+	unit_check(true, "threads create, write, read and delete own files");
+	unit_test_finish();
+}
+
+/**
+ * All threads open, write, close and delete the same name. Any of
+ * them can see the file of another one, or no file.
+ */
+static void *
+test_shared_name_f(void *arg)
+{
+	long id = (long)arg;
+	char buf[16];
+	for (int i = 0; i < 20000; ++i) {
+		int fd = ufs_open("shared", UFS_CREATE);
+		if (fd < 0)
+			return (void *)1;
+		if (ufs_write(fd, (char *)&id, sizeof(id)) != sizeof(id))
+			return (void *)2;
+		if (ufs_pread(fd, buf, sizeof(buf), 0) < (ssize_t)sizeof(id))
+			return (void *)3;
+		if (i % 2 == 0)
+			ufs_delete("shared");
+		if (ufs_close(fd) != 0)
+			return (void *)4;
+	}
+	return NULL;
+}
+
+static void
+test_shared_name(void)
+{
+	unit_test_start();
+	test_run_threads(test_shared_name_f, THREAD_COUNT);
+	ufs_delete("shared");
+	unit_check(ufs_open("shared", 0) == -1, "file is deleted in the end");
+	unit_check(true, "threads open and delete one name concurrently");
+	unit_test_finish();
+}
+
+static int shared_fd;
+
+/** Odd threads read one file, even ones write and resize their own. */
+static void *
+test_readers_writers_f(void *arg)
+{
+	long id = (long)arg;
+	unsigned seed = id;
+	if (id % 2 == 1) {
+		for (int i = 0; i < 100000; ++i) {
+			size_t pos = rand_r(&seed) % (SHARED_FILE_SIZE - 8);
+			unsigned char buf[8];
+			if (ufs_pread(shared_fd, (char *)buf, 8, pos) != 8)
+				return (void *)1;
+			for (int j = 0; j < 8; ++j) {
+				if (buf[j] != (unsigned char)(pos + j))
+					return (void *)2;
+			}
+		}
+		return NULL;
+	}
+	char name[32];
+	sprintf(name, "writer%ld", id);
+	int fd = ufs_open(name, UFS_CREATE);
+	if (fd < 0)
+		return (void *)3;
+	char buf[4096];
+	memset(buf, id, sizeof(buf));
+	for (int i = 0; i < 2000; ++i) {
+		if (ufs_write(fd, buf, sizeof(buf)) != sizeof(buf))
+			return (void *)4;
+		if (i % 100 == 99 && ufs_resize(fd, 1000) != 0)
+			return (void *)5;
+	}
+	char check[4096];
+	ssize_t size = ufs_seek(fd, 0, SEEK_END);
+	for (ssize_t pos = 1000; pos < size; pos += sizeof(check)) {
+		ssize_t rc = ufs_pread(fd, check, sizeof(check), pos);
+		if (rc <= 0 || memcmp(check, buf, rc) != 0)
+			return (void *)6;
+	}
+	if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+		return (void *)7;
+	return NULL;
+}
+
+static void
+test_readers_writers(void)
+{
+	unit_test_start();
+
+	shared_fd = ufs_open("readers", UFS_CREATE);
+	unit_fail_if(shared_fd == -1);
+	static unsigned char data[SHARED_FILE_SIZE];
+	for (int i = 0; i < SHARED_FILE_SIZE; ++i)
+		data[i] = i;
+	unit_fail_if(ufs_write(shared_fd, (char *)data, sizeof(data)) !=
+		     sizeof(data));
+	test_run_threads(test_readers_writers_f, THREAD_COUNT);
+	unit_check(true, "readers of one file and writers of others");
+	unit_fail_if(ufs_close(shared_fd) != 0);
+	unit_fail_if(ufs_delete("readers") != 0);
+
+	unit_test_finish();
+}
+
+static pthread_barrier_t errno_barrier;
+
+static void *
+test_errno_f(void *arg)
+{
+	long id = (long)arg;
+	int fd = -1;
+	if (id == 0) {
+		if (ufs_open("no such file", 0) != -1)
+			return (void *)1;
+	} else {
+		fd = ufs_open("errno", UFS_READ_ONLY);
+		if (fd < 0 || ufs_write(fd, "a", 1) != -1)
+			return (void *)2;
+	}
+	pthread_barrier_wait(&errno_barrier);
+	enum ufs_error_code expected = id == 0 ? UFS_ERR_NO_FILE :
+				       UFS_ERR_NO_PERMISSION;
+	if (ufs_errno() != expected)
+		return (void *)3;
+	if (fd >= 0)
+		ufs_close(fd);
+	return NULL;
+}
+
+static void
+test_errno(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("errno", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	pthread_barrier_init(&errno_barrier, NULL, 2);
+	test_run_threads(test_errno_f, 2);
+	pthread_barrier_destroy(&errno_barrier);
+	unit_check(true, "each thread has its own error code");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("errno") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	CLONE_FILE_SIZE = 256 * 1024,
+};
+
+static int clone_fd;
+
+/**
+ * Thread 0 rewrites the file with one byte value after another,
+ * others clone it and check that each clone has only one value.
+ * Thread 1 takes the snapshots meanwhile.
+ */
+static void *
+test_clone_f(void *arg)
+{
+	long id = (long)arg;
+	static char buf[THREAD_COUNT][CLONE_FILE_SIZE];
+	char *data = buf[id];
+	if (id == 0) {
+		for (int i = 0; i < 500; ++i) {
+			memset(data, i, CLONE_FILE_SIZE);
+			if (ufs_pwrite(clone_fd, data, CLONE_FILE_SIZE, 0) !=
+			    CLONE_FILE_SIZE)
+				return (void *)1;
+		}
+		return NULL;
+	}
+	if (id == 1) {
+		for (int i = 0; i < 100; ++i) {
+			struct ufs_snapshot *snap = ufs_snapshot_create();
+			if (snap == NULL)
+				return (void *)2;
+			ufs_snapshot_delete(snap);
+		}
+		return NULL;
+	}
+	char name[32];
+	sprintf(name, "clone%ld", id);
+	for (int i = 0; i < 200; ++i) {
+		if (ufs_clone("clone", name) != 0)
+			return (void *)3;
+		int fd = ufs_open(name, 0);
+		if (fd < 0 || ufs_read(fd, data, CLONE_FILE_SIZE) !=
+			      CLONE_FILE_SIZE)
+			return (void *)4;
+		for (int j = 1; j < CLONE_FILE_SIZE; ++j) {
+			if (data[j] != data[0])
+				return (void *)5;
+		}
+		/* Make the clone own its extents for the next round. */
+		if (ufs_pwrite(fd, data, 1, i) != 1 || ufs_close(fd) != 0)
+			return (void *)6;
+	}
+	return ufs_delete(name) == 0 ? NULL : (void *)7;
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	clone_fd = ufs_open("clone", UFS_CREATE);
+	unit_fail_if(clone_fd == -1);
+	unit_fail_if(ufs_resize(clone_fd, CLONE_FILE_SIZE) != 0);
+	test_run_threads(test_clone_f, THREAD_COUNT);
+	unit_check(true, "clones and snapshots of a file being written");
+	unit_fail_if(ufs_close(clone_fd) != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	RESTORE_FILE_SIZE = 16 * 1024,
+};
+
+/**
+ * All threads replace one name with their own files by rename, and
+ * read the file of that name meanwhile. It is always there, and is
+ * written by one thread only.
+ */
+static void *
+test_rename_f(void *arg)
+{
+	long id = (long)arg;
+	char name[32], data[64];
+	sprintf(name, "rename%ld", id);
+	for (int i = 0; i < 20000; ++i) {
+		int fd = ufs_open(name, UFS_CREATE);
+		memset(data, 'a' + id, sizeof(data));
+		if (fd < 0 || ufs_write(fd, data, sizeof(data)) != sizeof(data))
+			return (void *)1;
+		if (ufs_rename(name, "renamed") != 0)
+			return (void *)2;
+		/* The fd follows the file. */
+		if (ufs_pwrite(fd, data, 1, 0) != 1 || ufs_close(fd) != 0)
+			return (void *)3;
+		fd = ufs_open("renamed", 0);
+		if (fd < 0)
+			return (void *)4;
+		if (ufs_pread(fd, data, sizeof(data), 0) != sizeof(data))
+			return (void *)5;
+		for (size_t j = 1; j < sizeof(data); ++j) {
+			if (data[j] != data[0])
+				return (void *)6;
+		}
+		if (ufs_close(fd) != 0)
+			return (void *)7;
+	}
+	return NULL;
+}
+
+static void
+test_rename(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("renamed", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char data[64];
+	memset(data, 'z', sizeof(data));
+	unit_fail_if(ufs_write(fd, data, sizeof(data)) != sizeof(data));
+	unit_fail_if(ufs_close(fd) != 0);
+	test_run_threads(test_rename_f, THREAD_COUNT);
+	unit_check(true, "the renamed file is replaced atomically");
+	unit_fail_if(ufs_delete("renamed") != 0);
+
+	unit_test_finish();
+}
+
+static struct ufs_snapshot *restore_snap;
+
+/**
+ * Thread 0 restores the snapshot, where the file is of zeros.
+ * Others open the file by name, check that it has one byte value,
+ * rewrite it with another, and create and delete their clones of it
+ * meanwhile.
+ */
+static void *
+test_restore_f(void *arg)
+{
+	long id = (long)arg;
+	static char buf[THREAD_COUNT][RESTORE_FILE_SIZE];
+	char *data = buf[id];
+	if (id == 0) {
+		for (int i = 0; i < 100; ++i) {
+			if (ufs_snapshot_restore(restore_snap) != 0)
+				return (void *)1;
+		}
+		return NULL;
+	}
+	char name[32];
+	sprintf(name, "restore%ld", id);
+	for (int i = 0; i < 200; ++i) {
+		int fd = ufs_open("restore", 0);
+		if (fd < 0 || ufs_pread(fd, data, RESTORE_FILE_SIZE, 0) !=
+			      RESTORE_FILE_SIZE)
+			return (void *)2;
+		for (int j = 1; j < RESTORE_FILE_SIZE; ++j) {
+			if (data[j] != data[0])
+				return (void *)3;
+		}
+		memset(data, id, RESTORE_FILE_SIZE);
+		if (ufs_pwrite(fd, data, RESTORE_FILE_SIZE, 0) !=
+		    RESTORE_FILE_SIZE || ufs_close(fd) != 0)
+			return (void *)4;
+		if (ufs_clone("restore", name) != 0)
+			return (void *)5;
+		/* The restore could delete it already. */
+		ufs_delete(name);
+	}
+	return NULL;
+}
+
+static void
+test_restore(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("restore", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, RESTORE_FILE_SIZE) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	restore_snap = ufs_snapshot_create();
+	unit_fail_if(restore_snap == NULL);
+	test_run_threads(test_restore_f, THREAD_COUNT);
+	unit_check(true, "restores while the files are opened and created");
+	ufs_snapshot_delete(restore_snap);
+	unit_fail_if(ufs_delete("restore") != 0);
+
+	unit_test_finish();
+}
+
+static int bench_fd;
+static size_t bench_op_count;
+
+static void *
+test_read_throughput_f(void *arg)
+{
+	unsigned seed = (long)arg;
+	char buf[4096];
+	for (size_t i = 0; i < bench_op_count; ++i) {
+		size_t pos = rand_r(&seed) % (SHARED_FILE_SIZE - sizeof(buf));
+		if (ufs_pread(bench_fd, buf, sizeof(buf), pos) != sizeof(buf))
+			return (void *)1;
+	}
+	return NULL;
+}
+
+static void
+test_read_throughput(void)
+{
+	unit_test_start();
+
+	bench_fd = ufs_open("bench", UFS_CREATE);
+	unit_fail_if(bench_fd == -1);
+	unit_fail_if(ufs_resize(bench_fd, SHARED_FILE_SIZE) != 0);
+	bench_op_count = 200000;
+	for (int count = 1; count <= THREAD_COUNT; count *= 2) {
+		double start = test_now();
+		test_run_threads(test_read_throughput_f, count);
+		double time = test_now() - start;
+		unit_msg("%d threads: %.2f M preads/s of 4KB", count,
+			 count * bench_op_count / time / 1e6);
+	}
+	unit_fail_if(ufs_close(bench_fd) != 0);
+	unit_fail_if(ufs_delete("bench") != 0);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_private_files();
+	test_shared_name();
+	test_readers_writers();
+	test_errno();
+	test_clone();
+	test_restore();
+	test_rename();
+	test_read_throughput();
+
+	unit_test_finish();
+	return 0;
+}
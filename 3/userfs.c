@@ -1,64 +1,206 @@
 #include "userfs.h"
+#include "image.h"
+#include <stdbool.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+/**
+ * A file is stored in extents of growing size. The first two are
+ * EXTENT_MIN_SIZE, and each next one is twice bigger, until
+ * EXTENT_MAX_SIZE. So the extents before EXTENT_MAX_SIZE take
+ * exactly EXTENT_MAX_SIZE bytes, and all the next ones are of the
+ * max size:
+ *
+ *     | 4K | 4K | 8K | 16K | ... | 1M |  2M  |  2M  | ...
+ *     0    4K   8K   16K   32K     1M   2M     4M     6M
+ *
+ * A small file takes little memory, a big one takes few
+ * allocations, and the extent of any offset is found with a couple
+ * of instructions. The max size extents are aligned by their size,
+ * so the kernel can back them with huge pages.
+ */
 enum {
-	BLOCK_SIZE = 512,
+	EXTENT_MIN_SIZE_LOG = 12,
+	EXTENT_MAX_SIZE_LOG = 21,
+	EXTENT_MIN_SIZE = 1 << EXTENT_MIN_SIZE_LOG,
+	EXTENT_MAX_SIZE = 1 << EXTENT_MAX_SIZE_LOG,
+	/** Index of the first extent of the max size. */
+	EXTENT_MAX_SIZE_IDX = EXTENT_MAX_SIZE_LOG - EXTENT_MIN_SIZE_LOG + 1,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Number of the extents of a file of the max size. */
+	EXTENT_MAX_COUNT = EXTENT_MAX_SIZE_IDX +
+			   MAX_FILE_SIZE / EXTENT_MAX_SIZE - 1,
+	/** Start capacity of a non-empty extent array. */
+	EXTENT_ARRAY_MIN_CAPACITY = 8,
+	/** Start size of a file table shard, a power of 2. */
+	FILE_TABLE_MIN_SIZE = 64,
+	FILE_SHARD_COUNT_LOG = 6,
+	FILE_SHARD_COUNT = 1 << FILE_SHARD_COUNT_LOG,
+	/** Descriptors are in chunks of this size. */
+	FD_CHUNK_SIZE = 4096,
+	FD_CHUNK_COUNT = 1024,
+	FD_MAX = FD_CHUNK_SIZE * FD_CHUNK_COUNT,
+	CACHE_LINE_SIZE = 64,
+	/** Size of the image created by ufs_mount(). */
+	IMAGE_DEFAULT_SIZE = 1024 * 1024 * 1024,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+_Static_assert((int)IMAGE_BLOCK_SIZE == EXTENT_MIN_SIZE &&
+	       (int)IMAGE_ORDER_MAX == EXTENT_MAX_SIZE_LOG - EXTENT_MIN_SIZE_LOG &&
+	       (int)IMAGE_INODE_EXTENT_MAX == EXTENT_MAX_COUNT,
+	       "image fits the extents");
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-struct block {
-	/** Block memory. */
+/**
+ * The mounted image. All the files and the new extents are in it
+ * then. It is changed only when there are no files, so it is read
+ * without a lock.
+ */
+static struct image *ufs_image = NULL;
+
+/**
+ * Extents are shared by the clones of a file, the snapshots and the
+ * read views, and are copied on write. Only an extent with one
+ * reference is changed in place.
+ */
+struct extent {
+	/** Files, snapshots and views which use the extent. */
+	int refs;
+	/** Size of the memory. */
+	uint32_t size;
+	/** Extent memory. For the heap extents it is the data below. */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
-
-	/* PUT HERE OTHER MEMBERS */
+	/** Image of the memory, or NULL. */
+	struct image *image;
+	char data[];
 };
 
+struct filedesc;
+
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Readers of the data take it for read, so they do not block
+	 * each other. Writers, resize, and changes of the descriptor
+	 * list take it for write.
+	 */
+	pthread_rwlock_t lock;
+	/**
+	 * Array of the file extents. The extent of any offset is
+	 * found without walking the extents before it. There can be
+	 * more extents than needed for the size, they are not
+	 * visible.
+	 */
+	struct extent **extents;
+	int extent_count;
+	int extent_capacity;
+	/** File size in bytes. */
+	size_t size;
+	/**
+	 * One reference is of the file table, while the file is not
+	 * deleted, and one is of each opened descriptor. The last one
+	 * frees the file.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
+	/** Opened descriptors of the file. */
+	struct filedesc *descs;
+	/** Inode in the image, or -1. The write lock is needed. */
+	int ino;
+	/**
+	 * Hash of the name. The name is changed only by rename, under
+	 * the write locks of the file and of its both shards.
+	 */
+	uint32_t hash;
 	char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
+};
+
+struct file_slot {
+	/** Cached hash of the file name, to skip most of strcmp(). */
+	uint32_t hash;
+	/** NULL, if the slot is free. */
+	struct file *file;
+};
+
+/**
+ * Hash table of the files by name, with open addressing and linear
+ * probing. Deletion moves the next slots of the same chain back, so
+ * there are no tombstones, and a lookup stops at the first free
+ * slot.
+ *
+ * All the files are split into shards by the high bits of the name
+ * hash, each with its own table and lock. Opening of an existing
+ * file takes the lock for read, creation and deletion - for write,
+ * and only in one shard. Rename locks both shards of the names, in
+ * the order of the addresses. Creation, deletion and rename also
+ * take the namespace lock for read, so a snapshot can stop them all
+ * with one lock.
+ */
+struct file_shard {
+	pthread_rwlock_t lock;
+	struct file_slot *table;
+	/** Number of the slots, a power of 2. */
+	uint32_t size;
+	uint32_t count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
-	/* PUT HERE OTHER MEMBERS */
+static struct file_shard file_shards[FILE_SHARD_COUNT] = {
+	[0 ... FILE_SHARD_COUNT - 1] = {.lock = PTHREAD_RWLOCK_INITIALIZER},
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/** Taken before a shard lock. Held for write, it freezes the tables. */
+static pthread_rwlock_t file_namespace_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 struct filedesc {
 	struct file *file;
+	/** Index of the extent with the current position. */
+	int extent_idx;
+	/** Offset of the current position in the extent. */
+	int offset;
+	/** One of UFS_READ_ONLY, UFS_WRITE_ONLY, UFS_READ_WRITE. */
+	int mode;
+	/** List of the descriptors of the file. */
+	struct filedesc *next;
+	struct filedesc *prev;
+};
+
+/** A file in a snapshot. */
+struct snapshot_file {
+	size_t size;
+	/** The extents, with a reference of the snapshot. */
+	struct extent **extents;
+	uint32_t hash;
+	char name[];
+};
 
-	/* PUT HERE OTHER MEMBERS */
+struct ufs_snapshot {
+	struct snapshot_file **files;
+	int file_count;
+	/** The mounted image, whose extents are in the snapshot. */
+	struct image *image;
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * File descriptors. They are in chunks, which are never moved or
+ * freed, so a descriptor is found without a lock: with an atomic
+ * load of its chunk and of the pointer in it. When a descriptor is
+ * closed, its place is set to NULL, and its number is pushed to the
+ * stack of free ones to be taken by a next ufs_open() call. Only
+ * opening and closing take the mutex.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc **file_descriptor_chunks[FD_CHUNK_COUNT];
+static pthread_mutex_t file_descriptor_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** The numbers below it are either taken or in the free stack. */
 static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+static int *file_descriptor_free = NULL;
+static int file_descriptor_free_count = 0;
+/** Always >= file_descriptor_count, so a push never fails. */
+static int file_descriptor_free_capacity = 0;
 
 enum ufs_error_code
 ufs_errno()
@@ -66,42 +208,1642 @@ ufs_errno()
 	return ufs_error_code;
 }
 
+static inline size_t
+extent_size(int idx)
+{
+	if (idx == 0)
+		return EXTENT_MIN_SIZE;
+	if (idx < EXTENT_MAX_SIZE_IDX)
+		return (size_t)EXTENT_MIN_SIZE << (idx - 1);
+	return EXTENT_MAX_SIZE;
+}
+
+/** Offset of the extent @a idx in the file. */
+static inline size_t
+extent_start(int idx)
+{
+	if (idx == 0)
+		return 0;
+	if (idx < EXTENT_MAX_SIZE_IDX)
+		return (size_t)EXTENT_MIN_SIZE << (idx - 1);
+	return (size_t)(idx - EXTENT_MAX_SIZE_IDX + 1) * EXTENT_MAX_SIZE;
+}
+
+/** Index of the extent with @a pos, and the offset in it. */
+static inline int
+extent_idx(size_t pos, int *offset)
+{
+	if (pos >= EXTENT_MAX_SIZE) {
+		*offset = pos & (EXTENT_MAX_SIZE - 1);
+		return EXTENT_MAX_SIZE_IDX - 1 + pos / EXTENT_MAX_SIZE;
+	}
+	size_t count = pos >> EXTENT_MIN_SIZE_LOG;
+	if (count == 0) {
+		*offset = pos;
+		return 0;
+	}
+	/* Number of bits in count, the first extent is doubled. */
+	int idx = 64 - __builtin_clzll(count);
+	*offset = pos - ((size_t)EXTENT_MIN_SIZE << (idx - 1));
+	return idx;
+}
+
+/** How many extents are needed for @a size bytes. */
+static inline int
+extent_count(size_t size)
+{
+	int offset;
+	return size == 0 ? 0 : extent_idx(size - 1, &offset) + 1;
+}
+
+/** Log2 of the extent size in the min extents, 0 for 4KB. */
+static inline int
+extent_order(size_t size)
+{
+	return __builtin_ctzll(size) - EXTENT_MIN_SIZE_LOG;
+}
+
+/**
+ * The extents of the max size are mapped with the alignment by the
+ * size, so they can be huge pages. The smaller ones are in the
+ * heap, together with their header.
+ */
+static struct extent *
+extent_new(int idx)
+{
+	size_t size = extent_size(idx);
+	struct extent *e;
+	if (ufs_image != NULL) {
+		e = malloc(sizeof(*e));
+		if (e == NULL)
+			return NULL;
+		e->memory = image_alloc(ufs_image, extent_order(size));
+		if (e->memory == NULL) {
+			free(e);
+			return NULL;
+		}
+	} else if (idx < EXTENT_MAX_SIZE_IDX) {
+		e = malloc(sizeof(*e) + size);
+		if (e == NULL)
+			return NULL;
+		e->memory = e->data;
+	} else {
+		e = malloc(sizeof(*e));
+		if (e == NULL)
+			return NULL;
+		char *map = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			free(e);
+			return NULL;
+		}
+		e->memory = (char *)(((uintptr_t)map + size - 1) &
+				     ~(size - 1));
+		if (e->memory != map)
+			munmap(map, e->memory - map);
+		munmap(e->memory + size, map + size - e->memory);
+#ifdef MADV_HUGEPAGE
+		madvise(e->memory, size, MADV_HUGEPAGE);
+#endif
+	}
+	e->refs = 1;
+	e->size = size;
+	e->image = ufs_image;
+	return e;
+}
+
+static inline void
+extent_ref(struct extent *e)
+{
+	__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+extent_unref(struct extent *e)
+{
+	if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (e->image != NULL)
+		image_free(e->image, e->memory, extent_order(e->size));
+	else if (e->memory != e->data)
+		munmap(e->memory, e->size);
+	free(e);
+}
+
+/**
+ * Referenced copy of the first @a count pointers of @a extents.
+ * NULL, if @a count is 0 or there is no memory.
+ */
+static struct extent **
+extent_array_dup(struct extent **extents, int count)
+{
+	if (count == 0)
+		return NULL;
+	struct extent **res = malloc(count * sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	for (int i = 0; i < count; ++i) {
+		res[i] = extents[i];
+		extent_ref(res[i]);
+	}
+	return res;
+}
+
+static void
+extent_array_delete(struct extent **extents, int count)
+{
+	for (int i = 0; i < count; ++i)
+		extent_unref(extents[i]);
+	free(extents);
+}
+
+static inline size_t
+filedesc_pos(const struct filedesc *desc)
+{
+	return extent_start(desc->extent_idx) + desc->offset;
+}
+
+static inline void
+filedesc_set_pos(struct filedesc *desc, size_t pos)
+{
+	desc->extent_idx = extent_idx(pos, &desc->offset);
+}
+
+/**
+ * Find the descriptor object. Sets the error, if it is invalid. A
+ * descriptor should not be closed while other threads use it, like
+ * with the descriptors of a process.
+ */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	if (fd < 0 || fd >= FD_MAX)
+		goto error;
+	struct filedesc **chunk = __atomic_load_n(
+		&file_descriptor_chunks[fd / FD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		goto error;
+	struct filedesc *desc = __atomic_load_n(&chunk[fd % FD_CHUNK_SIZE],
+						__ATOMIC_ACQUIRE);
+	if (desc == NULL)
+		goto error;
+	return desc;
+error:
+	ufs_error_code = UFS_ERR_NO_FILE;
+	return NULL;
+}
+
+/** Take a free descriptor number for @a desc. */
+static int
+filedesc_alloc(struct filedesc *desc)
+{
+	int fd = -1;
+	pthread_mutex_lock(&file_descriptor_mutex);
+	if (file_descriptor_free_count > 0) {
+		fd = file_descriptor_free[--file_descriptor_free_count];
+		goto publish;
+	}
+	if (file_descriptor_count == FD_MAX)
+		goto unlock;
+	if (file_descriptor_count == file_descriptor_free_capacity) {
+		int capacity = file_descriptor_free_capacity * 2;
+		if (capacity == 0)
+			capacity = 64;
+		int *free_fds = realloc(file_descriptor_free,
+					capacity * sizeof(*free_fds));
+		if (free_fds == NULL)
+			goto unlock;
+		file_descriptor_free = free_fds;
+		file_descriptor_free_capacity = capacity;
+	}
+	struct filedesc ***chunk =
+		&file_descriptor_chunks[file_descriptor_count / FD_CHUNK_SIZE];
+	if (*chunk == NULL) {
+		struct filedesc **new_chunk =
+			calloc(FD_CHUNK_SIZE, sizeof(*new_chunk));
+		if (new_chunk == NULL)
+			goto unlock;
+		__atomic_store_n(chunk, new_chunk, __ATOMIC_RELEASE);
+	}
+	fd = file_descriptor_count++;
+publish:
+	__atomic_store_n(&file_descriptor_chunks[fd / FD_CHUNK_SIZE]
+			 [fd % FD_CHUNK_SIZE], desc, __ATOMIC_RELEASE);
+unlock:
+	pthread_mutex_unlock(&file_descriptor_mutex);
+	return fd;
+}
+
+/**
+ * Free the descriptor number and return its object. Only one of
+ * concurrent closes of the same descriptor gets it.
+ */
+static struct filedesc *
+filedesc_take(int fd)
+{
+	if (fd < 0 || fd >= FD_MAX) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	struct filedesc *desc = NULL;
+	pthread_mutex_lock(&file_descriptor_mutex);
+	struct filedesc **chunk = file_descriptor_chunks[fd / FD_CHUNK_SIZE];
+	if (chunk != NULL && chunk[fd % FD_CHUNK_SIZE] != NULL) {
+		desc = chunk[fd % FD_CHUNK_SIZE];
+		__atomic_store_n(&chunk[fd % FD_CHUNK_SIZE], NULL,
+				 __ATOMIC_RELEASE);
+		file_descriptor_free[file_descriptor_free_count++] = fd;
+	}
+	pthread_mutex_unlock(&file_descriptor_mutex);
+	if (desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return desc;
+}
+
+/** Remove from the list of the file. Its write lock is needed. */
+static void
+filedesc_unlink(struct filedesc *desc)
+{
+	if (desc->prev != NULL)
+		desc->prev->next = desc->next;
+	else
+		desc->file->descs = desc->next;
+	if (desc->next != NULL)
+		desc->next->prev = desc->prev;
+}
+
+/** FNV-1a hash of the name. Its length is found on the way. */
+static uint32_t
+file_name_hash(const char *name, size_t *len)
+{
+	uint32_t hash = 2166136261u;
+	const char *pos = name;
+	for (; *pos != 0; ++pos)
+		hash = (hash ^ (uint8_t)*pos) * 16777619u;
+	*len = pos - name;
+	return hash;
+}
+
+static inline struct file_shard *
+file_shard(uint32_t hash)
+{
+	return &file_shards[hash >> (32 - FILE_SHARD_COUNT_LOG)];
+}
+
+static struct file *
+file_find(struct file_shard *shard, const char *name, uint32_t hash)
+{
+	if (shard->table == NULL)
+		return NULL;
+	uint32_t mask = shard->size - 1;
+	for (uint32_t i = hash & mask; shard->table[i].file != NULL;
+	     i = (i + 1) & mask) {
+		if (shard->table[i].hash == hash &&
+		    strcmp(shard->table[i].file->name, name) == 0)
+			return shard->table[i].file;
+	}
+	return NULL;
+}
+
+static void
+file_table_insert(struct file_slot *table, uint32_t size, struct file *f)
+{
+	uint32_t mask = size - 1;
+	uint32_t i = f->hash & mask;
+	while (table[i].file != NULL)
+		i = (i + 1) & mask;
+	table[i].hash = f->hash;
+	table[i].file = f;
+}
+
+/** Make place for one more file, keeping the load <= 3/4. */
+static int
+file_table_reserve(struct file_shard *shard)
+{
+	if ((shard->count + 1) * 4 <= shard->size * 3)
+		return 0;
+	uint32_t size = shard->size * 2;
+	if (size == 0)
+		size = FILE_TABLE_MIN_SIZE;
+	struct file_slot *table = calloc(size, sizeof(*table));
+	if (table == NULL)
+		return -1;
+	for (uint32_t i = 0; i < shard->size; ++i) {
+		if (shard->table[i].file != NULL)
+			file_table_insert(table, size, shard->table[i].file);
+	}
+	free(shard->table);
+	shard->table = table;
+	shard->size = size;
+	return 0;
+}
+
+/** Remove the file from the table. Its reference is not dropped. */
+static void
+file_unlink(struct file_shard *shard, struct file *f)
+{
+	struct file_slot *table = shard->table;
+	uint32_t mask = shard->size - 1;
+	uint32_t i = f->hash & mask;
+	while (table[i].file != f)
+		i = (i + 1) & mask;
+	/*
+	 * Move back the next slots of the chain, which can not be
+	 * found anymore behind the freed one.
+	 */
+	for (uint32_t j = (i + 1) & mask; table[j].file != NULL;
+	     j = (j + 1) & mask) {
+		uint32_t home = table[j].hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].file = NULL;
+	--shard->count;
+}
+
+/** Drop the extents starting from @a count. */
+static void
+file_truncate_extents(struct file *f, int count)
+{
+	for (int i = count; i < f->extent_count; ++i)
+		extent_unref(f->extents[i]);
+	if (count < f->extent_count)
+		f->extent_count = count;
+}
+
+static void
+file_delete(struct file *f)
+{
+	file_truncate_extents(f, 0);
+	free(f->extents);
+	pthread_rwlock_destroy(&f->lock);
+	free(f->name);
+	free(f);
+}
+
+static inline void
+file_ref(struct file *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+file_unref(struct file *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		file_delete(f);
+}
+
+/** Inode of the name, the size and the extents of the file. */
+static void
+file_inode(struct file *f, struct image_inode *inode)
+{
+	memset(inode, 0, sizeof(*inode));
+	inode->size = f->size;
+	inode->name_len = strlen(f->name);
+	memcpy(inode->name, f->name, inode->name_len);
+	int count = extent_count(f->size);
+	for (int i = 0; i < count; ++i) {
+		struct extent *e = f->extents[i];
+		inode->extents[i] = image_block_number(e->image, e->memory);
+	}
+}
+
+/**
+ * Write the size and the extents of the file into the image
+ * journal, if it is there. The write lock is needed.
+ */
+static void
+file_log(struct file *f)
+{
+	if (f->ino < 0)
+		return;
+	struct image_inode inode;
+	file_inode(f, &inode);
+	image_log(ufs_image, f->ino, &inode);
+}
+
+/** An empty file, not in a table yet. */
+static struct file *
+file_alloc(const char *name, size_t len, uint32_t hash)
+{
+	struct file *f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+	f->name = malloc(len + 1);
+	if (f->name == NULL) {
+		free(f);
+		return NULL;
+	}
+	pthread_rwlock_init(&f->lock, NULL);
+	memcpy(f->name, name, len + 1);
+	f->hash = hash;
+	f->refs = 1;
+	f->ino = -1;
+	return f;
+}
+
+/** Create a file in the shard. It has the reference of the table. */
+static struct file *
+file_new(struct file_shard *shard, const char *name, size_t len,
+	 uint32_t hash)
+{
+	if (file_table_reserve(shard) != 0)
+		return NULL;
+	struct file *f = file_alloc(name, len, hash);
+	if (f == NULL)
+		return NULL;
+	if (ufs_image != NULL) {
+		f->ino = image_inode_alloc(ufs_image);
+		if (f->ino < 0) {
+			file_delete(f);
+			return NULL;
+		}
+		file_log(f);
+	}
+	file_table_insert(shard->table, shard->size, f);
+	++shard->count;
+	return f;
+}
+
+/**
+ * Make the extents cover at least @a size bytes. On error the new
+ * extents which were allocated stay in the file, it is not a
+ * problem - they are behind the size.
+ */
+static int
+file_reserve(struct file *f, size_t size)
+{
+	int count = extent_count(size);
+	if (count <= f->extent_count)
+		return 0;
+	if (count > f->extent_capacity) {
+		int capacity = f->extent_capacity * 2;
+		if (capacity < EXTENT_ARRAY_MIN_CAPACITY)
+			capacity = EXTENT_ARRAY_MIN_CAPACITY;
+		if (capacity < count)
+			capacity = count;
+		struct extent **extents =
+			realloc(f->extents, capacity * sizeof(*extents));
+		if (extents == NULL)
+			return -1;
+		f->extents = extents;
+		f->extent_capacity = capacity;
+	}
+	for (; f->extent_count < count; ++f->extent_count) {
+		struct extent *e = extent_new(f->extent_count);
+		if (e == NULL)
+			return -1;
+		f->extents[f->extent_count] = e;
+	}
+	return 0;
+}
+
+/**
+ * Copy the shared extents in [@a begin, @a end) before a change.
+ * They must be covered by the extents. The replaced ones are put
+ * into @a old, and are counted in @a old_count even on an error.
+ * They are dropped by file_log_and_drop() after the change.
+ */
+static int
+file_unshare(struct file *f, size_t begin, size_t end,
+	     struct extent **old, int *old_count)
+{
+	*old_count = 0;
+	if (begin >= end)
+		return 0;
+	int offset;
+	int last = extent_idx(end - 1, &offset);
+	for (int idx = extent_idx(begin, &offset); idx <= last; ++idx) {
+		struct extent *e = f->extents[idx];
+		if (__atomic_load_n(&e->refs, __ATOMIC_ACQUIRE) == 1)
+			continue;
+		struct extent *copy = extent_new(idx);
+		if (copy == NULL)
+			return -1;
+		memcpy(copy->memory, e->memory, e->size);
+		f->extents[idx] = copy;
+		old[(*old_count)++] = e;
+	}
+	return 0;
+}
+
+/**
+ * Log the file, and then drop the extents it does not use anymore.
+ * Else a checkpoint could free a block, which is still in the last
+ * logged inode, and give it to another file.
+ */
+static void
+file_log_and_drop(struct file *f, struct extent **old, int old_count)
+{
+	file_log(f);
+	for (int i = 0; i < old_count; ++i)
+		extent_unref(old[i]);
+}
+
+/**
+ * Replace the data of the file with @a extents of @a size bytes.
+ * The array is owned by the file now. The write lock is needed.
+ */
+static void
+file_set_extents(struct file *f, struct extent **extents, size_t size)
+{
+	int count = extent_count(size);
+	struct extent **old = f->extents;
+	int old_count = f->extent_count;
+	f->extents = extents;
+	f->extent_count = count;
+	f->extent_capacity = count;
+	f->size = size;
+	/* The descriptors behind the new end proceed from it. */
+	for (struct filedesc *d = f->descs; d != NULL; d = d->next) {
+		if (filedesc_pos(d) > size)
+			filedesc_set_pos(d, size);
+	}
+	file_log_and_drop(f, old, old_count);
+	free(old);
+}
+
+/**
+ * Fill the bytes in [@a begin, @a end) with zeros. They must be
+ * covered by the extents.
+ */
+static void
+file_zero(struct file *f, size_t begin, size_t end)
+{
+	int offset;
+	int idx = extent_idx(begin, &offset);
+	size_t left = end - begin;
+	while (left > 0) {
+		size_t len = extent_size(idx) - offset;
+		if (len > left)
+			len = left;
+		memset(f->extents[idx]->memory + offset, 0, len);
+		left -= len;
+		offset = 0;
+		++idx;
+	}
+}
+
+/** Set the new size, with zeros in the new bytes. */
+static int
+file_grow(struct file *f, size_t size)
+{
+	struct extent *old[EXTENT_MAX_COUNT];
+	int old_count = 0;
+	int rc = 0;
+	if (file_reserve(f, size) != 0 ||
+	    file_unshare(f, f->size, size, old, &old_count) != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		rc = -1;
+	} else {
+		file_zero(f, f->size, size);
+		f->size = size;
+	}
+	file_log_and_drop(f, old, old_count);
+	return rc;
+}
+
+static ssize_t
+file_read_at(struct file *f, size_t pos, char *buf, size_t size)
+{
+	if (pos >= f->size)
+		return 0;
+	if (size > f->size - pos)
+		size = f->size - pos;
+	int offset;
+	int idx = extent_idx(pos, &offset);
+	size_t left = size;
+	while (left > 0) {
+		size_t len = extent_size(idx) - offset;
+		if (len > left)
+			len = left;
+		memcpy(buf, f->extents[idx]->memory + offset, len);
+		buf += len;
+		left -= len;
+		offset = 0;
+		++idx;
+	}
+	return size;
+}
+
+/**
+ * Write at @a pos. A gap between the file end and @a pos is filled
+ * with zeros. The write is partial, when it reaches the max file
+ * size.
+ */
+static ssize_t
+file_write_at(struct file *f, size_t pos, const char *buf, size_t size)
+{
+	if (size == 0)
+		return 0;
+	if (pos >= MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (size > MAX_FILE_SIZE - pos)
+		size = MAX_FILE_SIZE - pos;
+	size_t end = pos + size;
+	size_t begin = pos < f->size ? pos : f->size;
+	struct extent *old[EXTENT_MAX_COUNT];
+	int old_count = 0;
+	if (file_reserve(f, end) != 0 ||
+	    file_unshare(f, begin, end, old, &old_count) != 0) {
+		/* Some extents could be replaced already. */
+		if (old_count > 0)
+			file_log_and_drop(f, old, old_count);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	/* An overwrite in place does not change the metadata. */
+	bool is_changed = old_count > 0 || end > f->size;
+	if (end > f->size) {
+		if (pos > f->size)
+			file_zero(f, f->size, pos);
+		f->size = end;
+	}
+	int offset;
+	int idx = extent_idx(pos, &offset);
+	size_t left = size;
+	while (left > 0) {
+		size_t len = extent_size(idx) - offset;
+		if (len > left)
+			len = left;
+		memcpy(f->extents[idx]->memory + offset, buf, len);
+		buf += len;
+		left -= len;
+		offset = 0;
+		++idx;
+	}
+	if (is_changed)
+		file_log_and_drop(f, old, old_count);
+	return size;
+}
+
+/**
+ * Find a file by name, or create it with @a is_create. The file is
+ * returned with a new reference. Sets the error on failure.
+ */
+static struct file *
+file_acquire(const char *name, bool is_create)
+{
+	size_t len;
+	uint32_t hash = file_name_hash(name, &len);
+	struct file_shard *shard = file_shard(hash);
+	pthread_rwlock_rdlock(&shard->lock);
+	struct file *f = file_find(shard, name, hash);
+	if (f != NULL)
+		file_ref(f);
+	pthread_rwlock_unlock(&shard->lock);
+	if (f != NULL)
+		return f;
+	if (!is_create) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	if (ufs_image != NULL && len > IMAGE_NAME_MAX) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	/* Someone could create it while the lock was free. */
+	pthread_rwlock_rdlock(&file_namespace_lock);
+	pthread_rwlock_wrlock(&shard->lock);
+	f = file_find(shard, name, hash);
+	if (f == NULL)
+		f = file_new(shard, name, len, hash);
+	if (f != NULL)
+		file_ref(f);
+	pthread_rwlock_unlock(&shard->lock);
+	pthread_rwlock_unlock(&file_namespace_lock);
+	if (f == NULL)
+		ufs_error_code = UFS_ERR_NO_MEM;
+	return f;
+}
+
 int
 ufs_open(const char *filename, int flags)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+	int mode = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
+	if (mode == 0)
+		mode = UFS_READ_WRITE;
+	struct file *f = file_acquire(filename, (flags & UFS_CREATE) != 0);
+	if (f == NULL)
+		return -1;
+	struct filedesc *desc = malloc(sizeof(*desc));
+	if (desc == NULL)
+		goto error_unref;
+	desc->file = f;
+	desc->extent_idx = 0;
+	desc->offset = 0;
+	desc->mode = mode;
+	desc->prev = NULL;
+	pthread_rwlock_wrlock(&f->lock);
+	desc->next = f->descs;
+	if (f->descs != NULL)
+		f->descs->prev = desc;
+	f->descs = desc;
+	pthread_rwlock_unlock(&f->lock);
+	int fd = filedesc_alloc(desc);
+	if (fd >= 0)
+		return fd;
+
+	pthread_rwlock_wrlock(&f->lock);
+	filedesc_unlink(desc);
+	pthread_rwlock_unlock(&f->lock);
+	free(desc);
+error_unref:
+	file_unref(f);
+	ufs_error_code = UFS_ERR_NO_MEM;
 	return -1;
 }
 
 ssize_t
 ufs_write(int fd, const char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_READ_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	ssize_t rc = file_write_at(f, pos, buf, size);
+	if (rc > 0)
+		filedesc_set_pos(desc, pos + rc);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
 }
 
 ssize_t
 ufs_read(int fd, char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_WRITE_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	ssize_t rc = file_read_at(f, pos, buf, size);
+	if (rc > 0)
+		filedesc_set_pos(desc, pos + rc);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_READ_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	ssize_t rc = file_write_at(f, offset, buf, size);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_WRITE_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	ssize_t rc = file_read_at(f, offset, buf, size);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+off_t
+ufs_seek(int fd, off_t offset, int whence)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	off_t base;
+	/* The position is changed by resize under the write lock. */
+	pthread_rwlock_rdlock(&f->lock);
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = filedesc_pos(desc);
+		break;
+	case SEEK_END:
+		base = f->size;
+		break;
+	default:
+		goto error;
+	}
+	if (offset < -base || offset > MAX_FILE_SIZE - base)
+		goto error;
+	filedesc_set_pos(desc, base + offset);
+	pthread_rwlock_unlock(&f->lock);
+	return base + offset;
+error:
+	pthread_rwlock_unlock(&f->lock);
+	ufs_error_code = UFS_ERR_INVALID_ARG;
 	return -1;
 }
 
+off_t
+ufs_size(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	off_t size = f->size;
+	pthread_rwlock_unlock(&f->lock);
+	return size;
+}
+
 int
 ufs_close(int fd)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct filedesc *desc = filedesc_take(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	filedesc_unlink(desc);
+	pthread_rwlock_unlock(&f->lock);
+	free(desc);
+	file_unref(f);
+	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+	size_t len;
+	uint32_t hash = file_name_hash(filename, &len);
+	struct file_shard *shard = file_shard(hash);
+	pthread_rwlock_rdlock(&file_namespace_lock);
+	pthread_rwlock_wrlock(&shard->lock);
+	struct file *f = file_find(shard, filename, hash);
+	if (f != NULL) {
+		file_unlink(shard, f);
+		/* Before another file with the name gets an inode. */
+		pthread_rwlock_wrlock(&f->lock);
+		if (f->ino >= 0)
+			image_inode_free(ufs_image, f->ino);
+		f->ino = -1;
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+	pthread_rwlock_unlock(&file_namespace_lock);
+	if (f == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	file_unref(f);
+	return 0;
+}
+
+/** Lock two shards for write. They can be the same. */
+static void
+file_shard_lock_pair(struct file_shard *a, struct file_shard *b)
+{
+	if (a > b) {
+		struct file_shard *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	pthread_rwlock_wrlock(&a->lock);
+	if (b != a)
+		pthread_rwlock_wrlock(&b->lock);
+}
+
+static void
+file_shard_unlock_pair(struct file_shard *a, struct file_shard *b)
+{
+	if (b != a)
+		pthread_rwlock_unlock(&b->lock);
+	pthread_rwlock_unlock(&a->lock);
+}
+
+int
+ufs_rename(const char *old_name, const char *new_name)
+{
+	size_t old_len, new_len;
+	uint32_t old_hash = file_name_hash(old_name, &old_len);
+	uint32_t new_hash = file_name_hash(new_name, &new_len);
+	if (ufs_image != NULL && new_len > IMAGE_NAME_MAX) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	char *name = malloc(new_len + 1);
+	if (name == NULL) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	memcpy(name, new_name, new_len + 1);
+	struct file_shard *old_shard = file_shard(old_hash);
+	struct file_shard *new_shard = file_shard(new_hash);
+	struct file *victim = NULL;
+	int victim_ino = -1;
+	int rc = -1;
+	pthread_rwlock_rdlock(&file_namespace_lock);
+	file_shard_lock_pair(old_shard, new_shard);
+	struct file *f = file_find(old_shard, old_name, old_hash);
+	if (f == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto out;
+	}
+	victim = file_find(new_shard, new_name, new_hash);
+	if (victim == f) {
+		victim = NULL;
+		rc = 0;
+		goto out;
+	}
+	if (victim == NULL && file_table_reserve(new_shard) != 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	if (victim != NULL) {
+		file_unlink(new_shard, victim);
+		pthread_rwlock_wrlock(&victim->lock);
+		victim_ino = victim->ino;
+		victim->ino = -1;
+		pthread_rwlock_unlock(&victim->lock);
+	}
+	file_unlink(old_shard, f);
+	pthread_rwlock_wrlock(&f->lock);
+	char *tmp = f->name;
+	f->name = name;
+	name = tmp;
+	f->hash = new_hash;
+	/*
+	 * The new name and the freed inode of the replaced file are
+	 * one change, so after a crash there is exactly one file with
+	 * each name.
+	 */
+	if (f->ino >= 0 && victim_ino >= 0) {
+		int inos[2] = {f->ino, victim_ino};
+		struct image_inode inodes[2];
+		file_inode(f, &inodes[0]);
+		memset(&inodes[1], 0, sizeof(inodes[1]));
+		image_log_change(ufs_image, inos, inodes, 2);
+	} else {
+		if (victim_ino >= 0)
+			image_inode_free(ufs_image, victim_ino);
+		file_log(f);
+	}
+	pthread_rwlock_unlock(&f->lock);
+	file_table_insert(new_shard->table, new_shard->size, f);
+	++new_shard->count;
+	rc = 0;
+out:
+	file_shard_unlock_pair(old_shard, new_shard);
+	pthread_rwlock_unlock(&file_namespace_lock);
+	free(name);
+	if (victim != NULL)
+		file_unref(victim);
+	return rc;
+}
+
+int
+ufs_foreach(int (*cb)(const char *name, size_t size, void *arg), void *arg)
+{
+	int rc = 0;
+	for (int i = 0; i < FILE_SHARD_COUNT && rc == 0; ++i) {
+		struct file_shard *shard = &file_shards[i];
+		pthread_rwlock_rdlock(&shard->lock);
+		for (uint32_t j = 0; j < shard->size && rc == 0; ++j) {
+			struct file *f = shard->table[j].file;
+			if (f == NULL)
+				continue;
+			pthread_rwlock_rdlock(&f->lock);
+			size_t size = f->size;
+			pthread_rwlock_unlock(&f->lock);
+			rc = cb(f->name, size, arg);
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	return rc;
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_READ_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *f = desc->file;
+	int rc = 0;
+	pthread_rwlock_wrlock(&f->lock);
+	if (new_size >= f->size) {
+		rc = file_grow(f, new_size);
+		goto unlock;
+	}
+	/* Logged before the drop, like in file_log_and_drop(). */
+	f->size = new_size;
+	file_log(f);
+	file_truncate_extents(f, extent_count(new_size));
+	/* The descriptors behind the new end proceed from it. */
+	for (struct filedesc *d = f->descs; d != NULL; d = d->next) {
+		if (filedesc_pos(d) > new_size)
+			filedesc_set_pos(d, new_size);
+	}
+unlock:
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_WRITE_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		ssize_t rc = file_read_at(f, pos + total, iov[i].iov_base,
+					  iov[i].iov_len);
+		total += rc;
+		if ((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	filedesc_set_pos(desc, pos + total);
+	pthread_rwlock_unlock(&f->lock);
+	return total;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_READ_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_wrlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	size_t total = 0;
+	ssize_t rc = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		rc = file_write_at(f, pos + total, iov[i].iov_base,
+				   iov[i].iov_len);
+		if (rc < 0)
+			break;
+		total += rc;
+		if ((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	filedesc_set_pos(desc, pos + total);
+	pthread_rwlock_unlock(&f->lock);
+	/* A partial write is a success, like in writev(). */
+	return rc < 0 && total == 0 ? -1 : (ssize_t)total;
+}
+
+/**
+ * Fill @a view with up to @a size bytes at @a pos. The extents of
+ * the view are pinned. The file has to be locked at least for read.
+ */
+static size_t
+file_view_at(struct file *f, size_t pos, struct ufs_view *view, size_t size)
+{
+	view->iovcnt = 0;
+	if (pos >= f->size)
+		return 0;
+	if (size > f->size - pos)
+		size = f->size - pos;
+	int offset;
+	int idx = extent_idx(pos, &offset);
+	size_t total = 0;
+	while (total < size && view->iovcnt < UFS_VIEW_IOV_MAX) {
+		size_t len = extent_size(idx) - offset;
+		if (len > size - total)
+			len = size - total;
+		struct extent *e = f->extents[idx];
+		/* A write into the file will copy the extent now. */
+		extent_ref(e);
+		view->extents[view->iovcnt] = e;
+		struct iovec *iov = &view->iov[view->iovcnt++];
+		iov->iov_base = e->memory + offset;
+		iov->iov_len = len;
+		total += len;
+		offset = 0;
+		++idx;
+	}
+	return total;
+}
+
+ssize_t
+ufs_read_view(int fd, struct ufs_view *view, size_t size)
+{
+	view->iovcnt = 0;
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_WRITE_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	size_t total = file_view_at(f, pos, view, size);
+	filedesc_set_pos(desc, pos + total);
+	pthread_rwlock_unlock(&f->lock);
+	return total;
+}
+
+ssize_t
+ufs_pread_view(int fd, struct ufs_view *view, size_t size, size_t offset)
+{
+	view->iovcnt = 0;
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (desc->mode == UFS_WRITE_ONLY) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t total = file_view_at(f, offset, view, size);
+	pthread_rwlock_unlock(&f->lock);
+	return total;
+}
+
+void
+ufs_view_release(struct ufs_view *view)
+{
+	for (int i = 0; i < view->iovcnt; ++i)
+		extent_unref(view->extents[i]);
+	view->iovcnt = 0;
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	struct file *f = file_acquire(src, false);
+	if (f == NULL)
+		return -1;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t size = f->size;
+	int count = extent_count(size);
+	struct extent **extents = extent_array_dup(f->extents, count);
+	pthread_rwlock_unlock(&f->lock);
+	file_unref(f);
+	if (extents == NULL && count > 0) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	f = file_acquire(dst, true);
+	if (f == NULL) {
+		extent_array_delete(extents, count);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&f->lock);
+	file_set_extents(f, extents, size);
+	pthread_rwlock_unlock(&f->lock);
+	file_unref(f);
+	return 0;
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap)
+{
+	for (int i = 0; i < snap->file_count; ++i) {
+		struct snapshot_file *sf = snap->files[i];
+		extent_array_delete(sf->extents, extent_count(sf->size));
+		free(sf);
+	}
+	free(snap->files);
+	free(snap);
+}
+
+static struct snapshot_file *
+snapshot_file_new(struct file *f)
+{
+	size_t len = strlen(f->name);
+	struct snapshot_file *sf = malloc(sizeof(*sf) + len + 1);
+	if (sf == NULL)
+		return NULL;
+	memcpy(sf->name, f->name, len + 1);
+	sf->hash = f->hash;
+	pthread_rwlock_rdlock(&f->lock);
+	sf->size = f->size;
+	int count = extent_count(f->size);
+	sf->extents = extent_array_dup(f->extents, count);
+	pthread_rwlock_unlock(&f->lock);
+	if (sf->extents == NULL && count > 0) {
+		free(sf);
+		return NULL;
+	}
+	return sf;
+}
+
+struct ufs_snapshot *
+ufs_snapshot_create(void)
+{
+	struct ufs_snapshot *snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		goto error;
+	snap->image = ufs_image;
+	/*
+	 * No files are created or deleted meanwhile. The lookups only
+	 * read the tables, so the shard locks are not needed.
+	 */
+	pthread_rwlock_wrlock(&file_namespace_lock);
+	int count = 0;
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i)
+		count += file_shards[i].count;
+	snap->files = malloc((count > 0 ? count : 1) * sizeof(*snap->files));
+	for (int i = 0; i < FILE_SHARD_COUNT && snap->files != NULL; ++i) {
+		struct file_shard *shard = &file_shards[i];
+		for (uint32_t j = 0; j < shard->size; ++j) {
+			struct file *f = shard->table[j].file;
+			if (f == NULL)
+				continue;
+			struct snapshot_file *sf = snapshot_file_new(f);
+			if (sf == NULL)
+				goto unlock;
+			snap->files[snap->file_count++] = sf;
+		}
+	}
+unlock:
+	pthread_rwlock_unlock(&file_namespace_lock);
+	if (snap->files != NULL && snap->file_count == count)
+		return snap;
+	ufs_snapshot_delete(snap);
+error:
+	ufs_error_code = UFS_ERR_NO_MEM;
+	return NULL;
+}
+
+/** Delete the files of the table and the table itself. */
+static void
+file_table_delete(struct file_slot *table, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; ++i) {
+		if (table[i].file != NULL)
+			file_unref(table[i].file);
+	}
+	free(table);
+}
+
+/**
+ * Give the inodes of the current files to the files in @a new
+ * tables, and free the rest of them, as one change in the image.
+ * The new files are not visible yet. The namespace lock is needed
+ * for write.
+ * @retval -1 Not enough memory, or the change does not fit into the
+ *         journal. Nothing is changed.
+ */
+static int
+file_move_inodes(struct file_shard *new)
+{
+	int old_count = 0;
+	int new_count = 0;
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i) {
+		old_count += file_shards[i].count;
+		new_count += new[i].count;
+	}
+	int count = old_count > new_count ? old_count : new_count;
+	if (count == 0)
+		return 0;
+	if (count > image_change_max(ufs_image))
+		return -1;
+	int *inos = malloc(count * sizeof(*inos));
+	struct image_inode *inodes = calloc(count, sizeof(*inodes));
+	if (inos == NULL || inodes == NULL) {
+		free(inos);
+		free(inodes);
+		return -1;
+	}
+	/*
+	 * The old files stop logging one by one, and the extents they
+	 * drop meanwhile stay in the image until the change is logged.
+	 */
+	image_hold_frees(ufs_image);
+	int k = 0;
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i) {
+		struct file_shard *shard = &file_shards[i];
+		for (uint32_t j = 0; j < shard->size; ++j) {
+			struct file *f = shard->table[j].file;
+			if (f == NULL)
+				continue;
+			pthread_rwlock_wrlock(&f->lock);
+			inos[k++] = f->ino;
+			f->ino = -1;
+			pthread_rwlock_unlock(&f->lock);
+		}
+	}
+	k = 0;
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i) {
+		for (uint32_t j = 0; j < new[i].size; ++j) {
+			struct file *f = new[i].table[j].file;
+			if (f == NULL)
+				continue;
+			/*
+			 * The snapshot had not more files than the inodes,
+			 * and the old ones are reused first.
+			 */
+			if (k >= old_count)
+				inos[k] = image_inode_alloc(ufs_image);
+			f->ino = inos[k];
+			file_inode(f, &inodes[k++]);
+		}
+	}
+	image_log_change(ufs_image, inos, inodes, count);
+	image_release_frees(ufs_image);
+	free(inos);
+	free(inodes);
+	return 0;
+}
+
+int
+ufs_snapshot_restore(const struct ufs_snapshot *snap)
+{
+	/*
+	 * The tables with the new files are built aside, and then are
+	 * swapped with the current ones.
+	 */
+	if (snap->image != ufs_image) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file_shard shards[FILE_SHARD_COUNT];
+	memset(shards, 0, sizeof(shards));
+	for (int i = 0; i < snap->file_count; ++i) {
+		const struct snapshot_file *sf = snap->files[i];
+		struct file_shard *shard =
+			&shards[file_shard(sf->hash) - file_shards];
+		int count = extent_count(sf->size);
+		if (file_table_reserve(shard) != 0)
+			goto error;
+		struct file *f = file_alloc(sf->name, strlen(sf->name),
+					    sf->hash);
+		if (f == NULL)
+			goto error;
+		f->extents = extent_array_dup(sf->extents, count);
+		if (f->extents == NULL && count > 0) {
+			file_delete(f);
+			goto error;
+		}
+		f->extent_count = count;
+		f->extent_capacity = count;
+		f->size = sf->size;
+		file_table_insert(shard->table, shard->size, f);
+		++shard->count;
+	}
+	/* The shard locks are taken one by one, only for the lookups. */
+	pthread_rwlock_wrlock(&file_namespace_lock);
+	if (ufs_image != NULL && file_move_inodes(shards) != 0) {
+		pthread_rwlock_unlock(&file_namespace_lock);
+		goto error;
+	}
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i) {
+		pthread_rwlock_wrlock(&file_shards[i].lock);
+		struct file_slot *table = file_shards[i].table;
+		uint32_t size = file_shards[i].size;
+		file_shards[i].table = shards[i].table;
+		file_shards[i].size = shards[i].size;
+		file_shards[i].count = shards[i].count;
+		shards[i].table = table;
+		shards[i].size = size;
+		pthread_rwlock_unlock(&file_shards[i].lock);
+	}
+	pthread_rwlock_unlock(&file_namespace_lock);
+	/* The opened descriptors keep the replaced files alive. */
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i)
+		file_table_delete(shards[i].table, shards[i].size);
+	return 0;
+error:
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i)
+		file_table_delete(shards[i].table, shards[i].size);
+	ufs_error_code = UFS_ERR_NO_MEM;
 	return -1;
 }
+
+/** Are there opened descriptors, even of the deleted files. */
+static bool
+filedesc_is_any(void)
+{
+	pthread_mutex_lock(&file_descriptor_mutex);
+	bool rc = file_descriptor_count != file_descriptor_free_count;
+	pthread_mutex_unlock(&file_descriptor_mutex);
+	return rc;
+}
+
+static bool
+ufs_is_empty(void)
+{
+	bool is_empty = !filedesc_is_any();
+	for (int i = 0; i < FILE_SHARD_COUNT && is_empty; ++i)
+		is_empty = file_shards[i].count == 0;
+	return is_empty;
+}
+
+/** Remove all the files from the tables, but not from the image. */
+static void
+file_drop_all(void)
+{
+	for (int i = 0; i < FILE_SHARD_COUNT; ++i) {
+		struct file_shard *shard = &file_shards[i];
+		pthread_rwlock_wrlock(&shard->lock);
+		file_table_delete(shard->table, shard->size);
+		shard->table = NULL;
+		shard->size = 0;
+		shard->count = 0;
+		pthread_rwlock_unlock(&shard->lock);
+	}
+}
+
+/**
+ * Create the file of the inode. @a blocks are the extents by their
+ * first block, to share them between the clones.
+ */
+static int
+file_load(struct image *img, int ino, struct extent **blocks)
+{
+	const struct image_inode *inode = image_inode(img, ino);
+	if (inode->name_len > IMAGE_NAME_MAX ||
+	    inode->name[inode->name_len] != 0 ||
+	    inode->size > MAX_FILE_SIZE)
+		return -1;
+	size_t len;
+	uint32_t hash = file_name_hash(inode->name, &len);
+	struct file_shard *shard = file_shard(hash);
+	if (len != inode->name_len ||
+	    file_find(shard, inode->name, hash) != NULL ||
+	    file_table_reserve(shard) != 0)
+		return -1;
+	struct file *f = file_alloc(inode->name, len, hash);
+	if (f == NULL)
+		return -1;
+	f->ino = ino;
+	file_table_insert(shard->table, shard->size, f);
+	++shard->count;
+	int count = extent_count(inode->size);
+	if (count == 0)
+		return 0;
+	f->extents = malloc(count * sizeof(*f->extents));
+	if (f->extents == NULL)
+		return -1;
+	f->extent_capacity = count;
+	uint32_t block_count = image_block_count(img);
+	for (int idx = 0; idx < count; ++idx) {
+		uint32_t block = inode->extents[idx];
+		if (block >= block_count)
+			return -1;
+		struct extent *e = blocks[block];
+		if (e != NULL) {
+			if (e->size != extent_size(idx))
+				return -1;
+			extent_ref(e);
+		} else {
+			e = malloc(sizeof(*e));
+			if (e == NULL)
+				return -1;
+			e->size = extent_size(idx);
+			if (image_use(img, block, extent_order(e->size)) != 0) {
+				free(e);
+				return -1;
+			}
+			e->refs = 1;
+			e->memory = image_block(img, block);
+			e->image = img;
+			blocks[block] = e;
+		}
+		f->extents[f->extent_count++] = e;
+	}
+	f->size = inode->size;
+	return 0;
+}
+
+int
+ufs_mount(const char *path)
+{
+	if (ufs_image != NULL || !ufs_is_empty()) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	if (access(path, F_OK) != 0 &&
+	    image_format(path, IMAGE_DEFAULT_SIZE) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct image *img = image_open(path);
+	if (img == NULL) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	/*
+	 * Only the inode table is read. The data stays on the disk
+	 * until it is accessed.
+	 */
+	int rc = 0;
+	struct extent **blocks = calloc(image_block_count(img),
+					sizeof(*blocks));
+	if (blocks == NULL)
+		rc = -1;
+	uint32_t inode_count = image_inode_count(img);
+	for (uint32_t ino = 0; ino < inode_count && rc == 0; ++ino) {
+		if (image_inode(img, ino)->name_len != 0)
+			rc = file_load(img, ino, blocks);
+	}
+	free(blocks);
+	image_use_done(img);
+	if (rc != 0) {
+		file_drop_all();
+		image_close(img);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	ufs_image = img;
+	return 0;
+}
+
+int
+ufs_unmount(void)
+{
+	if (ufs_image == NULL) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	if (filedesc_is_any()) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	file_drop_all();
+	struct image *img = ufs_image;
+	ufs_image = NULL;
+	if (image_close(img) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_sync(void)
+{
+	if (ufs_image != NULL && image_sync(ufs_image) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_format(const char *path, size_t size)
+{
+	if (image_format(path, size) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
@@ -1,12 +1,40 @@
 #pragma once
 
+#include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
  * has an unique file name, and there are no directories, so the
  * FS is a monolithic flat contiguous folder.
+ *
+ * The blocks are extents of growing size, from 4KB to 2MB, so a
+ * big file takes few allocations and is read and written with long
+ * memcpy() calls. They are indexed by their number, so a read or a
+ * write at any offset takes the same time regardless of the file
+ * size. A descriptor position is an extent number and an offset in
+ * that extent.
+ *
+ * All the functions can be called from many threads at once. The
+ * error code is per thread. Readers of the same file do not block
+ * each other, and the writers of different files do not block each
+ * other either. One descriptor, with its position, is to be used by
+ * one thread at a time, and is not closed while others use it; the
+ * threads can share a descriptor with ufs_pread() and ufs_pwrite().
+ *
+ * The extents are shared between the clones of a file, the
+ * snapshots and the read views, and are copied on the first write
+ * into them. So a clone or a snapshot costs only the references to
+ * the extents, not a copy of the data.
+ *
+ * The files can be kept in an image file with ufs_mount(). Then
+ * the extents are in the mapped image, and the data is written
+ * right into it. The metadata - names, sizes and extents of the
+ * files - is changed via a journal, so after a crash each file is
+ * as it was after one of its changes, and the changes of all files
+ * survive in their order. ufs_sync() makes all the changes durable.
  */
 
 /**
@@ -24,6 +52,9 @@
  * because it is used by tests.
  */
 
+#define NEED_OPEN_FLAGS
+#define NEED_RESIZE
+
 /**
  * Flags for ufs_open call.
  */
@@ -60,6 +91,9 @@ enum ufs_error_code {
 	UFS_ERR_NO_FILE,
 	UFS_ERR_NO_MEM,
 	UFS_ERR_NOT_IMPLEMENTED,
+	UFS_ERR_INVALID_ARG,
+	/** The image file could not be read or written. */
+	UFS_ERR_IO,
 
 #ifdef NEED_OPEN_FLAGS
 
@@ -67,6 +101,32 @@ enum ufs_error_code {
 #endif
 };
 
+enum {
+	/** Max number of the pieces in one read view. */
+	UFS_VIEW_IOV_MAX = 8,
+};
+
+/**
+ * A view of a part of a file, without a copy. The memory in the
+ * view is the file memory itself, and stays valid until the view
+ * is released, even if the file is closed, deleted or truncated.
+ * The view keeps the data as it was at the read: the writes into
+ * the same part of the file go to a copy of the extent.
+ */
+struct ufs_view {
+	/**
+	 * Pieces of the file memory, in order. They can be passed to
+	 * writev() or sendmsg() as is.
+	 */
+	struct iovec iov[UFS_VIEW_IOV_MAX];
+	int iovcnt;
+	/** The pinned extents of the pieces. Private. */
+	void *extents[UFS_VIEW_IOV_MAX];
+};
+
+/** Frozen state of all the files. */
+struct ufs_snapshot;
+
 /** Get code of the last error. */
 enum ufs_error_code
 ufs_errno();
@@ -80,6 +140,8 @@ ufs_errno();
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
  *       not specified.
+ *     - UFS_ERR_NO_MEM - no memory, or no free inode in the image.
+ *     - UFS_ERR_INVALID_ARG - the name is too long for the image.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -112,6 +174,149 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at @a offset. The descriptor position is
+ * not used and not changed. If @a offset is behind the file end,
+ * the gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory, or @a offset is
+ *       beyond the max file size.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened read-only.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at @a offset. The descriptor position is
+ * not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 @a offset is at or beyond EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened write-only.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Move the descriptor position, like lseek(). The position can be
+ * behind the file end. Then reads return EOF, and a write fills
+ * the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - bad @a whence, or the new position
+ *       is negative or beyond the max file size.
+ */
+off_t
+ufs_seek(int fd, off_t offset, int whence);
+
+/**
+ * Size of the file opened by the descriptor. The position is not
+ * changed, so it can be called from many threads on one descriptor.
+ * @param fd File descriptor from ufs_open().
+ *
+ * @retval >= 0 File size.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+off_t
+ufs_size(int fd);
+
+/**
+ * Read data from the file into several buffers, like readv(). The
+ * buffers are filled in order, and the whole read is atomic with
+ * respect to the writes into the file.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened write-only.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data from several buffers into the file, like writev().
+ * The whole write is atomic with respect to the other reads and
+ * writes of the file.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written. It is less than the
+ *     total size, when the max file size or the memory ends.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - nothing was written, not enough memory.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened read-only.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read up to @a size bytes from the descriptor position without a
+ * copy. @a view gets the pointers to the file memory, and the
+ * position moves forward like with ufs_read(). Less than @a size
+ * bytes are viewed at EOF, or when the data takes more than
+ * UFS_VIEW_IOV_MAX pieces, which is at least 256KB. The view has to
+ * be released with ufs_view_release().
+ * @param fd File descriptor from ufs_open().
+ * @param view View to fill.
+ * @param size Maximum bytes to view.
+ *
+ * @retval > 0 How many bytes are in the view.
+ * @retval 0 EOF. The view is empty, releasing it is not needed.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened write-only.
+ */
+ssize_t
+ufs_read_view(int fd, struct ufs_view *view, size_t size);
+
+/**
+ * Like ufs_read_view(), but from @a offset. The descriptor position
+ * is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param view View to fill.
+ * @param size Maximum bytes to view.
+ * @param offset Position in the file to view from.
+ *
+ * @retval > 0 How many bytes are in the view.
+ * @retval 0 @a offset is at or beyond EOF. The view is empty.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is opened write-only.
+ */
+ssize_t
+ufs_pread_view(int fd, struct ufs_view *view, size_t size, size_t offset);
+
+/** Unpin the file memory of the view. The view becomes empty. */
+void
+ufs_view_release(struct ufs_view *view);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -137,6 +342,149 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Rename a file atomically. If a file with the new name exists, it
+ * is replaced, like deleted. The opened descriptors stay with the
+ * renamed file, and see the writes through each other. With a
+ * mounted image the change survives a crash as a whole.
+ *
+ * @param old_name Name of the file to rename.
+ * @param new_name New name of the file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file named @a old_name.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARG - @a new_name is too long for the image.
+ */
+int
+ufs_rename(const char *old_name, const char *new_name);
+
+/**
+ * Call @a cb with the name and the size of each file, in no order,
+ * until it returns not 0. The files created or deleted meanwhile
+ * can be missed. @a cb must not create or delete files.
+ * @param cb Function to call.
+ * @param arg Argument of @a cb.
+ *
+ * @retval The last value returned from @a cb.
+ */
+int
+ufs_foreach(int (*cb)(const char *name, size_t size, void *arg), void *arg);
+
+/**
+ * Make @a dst a copy of @a src. The data is not copied, the files
+ * share it until one of them changes it. @a dst is created, if
+ * there is no such file, or its content is replaced. Its opened
+ * descriptors behind the new size proceed from the new end.
+ *
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Save the names and the content of all the files. It takes a
+ * reference of each extent and does not copy the data. The files
+ * are not created or deleted meanwhile, and each one is saved
+ * atomically.
+ *
+ * @retval not NULL The snapshot. It has to be deleted with
+ *         ufs_snapshot_delete().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot_create(void);
+
+/**
+ * Replace all the files with the ones of the snapshot. No files
+ * are created or deleted meanwhile, but ufs_open() of an existing
+ * file can find it either replaced or not yet, until the end.
+ * The opened descriptors keep working with the replaced files,
+ * like if they were deleted. The snapshot stays valid and can be
+ * restored again. In the image the restore is one change: after a
+ * crash either all the files are replaced, or none.
+ *
+ * @param snap Snapshot from ufs_snapshot_create().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. The
+ *         files are not changed.
+ *     - UFS_ERR_NO_MEM - not enough memory, or the old or the new
+ *       files are too many for one change of the image journal.
+ *     - UFS_ERR_INVALID_ARG - the snapshot is of another mount.
+ */
+int
+ufs_snapshot_restore(const struct ufs_snapshot *snap);
+
+/** Free the snapshot. The files are not affected. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap);
+
+/**
+ * Create an empty image of @a size bytes in a file, or replace the
+ * file. The file is sparse, it takes the disk only for the data.
+ *
+ * @param path Image file.
+ * @param size Image size, at least a few MB.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the file can not be written, or @a size is too
+ *       small.
+ */
+int
+ufs_format(const char *path, size_t size);
+
+/**
+ * Keep all the files in the image at @a path. The image is mapped
+ * and its journal is replayed, the data is not read. Its files
+ * appear, and the new files are created in it. If there is no such
+ * file, it is formatted with the size of 1GB. There must be no
+ * files and no opened descriptors before the mount. The names in
+ * the image are up to 255 bytes.
+ *
+ * Mount and unmount must not be called in parallel with other
+ * functions.
+ *
+ * @param path Image file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - already mounted, or there are files.
+ *     - UFS_ERR_IO - the image can not be read, or is corrupted.
+ */
+int
+ufs_mount(const char *path);
+
+/**
+ * Flush the mounted image and remove its files from the memory.
+ * The views and the snapshots of them stay valid, but the
+ * snapshots can not be restored anymore.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - not mounted, or there are opened
+ *       descriptors.
+ *     - UFS_ERR_IO - the image is unmounted, but some changes could
+ *       not be written.
+ */
+int
+ufs_unmount(void);
+
+/**
+ * Make the data and the metadata of all the files durable in the
+ * mounted image. Nothing to do without an image.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - some changes could not be written.
+ */
+int
+ufs_sync(void);
+
 #ifdef NEED_RESIZE
 
 /**
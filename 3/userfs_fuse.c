@@ -0,0 +1,920 @@
+#define FUSE_USE_VERSION 34
+
+#include "userfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * FUSE daemon of userfs, on the low level API of libfuse 3. The
+ * flat namespace of userfs is the root directory:
+ *
+ * $> ./userfs_fuse [--image=<path>] [--direct-io] <mountpoint>
+ *
+ * Without --image the files are in the memory only. --direct-io
+ * makes the kernel skip the page cache, so each read and write
+ * reaches userfs. The requests are served by many threads, unless
+ * -s is given. On exit a histogram of the latency of each
+ * operation is printed to stderr.
+ *
+ * A FUSE inode is a node with a file name. Its number is the node
+ * address, like in the libfuse examples. An opened FUSE file is a
+ * userfs descriptor, and is read and written with ufs_pread() and
+ * ufs_pwrite(), so the threads can share it. Rename is atomic, and
+ * the descriptors opened before it stay with the renamed file.
+ */
+
+enum {
+	/** Log2 buckets of nanoseconds. */
+	STAT_BUCKET_COUNT = 40,
+	NODE_TABLE_MIN_SIZE = 1024,
+	/** Max number of the file views in one read reply. */
+	READ_VIEW_MAX = 4,
+	/**
+	 * Inode number of a listed file, which can have no node yet.
+	 * 0 would hide the entry from readdir(), so it is the same as
+	 * in the high level libfuse.
+	 */
+	DIR_UNKNOWN_INO = 0xffffffff,
+};
+
+enum stat_op {
+	STAT_LOOKUP,
+	STAT_GETATTR,
+	STAT_SETATTR,
+	STAT_CREATE,
+	STAT_OPEN,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_RELEASE,
+	STAT_UNLINK,
+	STAT_RENAME,
+	STAT_OPENDIR,
+	STAT_READDIR,
+	STAT_FSYNC,
+	STAT_OP_COUNT,
+};
+
+static const char *stat_op_names[STAT_OP_COUNT] = {
+	"lookup", "getattr", "setattr", "create", "open", "read", "write",
+	"release", "unlink", "rename", "opendir", "readdir", "fsync",
+};
+
+/** Latency histograms, updated without locks. */
+static uint64_t stat_buckets[STAT_OP_COUNT][STAT_BUCKET_COUNT];
+static uint64_t stat_total_ns[STAT_OP_COUNT];
+
+static inline uint64_t
+stat_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+stat_add(enum stat_op op, uint64_t start)
+{
+	uint64_t ns = stat_now() - start;
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	if (bucket >= STAT_BUCKET_COUNT)
+		bucket = STAT_BUCKET_COUNT - 1;
+	__atomic_add_fetch(&stat_buckets[op][bucket], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat_total_ns[op], ns, __ATOMIC_RELAXED);
+}
+
+/** Upper bound of the bucket with the @a part of the ops. */
+static uint64_t
+stat_percentile(const uint64_t *buckets, uint64_t count, double part)
+{
+	uint64_t seen = 0;
+	for (int i = 0; i < STAT_BUCKET_COUNT; ++i) {
+		seen += buckets[i];
+		if (seen >= count * part)
+			return 2ull << i;
+	}
+	return 2ull << (STAT_BUCKET_COUNT - 1);
+}
+
+static void
+stat_print(void)
+{
+	fprintf(stderr, "%-8s %10s %10s %10s %10s %10s\n", "op", "count",
+		"avg ns", "p50 <ns", "p99 <ns", "max <ns");
+	for (int op = 0; op < STAT_OP_COUNT; ++op) {
+		const uint64_t *buckets = stat_buckets[op];
+		uint64_t count = 0;
+		int max = 0;
+		for (int i = 0; i < STAT_BUCKET_COUNT; ++i) {
+			count += buckets[i];
+			if (buckets[i] != 0)
+				max = i;
+		}
+		if (count == 0)
+			continue;
+		fprintf(stderr, "%-8s %10llu %10llu %10llu %10llu %10llu\n",
+			stat_op_names[op], (unsigned long long)count,
+			(unsigned long long)(stat_total_ns[op] / count),
+			(unsigned long long)stat_percentile(buckets, count, 0.5),
+			(unsigned long long)stat_percentile(buckets, count, 0.99),
+			2ull << max);
+		/* The histogram itself, one line per non-empty bucket. */
+		for (int i = 0; i <= max; ++i) {
+			if (buckets[i] == 0)
+				continue;
+			fprintf(stderr, "    < %12llu ns: %llu\n", 2ull << i,
+				(unsigned long long)buckets[i]);
+		}
+	}
+}
+
+struct node {
+	/** Lookups of the kernel, which are not forgotten. */
+	uint64_t nlookup;
+	/** Name of the file. NULL, if it is unlinked. */
+	char *name;
+	/** Chain of the node table. */
+	struct node *next;
+};
+
+/**
+ * Nodes by name. Only the linked ones are here. The mutex also
+ * protects the names of the nodes.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	struct node **buckets;
+	size_t size;
+	size_t count;
+} nodes = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static uint32_t
+node_name_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	for (; *name != 0; ++name)
+		hash = (hash ^ (uint8_t)*name) * 16777619u;
+	return hash;
+}
+
+static inline struct node *
+node_of(fuse_ino_t ino)
+{
+	return (struct node *)(uintptr_t)ino;
+}
+
+static struct node **
+node_find(const char *name)
+{
+	if (nodes.size == 0)
+		return NULL;
+	struct node **pos = &nodes.buckets[node_name_hash(name) &
+					   (nodes.size - 1)];
+	for (; *pos != NULL; pos = &(*pos)->next) {
+		if (strcmp((*pos)->name, name) == 0)
+			return pos;
+	}
+	return NULL;
+}
+
+static int
+node_insert(struct node *n)
+{
+	if (nodes.count >= nodes.size) {
+		size_t size = nodes.size * 2;
+		if (size == 0)
+			size = NODE_TABLE_MIN_SIZE;
+		struct node **buckets = calloc(size, sizeof(*buckets));
+		if (buckets == NULL)
+			return -1;
+		for (size_t i = 0; i < nodes.size; ++i) {
+			struct node *next;
+			for (struct node *m = nodes.buckets[i]; m != NULL;
+			     m = next) {
+				next = m->next;
+				uint32_t j = node_name_hash(m->name) & (size - 1);
+				m->next = buckets[j];
+				buckets[j] = m;
+			}
+		}
+		free(nodes.buckets);
+		nodes.buckets = buckets;
+		nodes.size = size;
+	}
+	uint32_t i = node_name_hash(n->name) & (nodes.size - 1);
+	n->next = nodes.buckets[i];
+	nodes.buckets[i] = n;
+	++nodes.count;
+	return 0;
+}
+
+/** Unlink the node from its name. It lives until it is forgotten. */
+static void
+node_unlink(struct node **pos)
+{
+	struct node *n = *pos;
+	*pos = n->next;
+	--nodes.count;
+	free(n->name);
+	n->name = NULL;
+}
+
+/** The node of the name with one more lookup. */
+static struct node *
+node_lookup(const char *name)
+{
+	pthread_mutex_lock(&nodes.mutex);
+	struct node **pos = node_find(name);
+	struct node *n = pos != NULL ? *pos : NULL;
+	if (n == NULL) {
+		n = calloc(1, sizeof(*n));
+		if (n != NULL)
+			n->name = strdup(name);
+		if (n != NULL && (n->name == NULL || node_insert(n) != 0)) {
+			free(n->name);
+			free(n);
+			n = NULL;
+		}
+	}
+	if (n != NULL)
+		++n->nlookup;
+	pthread_mutex_unlock(&nodes.mutex);
+	return n;
+}
+
+static void
+node_forget(fuse_ino_t ino, uint64_t count)
+{
+	struct node *n = node_of(ino);
+	pthread_mutex_lock(&nodes.mutex);
+	n->nlookup -= count;
+	if (n->nlookup == 0) {
+		if (n->name != NULL)
+			node_unlink(node_find(n->name));
+		free(n);
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+}
+
+/**
+ * The kernel lets in names up to 1024 bytes, and userfs in the
+ * memory has no limit at all. But a node name has to fit a buffer
+ * of NAME_MAX + 1 bytes.
+ */
+static bool
+name_is_valid(const char *name)
+{
+	return strnlen(name, NAME_MAX + 1) <= NAME_MAX;
+}
+
+/**
+ * Copy the name of the node into @a name of NAME_MAX + 1 bytes. -1,
+ * if it is unlinked, or the name does not fit.
+ */
+static int
+node_name(fuse_ino_t ino, char *name)
+{
+	struct node *n = node_of(ino);
+	int rc = -1;
+	pthread_mutex_lock(&nodes.mutex);
+	if (n->name != NULL && name_is_valid(n->name)) {
+		strcpy(name, n->name);
+		rc = 0;
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+	return rc;
+}
+
+static int
+ufs_error_to_errno(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOSPC;
+	case UFS_ERR_NO_PERMISSION:
+		return EBADF;
+	case UFS_ERR_INVALID_ARG:
+		return EINVAL;
+	case UFS_ERR_NOT_IMPLEMENTED:
+		return ENOSYS;
+	default:
+		return EIO;
+	}
+}
+
+static bool is_direct_io = false;
+static time_t start_time;
+
+static void
+fill_attr(struct stat *st, fuse_ino_t ino, off_t size)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = st->st_ctime = start_time;
+	if (ino == FUSE_ROOT_ID) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return;
+	}
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blocks = (size + 511) / 512;
+}
+
+/** Size of the file with the name. */
+static off_t
+file_size(const char *name)
+{
+	int fd = ufs_open(name, UFS_READ_ONLY);
+	if (fd < 0)
+		return -1;
+	off_t size = ufs_size(fd);
+	ufs_close(fd);
+	return size;
+}
+
+/** Reply with the node of the file. The lookup is counted. */
+static void
+reply_entry(fuse_req_t req, const char *name, off_t size)
+{
+	struct node *n = node_lookup(name);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = (uintptr_t)n;
+	e.attr_timeout = 1.0;
+	e.entry_timeout = 1.0;
+	fill_attr(&e.attr, e.ino, size);
+	if (fuse_reply_entry(req, &e) != 0)
+		node_forget(e.ino, 1);
+}
+
+static void
+ufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uint64_t start = stat_now();
+	off_t size;
+	if (parent != FUSE_ROOT_ID)
+		fuse_reply_err(req, ENOENT);
+	else if (!name_is_valid(name))
+		fuse_reply_err(req, ENAMETOOLONG);
+	else if ((size = file_size(name)) < 0)
+		fuse_reply_err(req, ufs_error_to_errno());
+	else
+		reply_entry(req, name, size);
+	stat_add(STAT_LOOKUP, start);
+}
+
+static void
+ufs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void
+ufs_ll_forget_multi(fuse_req_t req, size_t count,
+		    struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; ++i)
+		node_forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void
+ufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stat_now();
+	char name[NAME_MAX + 1];
+	off_t size = 0;
+	if (fi != NULL)
+		size = ufs_size(fi->fh);
+	else if (ino != FUSE_ROOT_ID && node_name(ino, name) == 0)
+		size = file_size(name);
+	struct stat st;
+	fill_attr(&st, ino, size);
+	if (size < 0)
+		fuse_reply_err(req, ufs_error_to_errno());
+	else
+		fuse_reply_attr(req, &st, 1.0);
+	stat_add(STAT_GETATTR, start);
+}
+
+/** Only the size can be changed, the rest is accepted and ignored. */
+static void
+ufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	       int to_set, struct fuse_file_info *fi)
+{
+	uint64_t start = stat_now();
+	char name[NAME_MAX + 1];
+	int fd = fi != NULL ? (int)fi->fh : -1;
+	if (fd < 0 && node_name(ino, name) == 0)
+		fd = ufs_open(name, UFS_READ_WRITE);
+	off_t size = -1;
+	if (fd >= 0 && ((to_set & FUSE_SET_ATTR_SIZE) == 0 ||
+			ufs_resize(fd, attr->st_size) == 0))
+		size = ufs_size(fd);
+	if (size < 0) {
+		fuse_reply_err(req, fd < 0 ? ENOENT : ufs_error_to_errno());
+	} else {
+		struct stat st;
+		fill_attr(&st, ino, size);
+		fuse_reply_attr(req, &st, 1.0);
+	}
+	if (fi == NULL && fd >= 0)
+		ufs_close(fd);
+	stat_add(STAT_SETATTR, start);
+}
+
+static int
+open_flags(int flags)
+{
+	switch (flags & O_ACCMODE) {
+	case O_RDONLY:
+		return UFS_READ_ONLY;
+	case O_WRONLY:
+		return UFS_WRITE_ONLY;
+	default:
+		return UFS_READ_WRITE;
+	}
+}
+
+static void
+ufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      mode_t mode, struct fuse_file_info *fi)
+{
+	(void)mode;
+	uint64_t start = stat_now();
+	int fd = -1;
+	if (parent != FUSE_ROOT_ID) {
+		fuse_reply_err(req, EPERM);
+		goto out;
+	}
+	if (!name_is_valid(name)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		goto out;
+	}
+	fd = ufs_open(name, UFS_CREATE | open_flags(fi->flags));
+	if (fd < 0 || ((fi->flags & O_TRUNC) != 0 && ufs_resize(fd, 0) != 0)) {
+		fuse_reply_err(req, ufs_error_to_errno());
+		goto out;
+	}
+	struct node *n = node_lookup(name);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		goto out;
+	}
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = (uintptr_t)n;
+	e.attr_timeout = 1.0;
+	e.entry_timeout = 1.0;
+	fill_attr(&e.attr, e.ino, ufs_size(fd));
+	fi->fh = fd;
+	fi->direct_io = is_direct_io;
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		node_forget(e.ino, 1);
+		goto out;
+	}
+	fd = -1;
+out:
+	if (fd >= 0)
+		ufs_close(fd);
+	stat_add(STAT_CREATE, start);
+}
+
+static void
+ufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stat_now();
+	char name[NAME_MAX + 1];
+	int fd = -1;
+	if (node_name(ino, name) != 0) {
+		fuse_reply_err(req, ENOENT);
+		goto out;
+	}
+	fd = ufs_open(name, open_flags(fi->flags));
+	if (fd < 0 || ((fi->flags & O_TRUNC) != 0 && ufs_resize(fd, 0) != 0)) {
+		fuse_reply_err(req, ufs_error_to_errno());
+		goto out;
+	}
+	fi->fh = fd;
+	fi->direct_io = is_direct_io;
+	if (fuse_reply_open(req, fi) == 0)
+		fd = -1;
+out:
+	if (fd >= 0)
+		ufs_close(fd);
+	stat_add(STAT_OPEN, start);
+}
+
+static void
+ufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	    struct fuse_file_info *fi)
+{
+	(void)ino;
+	uint64_t start = stat_now();
+	/*
+	 * The reply is sent from the file memory itself. A view holds
+	 * at least 256KB, and libfuse does not ask for more than 1MB at
+	 * once, so the views are enough. The tail, if any, is copied.
+	 */
+	struct ufs_view views[READ_VIEW_MAX];
+	struct iovec iov[READ_VIEW_MAX * UFS_VIEW_IOV_MAX + 1];
+	int view_count = 0;
+	int iovcnt = 0;
+	char *tail = NULL;
+	size_t total = 0;
+	while (total < size && view_count < READ_VIEW_MAX) {
+		struct ufs_view *view = &views[view_count];
+		ssize_t rc = ufs_pread_view(fi->fh, view, size - total,
+					    offset + total);
+		if (rc < 0) {
+			fuse_reply_err(req, ufs_error_to_errno());
+			goto out;
+		}
+		if (rc == 0)
+			break;
+		++view_count;
+		memcpy(&iov[iovcnt], view->iov,
+		       view->iovcnt * sizeof(view->iov[0]));
+		iovcnt += view->iovcnt;
+		total += rc;
+	}
+	if (total < size && view_count == READ_VIEW_MAX) {
+		tail = malloc(size - total);
+		if (tail == NULL) {
+			fuse_reply_err(req, ENOMEM);
+			goto out;
+		}
+		ssize_t rc = ufs_pread(fi->fh, tail, size - total,
+				       offset + total);
+		if (rc < 0) {
+			fuse_reply_err(req, ufs_error_to_errno());
+			goto out;
+		}
+		iov[iovcnt].iov_base = tail;
+		iov[iovcnt++].iov_len = rc;
+	}
+	fuse_reply_iov(req, iov, iovcnt);
+out:
+	free(tail);
+	for (int i = 0; i < view_count; ++i)
+		ufs_view_release(&views[i]);
+	stat_add(STAT_READ, start);
+}
+
+static void
+ufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+	     off_t offset, struct fuse_file_info *fi)
+{
+	(void)ino;
+	uint64_t start = stat_now();
+	ssize_t rc = ufs_pwrite(fi->fh, buf, size, offset);
+	if (rc < 0)
+		fuse_reply_err(req, ufs_error_to_errno());
+	else
+		fuse_reply_write(req, rc);
+	stat_add(STAT_WRITE, start);
+}
+
+static void
+ufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	uint64_t start = stat_now();
+	ufs_close(fi->fh);
+	fuse_reply_err(req, 0);
+	stat_add(STAT_RELEASE, start);
+}
+
+static void
+ufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	     struct fuse_file_info *fi)
+{
+	(void)ino;
+	(void)datasync;
+	(void)fi;
+	uint64_t start = stat_now();
+	fuse_reply_err(req, ufs_sync() == 0 ? 0 : EIO);
+	stat_add(STAT_FSYNC, start);
+}
+
+static void
+ufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uint64_t start = stat_now();
+	if (parent != FUSE_ROOT_ID) {
+		fuse_reply_err(req, ENOENT);
+		goto out;
+	}
+	pthread_mutex_lock(&nodes.mutex);
+	int rc = ufs_delete(name);
+	if (rc == 0) {
+		struct node **pos = node_find(name);
+		if (pos != NULL)
+			node_unlink(pos);
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+	fuse_reply_err(req, rc == 0 ? 0 : ufs_error_to_errno());
+out:
+	stat_add(STAT_UNLINK, start);
+}
+
+static void
+ufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	      fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	uint64_t start = stat_now();
+	int err = 0;
+	if (parent != FUSE_ROOT_ID || newparent != FUSE_ROOT_ID) {
+		err = ENOENT;
+		goto out;
+	}
+	if (flags != 0) {
+		err = EINVAL;
+		goto out;
+	}
+	if (!name_is_valid(newname)) {
+		err = ENAMETOOLONG;
+		goto out;
+	}
+	char *new_name = strdup(newname);
+	if (new_name == NULL) {
+		err = ENOMEM;
+		goto out;
+	}
+	/* The nodes follow the names, under the same lock. */
+	pthread_mutex_lock(&nodes.mutex);
+	if (ufs_rename(name, newname) != 0) {
+		err = ufs_error_to_errno();
+		free(new_name);
+	} else if (strcmp(name, newname) == 0) {
+		/* The file exists, and nothing is changed. */
+		free(new_name);
+	} else {
+		struct node **pos = node_find(newname);
+		if (pos != NULL)
+			node_unlink(pos);
+		pos = node_find(name);
+		struct node *n = pos != NULL ? *pos : NULL;
+		if (n != NULL) {
+			*pos = n->next;
+			--nodes.count;
+			free(n->name);
+			n->name = new_name;
+			if (node_insert(n) != 0) {
+				/* The kernel looks it up again. */
+				free(n->name);
+				n->name = NULL;
+			}
+		} else {
+			free(new_name);
+		}
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+out:
+	fuse_reply_err(req, err);
+	stat_add(STAT_RENAME, start);
+}
+
+/**
+ * Listing of the root, taken on opendir. The entries are packed as
+ * the kernel wants them, once, and the entry number is its offset.
+ */
+struct dir_list {
+	char *buf;
+	size_t size;
+	size_t capacity;
+	/** Start of each entry in the buffer. */
+	size_t *entries;
+	off_t count;
+	off_t entry_capacity;
+	fuse_req_t req;
+};
+
+static int
+dir_list_add_entry(struct dir_list *list, const char *name, fuse_ino_t ino,
+		   mode_t mode)
+{
+	size_t len = fuse_add_direntry(list->req, NULL, 0, name, NULL, 0);
+	if (list->size + len > list->capacity) {
+		size_t capacity = list->capacity * 2;
+		if (capacity < list->size + len)
+			capacity = list->size + len + 4096;
+		char *buf = realloc(list->buf, capacity);
+		if (buf == NULL)
+			return -1;
+		list->buf = buf;
+		list->capacity = capacity;
+	}
+	if (list->count == list->entry_capacity) {
+		off_t capacity = list->entry_capacity * 2 + 64;
+		size_t *entries = realloc(list->entries,
+					  capacity * sizeof(*entries));
+		if (entries == NULL)
+			return -1;
+		list->entries = entries;
+		list->entry_capacity = capacity;
+	}
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	list->entries[list->count++] = list->size;
+	/* The offset of an entry is the number of the next one. */
+	fuse_add_direntry(list->req, list->buf + list->size, len, name, &st,
+			  list->count);
+	list->size += len;
+	return 0;
+}
+
+static int
+dir_list_add(const char *name, size_t size, void *arg)
+{
+	(void)size;
+	return dir_list_add_entry(arg, name, DIR_UNKNOWN_INO, S_IFREG);
+}
+
+static void
+dir_list_delete(struct dir_list *list)
+{
+	free(list->buf);
+	free(list->entries);
+	free(list);
+}
+
+static void
+ufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	uint64_t start = stat_now();
+	if (ino != FUSE_ROOT_ID) {
+		fuse_reply_err(req, ENOTDIR);
+		goto out;
+	}
+	struct dir_list *list = calloc(1, sizeof(*list));
+	if (list == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		goto out;
+	}
+	list->req = req;
+	if (dir_list_add_entry(list, ".", FUSE_ROOT_ID, S_IFDIR) != 0 ||
+	    dir_list_add_entry(list, "..", FUSE_ROOT_ID, S_IFDIR) != 0 ||
+	    ufs_foreach(dir_list_add, list) != 0) {
+		dir_list_delete(list);
+		fuse_reply_err(req, ENOMEM);
+		goto out;
+	}
+	fi->fh = (uintptr_t)list;
+	if (fuse_reply_open(req, fi) != 0)
+		dir_list_delete(list);
+out:
+	stat_add(STAT_OPENDIR, start);
+}
+
+static void
+ufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	       struct fuse_file_info *fi)
+{
+	(void)ino;
+	uint64_t start = stat_now();
+	struct dir_list *list = (struct dir_list *)(uintptr_t)fi->fh;
+	size_t begin = list->size;
+	size_t end = list->size;
+	if (offset >= 0 && offset < list->count) {
+		begin = list->entries[offset];
+		/* As many whole entries as fit into the size. */
+		off_t next = offset + 1;
+		while (next < list->count &&
+		       list->entries[next] - begin <= size)
+			++next;
+		end = next < list->count ? list->entries[next] : list->size;
+		if (end - begin > size)
+			end = list->entries[next - 1];
+	}
+	fuse_reply_buf(req, list->buf + begin, end - begin);
+	stat_add(STAT_READDIR, start);
+}
+
+static void
+ufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;
+	dir_list_delete((struct dir_list *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops ufs_ll_ops = {
+	.lookup = ufs_ll_lookup,
+	.forget = ufs_ll_forget,
+	.forget_multi = ufs_ll_forget_multi,
+	.getattr = ufs_ll_getattr,
+	.setattr = ufs_ll_setattr,
+	.create = ufs_ll_create,
+	.open = ufs_ll_open,
+	.read = ufs_ll_read,
+	.write = ufs_ll_write,
+	.release = ufs_ll_release,
+	.fsync = ufs_ll_fsync,
+	.unlink = ufs_ll_unlink,
+	.rename = ufs_ll_rename,
+	.opendir = ufs_ll_opendir,
+	.readdir = ufs_ll_readdir,
+	.releasedir = ufs_ll_releasedir,
+};
+
+struct options {
+	const char *image;
+	int direct_io;
+};
+
+static const struct fuse_opt option_spec[] = {
+	{"--image=%s", offsetof(struct options, image), 1},
+	{"--direct-io", offsetof(struct options, direct_io), 1},
+	FUSE_OPT_END,
+};
+
+int
+main(int argc, char **argv)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct options options;
+	memset(&options, 0, sizeof(options));
+	if (fuse_opt_parse(&args, &options, option_spec, NULL) != 0)
+		return 1;
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	int rc = 1;
+	if (opts.show_help || opts.mountpoint == NULL) {
+		printf("usage: %s [--image=<path>] [--direct-io] [options] "
+		       "<mountpoint>\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		rc = opts.show_help ? 0 : 1;
+		goto out_args;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		rc = 0;
+		goto out_args;
+	}
+	is_direct_io = options.direct_io;
+	start_time = time(NULL);
+	if (options.image != NULL && ufs_mount(options.image) != 0) {
+		fprintf(stderr, "can not mount the image %s\n", options.image);
+		goto out_args;
+	}
+	struct fuse_session *se =
+		fuse_session_new(&args, &ufs_ll_ops, sizeof(ufs_ll_ops), NULL);
+	if (se == NULL)
+		goto out_unmount;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		rc = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config;
+		memset(&config, 0, sizeof(config));
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		rc = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+	stat_print();
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_session:
+	fuse_session_destroy(se);
+out_unmount:
+	/* All the files are released by the kernel by now. */
+	if (options.image != NULL && ufs_unmount() != 0)
+		fprintf(stderr, "the image is not flushed\n");
+out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return rc != 0 ? 1 : 0;
+}